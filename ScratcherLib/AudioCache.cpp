@@ -0,0 +1,388 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <filesystem>
+#include <functional>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "AudioCache.h"
+#include "TrackBuffer.h"
+#include "TrackSummary.h"
+
+namespace fs = std::filesystem;
+
+static const char s_magic[8] = { 'S', 'C', 'R', 'P', 'C', 'M', '\0', '\0' };
+static const uint32_t s_version = 2;
+
+// the samples start on a page boundary of the file
+static const uint64_t s_data_align = 4096;
+
+// frames read from the track at a time when storing
+static const unsigned s_store_chunk = 65536;
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t rate;
+	uint32_t chn;
+	uint32_t length;
+
+	// the key, followed by path_size bytes of the source path
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+	uint32_t path_size;
+
+	// length * chn floats from data_offset, then num_levels counts of floats and
+	// the levels of the summary from levels_offset
+	uint32_t num_levels;
+	uint64_t data_offset;
+	uint64_t levels_offset;
+	float peak[2];
+	float rms[2];
+};
+
+struct CacheKey
+{
+	std::string path;
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	uint64_t hash = 0;
+};
+
+static std::mutex s_dir_mutex;
+static std::string s_dir;
+
+void AudioCache::s_set_directory(const char* dir)
+{
+	std::lock_guard<std::mutex> lock(s_dir_mutex);
+	s_dir = dir != nullptr ? dir : "";
+}
+
+std::string AudioCache::s_directory()
+{
+	std::lock_guard<std::mutex> lock(s_dir_mutex);
+	return s_dir;
+}
+
+// 64-bit FNV-1a
+static const uint64_t s_fnv_offset = 14695981039346656037ull;
+static const uint64_t s_fnv_prime = 1099511628211ull;
+
+static uint64_t s_fnv(uint64_t h, const uint8_t* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= data[i];
+		h *= s_fnv_prime;
+	}
+	return h;
+}
+
+static bool s_seek(FILE* fp, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(fp, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// The content hash samples the source instead of reading all of it: the size, a block at
+// the head and one at the tail, and blocks spread evenly in between. An edit that keeps
+// the size and the time and misses every block goes unnoticed. Smaller files are hashed whole.
+static const uint64_t s_hash_block = 64 * 1024;
+static const uint64_t s_hash_num_blocks = 16;
+
+static bool s_hash_file(const char* fileName, uint64_t size, uint64_t& hash)
+{
+	FILE* fp = fopen(fileName, "rb");
+	if (fp == nullptr) return false;
+	std::vector<uint8_t> buf((size_t)s_hash_block);
+	hash = s_fnv(s_fnv_offset, (const uint8_t*)&size, sizeof(size));
+	bool ok = true;
+	if (size <= s_hash_block * s_hash_num_blocks)
+	{
+		size_t n;
+		while ((n = fread(buf.data(), 1, buf.size(), fp)) > 0)
+			hash = s_fnv(hash, buf.data(), n);
+	}
+	else
+	{
+		// block k starts k / (s_hash_num_blocks - 1) of the way to the last one
+		for (uint64_t k = 0; ok && k < s_hash_num_blocks; k++)
+		{
+			uint64_t offset = (size - s_hash_block) / (s_hash_num_blocks - 1) * k;
+			if (k == s_hash_num_blocks - 1) offset = size - s_hash_block;
+			ok = s_seek(fp, offset) && fread(buf.data(), 1, buf.size(), fp) == buf.size();
+			if (ok) hash = s_fnv(hash, buf.data(), buf.size());
+		}
+	}
+	fclose(fp);
+	return ok;
+}
+
+// Path, size and time of the source, the hash only when asked as it reads the source
+static bool s_get_key(const char* fileName, bool with_hash, CacheKey& key)
+{
+	std::error_code ec;
+	fs::path path = fs::absolute(fs::u8path(fileName), ec);
+	if (ec) return false;
+	key.path = path.lexically_normal().u8string();
+	key.size = (uint64_t)fs::file_size(path, ec);
+	if (ec) return false;
+	fs::file_time_type mtime = fs::last_write_time(path, ec);
+	if (ec) return false;
+	key.mtime = (int64_t)mtime.time_since_epoch().count();
+	return !with_hash || s_hash_file(fileName, key.size, key.hash);
+}
+
+static std::string s_entry_name(const std::string& dir, const CacheKey& key)
+{
+	uint64_t h = s_fnv(s_fnv_offset, (const uint8_t*)key.path.data(), key.path.size());
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.pcm", (unsigned long long)h);
+	return (fs::u8path(dir) / name).u8string();
+}
+
+// A read-only mapping of a whole file
+class MappedFile
+{
+public:
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (m_data != nullptr) UnmapViewOfFile(m_data);
+#else
+		if (m_data != nullptr) munmap((void*)m_data, m_size);
+#endif
+	}
+
+	bool open(const std::string& fileName)
+	{
+#ifdef _WIN32
+		HANDLE file = CreateFileW(fs::u8path(fileName).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return false;
+		}
+		HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (mapping == nullptr) return false;
+		m_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		m_size = (size_t)size.QuadPart;
+		return m_data != nullptr;
+#else
+		int fd = ::open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+		void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) return false;
+		m_data = (const uint8_t*)data;
+		m_size = (size_t)st.st_size;
+		return true;
+#endif
+	}
+
+	const uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+};
+
+// Samples of a track read straight from a mapped cache entry
+class MappedSource : public TrackBuffer::Source
+{
+public:
+	MappedSource(MappedFile* file, uint64_t data_offset, unsigned chn)
+		: m_file(file), m_samples((const float*)(file->data() + data_offset)), m_chn(chn)
+	{
+	}
+
+	~MappedSource()
+	{
+		delete m_file;
+	}
+
+	virtual void Read(unsigned pos, unsigned count, float* data)
+	{
+		memcpy(data, m_samples + (size_t)pos * m_chn, sizeof(float) * count * m_chn);
+	}
+
+	virtual bool Persistent() const { return true; }
+
+private:
+	MappedFile* m_file;
+	const float* m_samples;
+	unsigned m_chn;
+};
+
+TrackBuffer* AudioCache::s_open(const char* fileName)
+{
+	std::string dir = s_directory();
+	if (dir.empty()) return nullptr;
+
+	CacheKey key;
+	if (!s_get_key(fileName, false, key)) return nullptr;
+
+	MappedFile* file = new MappedFile;
+	if (!file->open(s_entry_name(dir, key)) || file->size() < sizeof(CacheHeader))
+	{
+		delete file;
+		return nullptr;
+	}
+
+	// the cheap part of the key first, the hash only when all else matches
+	CacheHeader h;
+	memcpy(&h, file->data(), sizeof(CacheHeader));
+	uint64_t data_size = (uint64_t)h.length * h.chn * sizeof(float);
+	bool valid = memcmp(h.magic, s_magic, sizeof(s_magic)) == 0 && h.version == s_version
+		&& (h.chn == 1 || h.chn == 2) && h.source_size == key.size && h.source_mtime == key.mtime
+		&& h.path_size == key.path.size() && sizeof(CacheHeader) + h.path_size <= file->size()
+		&& memcmp(file->data() + sizeof(CacheHeader), key.path.data(), key.path.size()) == 0
+		&& h.data_offset % sizeof(float) == 0 && h.data_offset + data_size <= file->size()
+		&& h.levels_offset + (uint64_t)h.num_levels * sizeof(uint64_t) <= file->size();
+	valid = valid && s_hash_file(fileName, key.size, key.hash) && h.source_hash == key.hash;
+
+	// the summary, copied out of the mapping
+	std::vector<std::vector<float>> levels(valid ? h.num_levels : 0);
+	uint64_t pos = h.levels_offset + (uint64_t)h.num_levels * sizeof(uint64_t);
+	for (uint32_t i = 0; valid && i < h.num_levels; i++)
+	{
+		uint64_t count;
+		memcpy(&count, file->data() + h.levels_offset + i * sizeof(uint64_t), sizeof(uint64_t));
+		valid = count <= (file->size() - pos) / sizeof(float);
+		if (!valid) break;
+		levels[i].resize((size_t)count);
+		memcpy(levels[i].data(), file->data() + pos, (size_t)count * sizeof(float));
+		pos += count * sizeof(float);
+	}
+	if (!valid)
+	{
+		delete file;
+		return nullptr;
+	}
+
+	TrackSummary* summary = new TrackSummary(h.chn);
+	summary->set(h.length, h.peak, h.rms, levels);
+
+	TrackBuffer* track = new TrackBuffer(new MappedSource(file, h.data_offset, h.chn), h.rate, h.chn, h.length);
+	track->SetSummary(summary);
+	return track;
+}
+
+bool AudioCache::s_store(const char* fileName, TrackBuffer* track)
+{
+	std::string dir = s_directory();
+	if (dir.empty()) return false;
+
+	CacheKey key;
+	if (!s_get_key(fileName, true, key)) return false;
+
+	std::error_code ec;
+	fs::create_directories(fs::u8path(dir), ec);
+	std::string entry = s_entry_name(dir, key);
+
+	// written aside and renamed over the entry, so a reader never maps half of it
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%llx.tmp", (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+	std::string tmp = entry + suffix;
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (fp == nullptr) return false;
+
+	unsigned chn = track->NumberOfChannels();
+	unsigned length = track->NumberOfSamples();
+
+	CacheHeader h;
+	memset(&h, 0, sizeof(CacheHeader));
+	memcpy(h.magic, s_magic, sizeof(s_magic));
+	h.version = s_version;
+	h.rate = track->Rate();
+	h.chn = chn;
+	h.length = length;
+	h.source_size = key.size;
+	h.source_mtime = key.mtime;
+	h.source_hash = key.hash;
+	h.path_size = (uint32_t)key.path.size();
+	h.data_offset = (sizeof(CacheHeader) + h.path_size + s_data_align - 1) / s_data_align * s_data_align;
+
+	bool ok = fwrite(&h, sizeof(CacheHeader), 1, fp) == 1;
+	ok = ok && fwrite(key.path.data(), 1, key.path.size(), fp) == key.path.size();
+	std::vector<uint8_t> pad((size_t)(h.data_offset - sizeof(CacheHeader) - h.path_size), 0);
+	ok = ok && fwrite(pad.data(), 1, pad.size(), fp) == pad.size();
+
+	TrackSummary* summary = new TrackSummary(chn);
+	std::vector<float> buf(s_store_chunk * chn);
+	for (unsigned pos = 0; ok && pos < length; pos += s_store_chunk)
+	{
+		unsigned count = std::min(s_store_chunk, length - pos);
+		track->GetSamples(pos, count, buf.data());
+		summary->add(buf.data(), count);
+		ok = fwrite(buf.data(), sizeof(float), count * chn, fp) == count * chn;
+	}
+	summary->finish();
+
+	h.num_levels = summary->num_levels();
+	h.levels_offset = h.data_offset + (uint64_t)length * chn * sizeof(float);
+	for (unsigned c = 0; c < chn; c++)
+	{
+		h.peak[c] = summary->peak(c);
+		h.rms[c] = summary->rms(c);
+	}
+	for (unsigned i = 0; ok && i < h.num_levels; i++)
+	{
+		uint64_t count = summary->level(i).size();
+		ok = fwrite(&count, sizeof(uint64_t), 1, fp) == 1;
+	}
+	for (unsigned i = 0; ok && i < h.num_levels; i++)
+	{
+		const std::vector<float>& level = summary->level(i);
+		ok = fwrite(level.data(), sizeof(float), level.size(), fp) == level.size();
+	}
+	ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(CacheHeader), 1, fp) == 1;
+	ok = fclose(fp) == 0 && ok;
+
+	if (ok)
+	{
+		fs::rename(fs::u8path(tmp), fs::u8path(entry), ec);
+		ok = !ec;
+	}
+	if (!ok)
+	{
+		fs::remove(fs::u8path(tmp), ec);
+		delete summary;
+		return false;
+	}
+
+	if (track->Summary() == nullptr)
+		track->SetSummary(summary);
+	else
+		delete summary;
+	return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+class TrackBuffer;
+
+// On-disk cache of decoded tracks, so that reopening a file maps the decoded samples
+// instead of decoding it again. One file per source path in the cache directory holds
+// the raw interleaved floats, the TrackSummary of the track and the key it was decoded
+// from: the path, size, modification time and a hash of the contents of the source,
+// taken over blocks spread through it.
+class AudioCache
+{
+public:
+	// Directory of the cache files, created when first stored to. Empty, the default,
+	// disables the cache.
+	static void s_set_directory(const char* dir);
+	static std::string s_directory();
+
+	// The decoded track of fileName mapped from the cache, with its summary set, or
+	// nullptr when the cache is disabled, has no entry or the source changed since.
+	static TrackBuffer* s_open(const char* fileName);
+
+	// Stores the complete decoded track of fileName, replacing any entry for it, and
+	// sets its summary when it has none. Reads the track on the calling thread.
+	static bool s_store(const char* fileName, TrackBuffer* track);
+};
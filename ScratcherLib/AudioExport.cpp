@@ -0,0 +1,392 @@
+#include <cstring>
+#include <cctype>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include "AudioExport.h"
+#include "AudioReadWrite.h"
+#include "Sampler.h"
+
+inline double time_sec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// buffer of the writes to a WAV or raw file
+static const size_t s_file_buffer = 1 << 20;
+
+int ExportFormatFromName(const char* fileName)
+{
+	std::string name = fileName;
+	size_t dot = name.find_last_of('.');
+	std::string ext = dot != std::string::npos ? name.substr(dot + 1) : "";
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return (char)tolower(c); });
+	if (ext == "flac") return Export_FLAC;
+	if (ext == "wav") return Export_WAV;
+	if (ext == "raw" || ext == "pcm") return Export_Raw;
+	return Export_MP3;
+}
+
+AudioWriter* CreateAudioWriter(const char* fileName, unsigned sample_rate, const ExportOptions& options)
+{
+	switch (options.format)
+	{
+	case Export_FLAC:
+		return AudioEncoder::s_open_flac(fileName, sample_rate, options.bits, options.dither);
+	case Export_WAV:
+		return PcmFileWriter::s_open(fileName, sample_rate, options.bits, true, options.dither);
+	case Export_Raw:
+		return PcmFileWriter::s_open(fileName, sample_rate, options.bits, false, options.dither);
+	default:
+		if (options.threads != 1)
+			return ParallelMp3Encoder::s_open(fileName, sample_rate, options.bit_rate, options.threads);
+		return AudioEncoder::s_open(fileName, sample_rate, options.bit_rate);
+	}
+}
+
+void WriteWavHeader(FILE* fp, unsigned sample_rate, int bits, uint64_t num_frames)
+{
+	uint16_t bytes = (uint16_t)(bits / 8);
+	uint32_t rate = sample_rate;
+	uint64_t data_size64 = num_frames * bytes * 2;
+	uint32_t data_size = data_size64 > 0xffffffffull - 36 ? 0xffffffffu - 36 : (uint32_t)data_size64;
+	uint32_t riff_size = 36 + data_size;
+	uint32_t fmt_size = 16;
+	uint16_t format = bits == 32 ? 3 : 1; // IEEE float or PCM
+	uint16_t channels = 2;
+	uint32_t byte_rate = rate * bytes * 2;
+	uint16_t block_align = bytes * 2;
+	uint16_t bits_per_sample = (uint16_t)bits;
+
+	fwrite("RIFF", 1, 4, fp);
+	fwrite(&riff_size, 4, 1, fp);
+	fwrite("WAVEfmt ", 1, 8, fp);
+	fwrite(&fmt_size, 4, 1, fp);
+	fwrite(&format, 2, 1, fp);
+	fwrite(&channels, 2, 1, fp);
+	fwrite(&rate, 4, 1, fp);
+	fwrite(&byte_rate, 4, 1, fp);
+	fwrite(&block_align, 2, 1, fp);
+	fwrite(&bits_per_sample, 2, 1, fp);
+	fwrite("data", 1, 4, fp);
+	fwrite(&data_size, 4, 1, fp);
+}
+
+// TPDF dither of sample n, in steps of the last bit: the difference of two uniform
+// values taken from a hash of n, so that the conversion loop carries no state
+inline float s_tpdf(uint32_t n)
+{
+	n ^= n >> 16;
+	n *= 0x7feb352du;
+	n ^= n >> 15;
+	n *= 0x846ca68bu;
+	n ^= n >> 16;
+	return (float)(int32_t)(n & 0xffff) * (1.0f / 65536.0f) - (float)(int32_t)(n >> 16) * (1.0f / 65536.0f);
+}
+
+// Scales count samples to bits-bit integers, rounded to nearest, computing in T:
+// float is exact enough for 16 bits, 24 bits take double. Written for the compiler
+// to vectorize.
+template <typename T>
+static void s_to_ints(const float* in, size_t count, int bits, bool dither, uint64_t index, int32_t* out)
+{
+	T scale = (T)((1 << (bits - 1)) - 1);
+	T lo = -scale - (T)1;
+	if (dither)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			T v = (T)in[i] * scale + (T)s_tpdf((uint32_t)(index + i));
+			v = v < lo ? lo : (v > scale ? scale : v);
+			out[i] = (int32_t)(v + (v >= (T)0 ? (T)0.5 : (T)-0.5));
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			T v = (T)in[i] * scale;
+			v = v < lo ? lo : (v > scale ? scale : v);
+			out[i] = (int32_t)(v + (v >= (T)0 ? (T)0.5 : (T)-0.5));
+		}
+	}
+}
+
+PcmFileWriter* PcmFileWriter::s_open(const char* fileName, unsigned sample_rate, int bits, bool wav, bool dither)
+{
+	if (bits != 16 && bits != 24) bits = 32;
+	FILE* fp = fopen(fileName, "wb");
+	if (fp == nullptr)
+	{
+		printf("Failed writing %s\n", fileName);
+		return nullptr;
+	}
+	setvbuf(fp, nullptr, _IOFBF, s_file_buffer);
+
+	PcmFileWriter* writer = new PcmFileWriter;
+	writer->m_fp = fp;
+	writer->m_sample_rate = sample_rate;
+	writer->m_bits = bits;
+	writer->m_wav = wav;
+	writer->m_dither = dither;
+	if (wav) WriteWavHeader(fp, sample_rate, bits, 0);
+	return writer;
+}
+
+PcmFileWriter::~PcmFileWriter()
+{
+	close();
+}
+
+bool PcmFileWriter::write(const float* frames, unsigned count)
+{
+	if (m_fp == nullptr) return false;
+	size_t n = (size_t)count * 2;
+	if (m_bits == 32)
+	{
+		m_ok = m_ok && fwrite(frames, sizeof(float), n, m_fp) == n;
+	}
+	else
+	{
+		m_ints.resize(n);
+		if (m_bits == 16)
+			s_to_ints<float>(frames, n, m_bits, m_dither, m_frames * 2, m_ints.data());
+		else
+			s_to_ints<double>(frames, n, m_bits, m_dither, m_frames * 2, m_ints.data());
+		size_t bytes = (size_t)(m_bits / 8);
+		m_bytes.resize(n * bytes);
+		uint8_t* b = m_bytes.data();
+		if (m_bits == 16)
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				int16_t v = (int16_t)m_ints[i];
+				memcpy(b + i * 2, &v, 2);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				uint32_t v = (uint32_t)m_ints[i];
+				b[i * 3] = (uint8_t)v;
+				b[i * 3 + 1] = (uint8_t)(v >> 8);
+				b[i * 3 + 2] = (uint8_t)(v >> 16);
+			}
+		}
+		m_ok = m_ok && fwrite(b, 1, m_bytes.size(), m_fp) == m_bytes.size();
+	}
+	m_frames += count;
+	return m_ok;
+}
+
+bool PcmFileWriter::close()
+{
+	if (m_fp == nullptr) return false;
+	if (m_wav)
+	{
+		m_ok = m_ok && fseek(m_fp, 0, SEEK_SET) == 0;
+		if (m_ok) WriteWavHeader(m_fp, m_sample_rate, m_bits, m_frames);
+	}
+	m_ok = fclose(m_fp) == 0 && m_ok;
+	m_fp = nullptr;
+	return m_ok;
+}
+
+// A ring of blocks of stereo frames from one producer to num_readers readers, each
+// reading every block. A block is written over once all readers are done with it.
+class BlockQueue
+{
+public:
+	BlockQueue(int block_size, int num_blocks, int num_readers)
+		: m_blocks(num_blocks, std::vector<float>((size_t)block_size * 2)), m_counts(num_blocks, 0), m_read(num_readers, 0)
+	{
+	}
+
+	// the next block to render into, once free
+	float* begin_write()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!_free())
+		{
+			m_waits++;
+			while (!_free())
+				m_freed.wait(lock);
+		}
+		return m_blocks[m_written % m_blocks.size()].data();
+	}
+
+	void end_write(int count)
+	{
+		if (count <= 0) return;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_counts[m_written % m_blocks.size()] = count;
+		m_written++;
+		m_filled.notify_all();
+	}
+
+	// no more blocks
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_finished = true;
+		m_filled.notify_all();
+	}
+
+	// The next block for reader r, nullptr after the last one
+	const float* begin_read(int r, int& count)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_read[r] == m_written && !m_finished)
+			m_filled.wait(lock);
+		if (m_read[r] == m_written) return nullptr;
+		size_t b = m_read[r] % m_blocks.size();
+		count = m_counts[b];
+		return m_blocks[b].data();
+	}
+
+	void end_read(int r)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_read[r]++;
+		m_freed.notify_all();
+	}
+
+	unsigned num_waits() const { return m_waits; }
+
+private:
+	std::vector<std::vector<float>> m_blocks;
+	std::vector<int> m_counts;
+	uint64_t m_written = 0;
+	std::vector<uint64_t> m_read;
+	bool m_finished = false;
+	unsigned m_waits = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_filled;
+	std::condition_variable m_freed;
+
+	bool _free() const
+	{
+		for (size_t r = 0; r < m_read.size(); r++)
+		{
+			if (m_written - m_read[r] >= m_blocks.size()) return false;
+		}
+		return true;
+	}
+};
+
+ExportJob::ExportJob(Sampler& sampler, unsigned sample_rate) : m_sampler(sampler), m_sample_rate(sample_rate)
+{
+}
+
+ExportJob::~ExportJob()
+{
+	for (size_t k = 0; k < m_owned.size(); k++)
+		delete m_owned[k];
+}
+
+void ExportJob::add(AudioWriter* writer, unsigned sample_rate)
+{
+	if (sample_rate != 0 && sample_rate != m_sample_rate)
+	{
+		writer = new ResampleWriter(writer, m_sample_rate, sample_rate);
+		m_owned.push_back(writer);
+	}
+	m_writers.push_back(writer);
+	m_ok.push_back(false);
+}
+
+bool ExportJob::run(ExportStats* stats, int block_size, int num_blocks)
+{
+	double t0 = time_sec();
+	m_sampler.set_sample_rate(m_sample_rate);
+
+	size_t num_writers = m_writers.size();
+	BlockQueue queue(block_size, num_blocks, (int)num_writers);
+	std::vector<std::atomic<bool>> failed(num_writers);
+	std::atomic<size_t> num_failed(0);
+	std::vector<double> write_times(num_writers, 0.0);
+	std::vector<std::thread> threads;
+	for (size_t k = 0; k < num_writers; k++)
+	{
+		failed[k] = false;
+		threads.push_back(std::thread([&, k]()
+		{
+			AudioWriter* writer = m_writers[k];
+			int count;
+			const float* block;
+			double write_time = 0.0;
+			while ((block = queue.begin_read((int)k, count)) != nullptr)
+			{
+				// after a failure the rest is only taken off the queue
+				if (!failed[k])
+				{
+					double t = time_sec();
+					if (!writer->write(block, (unsigned)count))
+					{
+						failed[k] = true;
+						num_failed++;
+					}
+					write_time += time_sec() - t;
+				}
+				queue.end_read((int)k);
+			}
+			double t = time_sec();
+			if (!writer->close() && !failed[k])
+			{
+				failed[k] = true;
+				num_failed++;
+			}
+			write_times[k] = write_time + time_sec() - t;
+		}));
+	}
+
+	// rendered while any writer is still taking it
+	uint64_t frames = 0;
+	double render_time = 0.0;
+	while (num_failed < num_writers)
+	{
+		float* block = queue.begin_write();
+		double t = time_sec();
+		int n = m_sampler.get_samples((int)frames, block_size, block);
+		render_time += time_sec() - t;
+		queue.end_write(n);
+		frames += (uint64_t)n;
+		if (n < block_size) break;
+	}
+	queue.finish();
+	for (size_t k = 0; k < num_writers; k++)
+		threads[k].join();
+
+	bool ok = true;
+	double write_time = 0.0;
+	for (size_t k = 0; k < num_writers; k++)
+	{
+		m_ok[k] = !failed[k];
+		ok = ok && m_ok[k];
+		write_time = std::max(write_time, write_times[k]);
+	}
+
+	if (stats != nullptr)
+	{
+		stats->frames = frames;
+		stats->render_time = render_time;
+		stats->write_time = write_time;
+		stats->wall_time = time_sec() - t0;
+		stats->render_waits = queue.num_waits();
+	}
+	return ok;
+}
+
+bool ExportAudio(Sampler& sampler, unsigned sample_rate, AudioWriter* writer, ExportStats* stats, int block_size, int num_blocks)
+{
+	ExportJob job(sampler, sample_rate);
+	job.add(writer);
+	return job.run(stats, block_size, num_blocks);
+}
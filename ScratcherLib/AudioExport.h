@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+class Sampler;
+
+// Takes the interleaved stereo frames of an export as they are rendered.
+class AudioWriter
+{
+public:
+	virtual ~AudioWriter() {}
+	virtual bool write(const float* frames, unsigned count) = 0;
+
+	// After the last write, flushes and finishes the file.
+	virtual bool close() = 0;
+};
+
+enum ExportFormat
+{
+	Export_MP3,
+	Export_FLAC,
+	Export_WAV,
+	Export_Raw	// interleaved samples without a header
+};
+
+struct ExportOptions
+{
+	int format = Export_MP3;
+	int bit_rate = 192000;	// MP3 only
+	int threads = 1;	// MP3 encoded in segments on this many threads when not 1, 0 for one per core
+	int bits = 32;	// 16, 24 or 32 for float; FLAC takes 16 or 24
+	bool dither = true;	// TPDF dither when reducing to 16 or 24 bits
+};
+
+// ExportFormat of the file extension, MP3 for any other
+int ExportFormatFromName(const char* fileName);
+
+// The writer of the format, nullptr when the file cannot be written
+AudioWriter* CreateAudioWriter(const char* fileName, unsigned sample_rate, const ExportOptions& options);
+
+// Writes frames straight to a WAV or raw file, as floats or as 16 or 24-bit integers,
+// through large buffered writes.
+class PcmFileWriter : public AudioWriter
+{
+public:
+	// nullptr when the file cannot be created
+	static PcmFileWriter* s_open(const char* fileName, unsigned sample_rate, int bits = 32, bool wav = true, bool dither = true);
+
+	// closes the file when still open
+	~PcmFileWriter();
+
+	virtual bool write(const float* frames, unsigned count);
+
+	// fills in the sizes of the WAV header
+	virtual bool close();
+
+private:
+	PcmFileWriter() {}
+
+	FILE* m_fp = nullptr;
+	unsigned m_sample_rate = 0;
+	int m_bits = 32;
+	bool m_wav = true;
+	bool m_dither = true;
+	bool m_ok = true;
+	uint64_t m_frames = 0;
+	std::vector<int32_t> m_ints;
+	std::vector<uint8_t> m_bytes;
+};
+
+// The 44-byte header of a stereo WAV file of num_frames frames, 32-bit float or integer
+void WriteWavHeader(FILE* fp, unsigned sample_rate, int bits, uint64_t num_frames);
+
+struct ExportStats
+{
+	uint64_t frames = 0;
+	double render_time = 0.0; // seconds in the sampler
+	double write_time = 0.0; // seconds in the writer, the slowest one of several
+	double wall_time = 0.0;
+	unsigned render_waits = 0; // blocks the renderer waited on a full queue for
+};
+
+// Renders a sampler once into several writers, each writing on a thread of its own
+// from a queue of blocks shared by all, so the slowest writer sets the pace.
+class ExportJob
+{
+public:
+	ExportJob(Sampler& sampler, unsigned sample_rate);
+	~ExportJob();
+
+	// Adds a writer taking the frames at sample_rate, 0 for the rate rendered at.
+	// Other rates are resampled on the writer's thread. The writer stays the caller's.
+	void add(AudioWriter* writer, unsigned sample_rate = 0);
+
+	// Renders up to the end of the sampler, or until every writer failed, and closes
+	// the writers. Fails when any writer did.
+	bool run(ExportStats* stats = nullptr, int block_size = 4096, int num_blocks = 16);
+
+	size_t num_writers() const { return m_writers.size(); }
+	bool succeeded(size_t k) const { return m_ok[k]; }
+
+private:
+	Sampler& m_sampler;
+	unsigned m_sample_rate;
+	std::vector<AudioWriter*> m_writers;
+	std::vector<AudioWriter*> m_owned;
+	std::vector<bool> m_ok;
+};
+
+// Renders the sampler at sample_rate into the writer until its end, without keeping
+// the output: blocks of block_size frames are rendered on the calling thread and
+// written on another, through a queue of num_blocks blocks. Closes the writer.
+bool ExportAudio(Sampler& sampler, unsigned sample_rate, AudioWriter* writer, ExportStats* stats = nullptr, int block_size = 4096, int num_blocks = 16);
@@ -1,5 +1,12 @@
+#include <cstdint>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+#include <memory.h>
 #include "TrackBuffer.h"
 #include "AudioReadWrite.h"
+#include "AudioCache.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -7,6 +14,7 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/log.h>
 #include <libavutil/opt.h>
+#include <libavutil/intreadwrite.h>
 #include <libswresample/swresample.h>
 }
 
@@ -23,9 +31,346 @@ inline bool exists_test(const char* name)
 	}
 }
 
+// Converts a decoded frame to interleaved stereo float in conv, reused for the whole
+// file, and returns the number of frames. A null frame flushes what the resampler holds.
+static int s_convert_frame(SwrContext* swr_ctx, const AVFrame* frame, std::vector<float>& conv)
+{
+	int in_length = frame != nullptr ? frame->nb_samples : 0;
+	int out_length = swr_get_out_samples(swr_ctx, in_length);
+	if (out_length <= 0) return 0;
+	if (conv.size() < (size_t)out_length * 2) conv.resize((size_t)out_length * 2);
+
+	uint8_t* out = (uint8_t*)conv.data();
+	int converted = swr_convert(swr_ctx, &out, out_length, frame != nullptr ? (const uint8_t **)frame->data : nullptr, in_length);
+	return converted > 0 ? converted : 0;
+}
+
+static void s_append_frame(SwrContext* swr_ctx, const AVFrame* frame, std::vector<float>& conv, TrackBuffer* track)
+{
+	int converted = s_convert_frame(swr_ctx, frame, conv);
+	if (converted > 0) track->Append(conv.data(), (unsigned)converted);
+}
+
+// An audio file opened for decoding to interleaved stereo float
+struct AudioInput
+{
+	AVFormatContext* p_fmt_ctx = nullptr;
+	int a_idx = -1;
+	AVCodecContext* p_codec_ctx_audio = nullptr;
+	AVFrame* p_frm_raw_audio = nullptr;
+	SwrContext* swr_ctx = nullptr;
+	int sample_rate = 0;
+};
+
+static void s_close_input(AudioInput& in)
+{
+	swr_free(&in.swr_ctx);
+	av_frame_free(&in.p_frm_raw_audio);
+	avcodec_free_context(&in.p_codec_ctx_audio);
+	avformat_close_input(&in.p_fmt_ctx);
+}
+
+static bool s_open_input(const char* fileName, AudioInput& in)
+{
+	if (!exists_test(fileName) || avformat_open_input(&in.p_fmt_ctx, fileName, nullptr, nullptr) != 0)
+	{
+		printf("Failed loading %s\n", fileName);
+		return false;
+	}
+	avformat_find_stream_info(in.p_fmt_ctx, nullptr);
+
+	for (unsigned i = 0; i < in.p_fmt_ctx->nb_streams; i++)
+	{
+		if (in.p_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+		{
+			in.a_idx = i;
+		}
+	}
+	if (in.a_idx < 0)
+	{
+		printf("%s is not an audio file!\n", fileName);
+		s_close_input(in);
+		return false;
+	}
+
+	AVCodecParameters* p_codec_par = in.p_fmt_ctx->streams[in.a_idx]->codecpar;
+	AVCodec* p_codec = avcodec_find_decoder(p_codec_par->codec_id);
+	in.p_codec_ctx_audio = avcodec_alloc_context3(p_codec);
+	avcodec_parameters_to_context(in.p_codec_ctx_audio, p_codec_par);
+	avcodec_open2(in.p_codec_ctx_audio, p_codec, nullptr);
+
+	in.sample_rate = in.p_codec_ctx_audio->sample_rate;
+	in.p_frm_raw_audio = av_frame_alloc();
+
+	int64_t layout_in = av_get_default_channel_layout(in.p_codec_ctx_audio->channels);
+	in.swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, in.sample_rate, layout_in, in.p_codec_ctx_audio->sample_fmt, in.sample_rate, 0, nullptr);
+	swr_init(in.swr_ctx);
+	return true;
+}
+
+// Decodes the whole input to the end of the track. progress, when given, is told the
+// fraction of the file read after every packet and stops the decoding by returning false.
+static bool s_decode_input(AudioInput& in, TrackBuffer* track, const std::function<bool(double)>& progress)
+{
+	// decoded frames go straight to the end of the track, through one conversion buffer
+	std::vector<float> conv(4608 * 2);
+	int64_t file_size = progress && in.p_fmt_ctx->pb != nullptr ? avio_size(in.p_fmt_ctx->pb) : 0;
+
+	AVPacket packet;
+	while (av_read_frame(in.p_fmt_ctx, &packet) == 0)
+	{
+		if (packet.stream_index == in.a_idx)
+		{
+			avcodec_send_packet(in.p_codec_ctx_audio, &packet);
+			while (avcodec_receive_frame(in.p_codec_ctx_audio, in.p_frm_raw_audio) == 0)
+			{
+				s_append_frame(in.swr_ctx, in.p_frm_raw_audio, conv, track);
+			}
+		}
+		double fraction = file_size > 0 && packet.pos >= 0 ? (double)packet.pos / (double)file_size : 0.0;
+		av_packet_unref(&packet);
+		if (progress && !progress(fraction)) return false;
+	}
+
+	// frames still held by the decoder and the resampler
+	avcodec_send_packet(in.p_codec_ctx_audio, nullptr);
+	while (avcodec_receive_frame(in.p_codec_ctx_audio, in.p_frm_raw_audio) == 0)
+	{
+		s_append_frame(in.swr_ctx, in.p_frm_raw_audio, conv, track);
+	}
+	s_append_frame(in.swr_ctx, nullptr, conv, track);
+	return true;
+}
 
 TrackBuffer* ReadAudioFromFile(const char* fileName)
 {
+	TrackBuffer* cached = AudioCache::s_open(fileName);
+	if (cached != nullptr) return cached;
+
+	AudioInput in;
+	if (!s_open_input(fileName, in)) return nullptr;
+
+	TrackBuffer* track = new TrackBuffer(in.sample_rate, 2);
+	s_decode_input(in, track, nullptr);
+	s_close_input(in);
+
+	AudioCache::s_store(fileName, track);
+	return track;
+}
+
+AudioLoader* AudioLoader::s_start(const char* fileName, Listener* listener)
+{
+	TrackBuffer* cached = AudioCache::s_open(fileName);
+	if (cached != nullptr)
+	{
+		// nothing left to load
+		AudioLoader* loader = new AudioLoader;
+		loader->m_track = cached;
+		loader->m_progress = 1.0;
+		loader->m_complete = true;
+		loader->m_finished = true;
+		if (listener != nullptr) listener->load_finished(true);
+		return loader;
+	}
+
+	AudioInput* in = new AudioInput;
+	if (!s_open_input(fileName, *in))
+	{
+		delete in;
+		return nullptr;
+	}
+
+	AudioLoader* loader = new AudioLoader;
+	loader->m_input = in;
+	loader->m_listener = listener;
+	loader->m_file_name = fileName;
+	loader->m_track = new TrackBuffer(in->sample_rate, 2);
+	loader->m_track->SetLoading(true);
+	loader->m_thread = std::thread(&AudioLoader::_thread_func, loader);
+	return loader;
+}
+
+AudioLoader::AudioLoader() : m_cancel(false), m_finished(false), m_complete(false), m_progress(0.0)
+{
+}
+
+AudioLoader::~AudioLoader()
+{
+	cancel();
+	if (m_thread.joinable()) m_thread.join();
+	if (m_input != nullptr)
+	{
+		s_close_input(*m_input);
+		delete m_input;
+	}
+}
+
+void AudioLoader::_thread_func()
+{
+	// progress is reported in steps of 1%
+	int reported = -1;
+	bool complete = s_decode_input(*m_input, m_track, [this, &reported](double fraction) -> bool
+	{
+		m_progress = fraction;
+		int percent = (int)(fraction * 100.0);
+		if (percent != reported && m_listener != nullptr)
+		{
+			reported = percent;
+			m_listener->load_progress(fraction);
+		}
+		return !m_cancel;
+	});
+
+	// set before the track wakes its waiters, who may ask right away
+	m_complete = complete;
+	if (complete) m_progress = 1.0;
+	m_track->SetLoading(false);
+	if (complete) AudioCache::s_store(m_file_name.c_str(), m_track);
+	m_finished = true;
+	if (m_listener != nullptr) m_listener->load_finished(complete);
+}
+
+// Packets decoded ahead of a segment and thrown away, so that the decoder state
+// (MP3 bit reservoir, MDCT overlap) is the one a serial decode has there.
+static const size_t s_preroll_packets = 8;
+
+// fewest packets worth a thread of their own
+static const size_t s_min_segment_packets = 256;
+
+// Frames a packet of n frames leaves after the decoder applies its skip-samples side
+// data. A skip at the start longer than the packet goes on into the next packets.
+static int64_t s_frames_kept(int64_t n, const uint8_t* skip, int size, int64_t& skip_pending)
+{
+	if (skip != nullptr && size >= 8)
+	{
+		skip_pending = AV_RL32(skip);
+		n -= AV_RL32(skip + 4);
+	}
+	int64_t skipped = std::min(std::max(n, (int64_t)0), skip_pending);
+	skip_pending -= skipped;
+	return std::max(n - skipped, (int64_t)0);
+}
+
+// frames at each segment boundary decoded by both segments and compared
+static const int64_t s_check_frames = 4096;
+
+static const uint64_t s_checksum_basis = 14695981039346656037ULL;
+
+// FNV-1a over the bytes of count interleaved stereo frames
+static void s_checksum(uint64_t& sum, const float* frames, int64_t count)
+{
+	const uint8_t* bytes = (const uint8_t*)frames;
+	size_t size = (size_t)count * 2 * sizeof(float);
+	for (size_t i = 0; i < size; i++)
+	{
+		sum ^= bytes[i];
+		sum *= 1099511628211ULL;
+	}
+}
+
+struct DecodeSegment
+{
+	size_t begin; // packets [begin, end)
+	size_t end;
+	int64_t pos; // first frame in the track, estimated from the packet durations
+	int64_t produced;
+	bool ok;
+
+	// the first frames of the segment, and as many decoded on past its end,
+	// which the next segment has to begin with
+	uint64_t head_sum;
+	int64_t head_frames;
+	uint64_t tail_sum;
+	int64_t tail_frames;
+};
+
+static void s_decode_segment(const AVCodecParameters* codec_par, const std::vector<AVPacket*>& packets, DecodeSegment& seg, TrackBuffer* track)
+{
+	AVCodec* p_codec = avcodec_find_decoder(codec_par->codec_id);
+	AVCodecContext* p_codec_ctx_audio = avcodec_alloc_context3(p_codec);
+	avcodec_parameters_to_context(p_codec_ctx_audio, codec_par);
+	avcodec_open2(p_codec_ctx_audio, p_codec, nullptr);
+
+	int sample_rate = p_codec_ctx_audio->sample_rate;
+	int64_t layout_in = av_get_default_channel_layout(p_codec_ctx_audio->channels);
+	SwrContext* swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, sample_rate, layout_in, p_codec_ctx_audio->sample_fmt, sample_rate, 0, nullptr);
+	swr_init(swr_ctx);
+
+	AVFrame* p_frm_raw_audio = av_frame_alloc();
+	std::vector<float> conv(4608 * 2);
+
+	// frames before pts_begin are pre-roll, from pts_end on they belong to the next segment
+	bool last = seg.end == packets.size();
+	int64_t pts_begin = packets[seg.begin]->pts;
+	int64_t pts_end = last ? INT64_MAX : packets[seg.end]->pts;
+	int64_t pos = seg.pos;
+	bool done = false;
+	seg.ok = true;
+
+	seg.head_sum = s_checksum_basis;
+	seg.head_frames = 0;
+	seg.tail_sum = s_checksum_basis;
+	seg.tail_frames = 0;
+
+	auto receive = [&]()
+	{
+		while (avcodec_receive_frame(p_codec_ctx_audio, p_frm_raw_audio) == 0)
+		{
+			int64_t pts = p_frm_raw_audio->pts;
+			if (pts == AV_NOPTS_VALUE) seg.ok = false;
+			if (!seg.ok) done = true;
+			if (done || pts < pts_begin) continue;
+
+			int converted = s_convert_frame(swr_ctx, p_frm_raw_audio, conv);
+			if (pts >= pts_end)
+			{
+				// past the end, only for the check against the next segment
+				int64_t n = std::min((int64_t)converted, s_check_frames - seg.tail_frames);
+				s_checksum(seg.tail_sum, conv.data(), n);
+				seg.tail_frames += n;
+				if (seg.tail_frames >= s_check_frames) done = true;
+				continue;
+			}
+
+			int64_t n = std::min((int64_t)converted, s_check_frames - seg.head_frames);
+			if (n > 0)
+			{
+				s_checksum(seg.head_sum, conv.data(), n);
+				seg.head_frames += n;
+			}
+			track->Write((unsigned)pos, conv.data(), (unsigned)converted);
+			pos += converted;
+		}
+	};
+
+	// past the end of the segment until the frames to check are there
+	size_t j = seg.begin > s_preroll_packets ? seg.begin - s_preroll_packets : 0;
+	for (; j < packets.size() && !done; j++)
+	{
+		avcodec_send_packet(p_codec_ctx_audio, packets[j]);
+		receive();
+	}
+	if (last)
+	{
+		avcodec_send_packet(p_codec_ctx_audio, nullptr);
+		receive();
+		int converted = s_convert_frame(swr_ctx, nullptr, conv);
+		if (converted > 0) track->Write((unsigned)pos, conv.data(), (unsigned)converted);
+		pos += converted;
+	}
+	seg.produced = pos - seg.pos;
+
+	swr_free(&swr_ctx);
+	av_frame_free(&p_frm_raw_audio);
+	avcodec_free_context(&p_codec_ctx_audio);
+}
+
+TrackBuffer* ReadAudioFromFileParallel(const char* fileName, int num_threads)
+{
+	TrackBuffer* cached = AudioCache::s_open(fileName);
+	if (cached != nullptr) return cached;
+
+	if (num_threads <= 0) num_threads = (int)std::thread::hardware_concurrency();
 	if (!exists_test(fileName))
 	{
 		printf("Failed loading %s\n", fileName);
@@ -33,11 +378,14 @@ TrackBuffer* ReadAudioFromFile(const char* fileName)
 	}
 
 	AVFormatContext* p_fmt_ctx = nullptr;
-	avformat_open_input(&p_fmt_ctx, fileName, nullptr, nullptr);
+	if (avformat_open_input(&p_fmt_ctx, fileName, nullptr, nullptr) != 0)
+	{
+		printf("Failed loading %s\n", fileName);
+		return nullptr;
+	}
 	avformat_find_stream_info(p_fmt_ctx, nullptr);
 
 	int a_idx = -1;
-
 	for (unsigned i = 0; i < p_fmt_ctx->nb_streams; i++)
 	{
 		if (p_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
@@ -45,72 +393,456 @@ TrackBuffer* ReadAudioFromFile(const char* fileName)
 			a_idx = i;
 		}
 	}
+	if (a_idx < 0)
+	{
+		printf("%s is not an audio file!\n", fileName);
+		avformat_close_input(&p_fmt_ctx);
+		return nullptr;
+	}
+	AVStream* stream = p_fmt_ctx->streams[a_idx];
+	int sample_rate = stream->codecpar->sample_rate;
 
-	AVCodecContext* p_codec_ctx_audio;
-	AVFrame *p_frm_raw_audio;
-	AVFrame *p_frm_f32_audio;	
-	SwrContext *swr_ctx;
-	int sample_rate;
+	// The compressed stream is small next to the decoded one and is read into memory.
+	// Segments are placed by packet timestamps, which have to be there and increasing.
+	std::vector<AVPacket*> packets;
+	bool indexed = true;
+	AVPacket packet;
+	while (av_read_frame(p_fmt_ctx, &packet) == 0)
+	{
+		if (packet.stream_index == a_idx)
+		{
+			if (packet.pts == AV_NOPTS_VALUE || packet.duration <= 0 || (packets.size() > 0 && packet.pts <= packets.back()->pts))
+				indexed = false;
+			packets.push_back(av_packet_clone(&packet));
+		}
+		av_packet_unref(&packet);
+	}
 
-	// audio
-	if (a_idx >= 0)
+	TrackBuffer* track = nullptr;
+	size_t num_segments = std::min((size_t)std::max(num_threads, 1), packets.size() / s_min_segment_packets);
+	if (indexed && num_segments > 1)
 	{
-		AVCodecParameters* p_codec_par = p_fmt_ctx->streams[a_idx]->codecpar;
-		AVCodec* p_codec = avcodec_find_decoder(p_codec_par->codec_id);
-		p_codec_ctx_audio = avcodec_alloc_context3(p_codec);
-		avcodec_parameters_to_context(p_codec_ctx_audio, p_codec_par);
-		avcodec_open2(p_codec_ctx_audio, p_codec, nullptr);
+		// first frame of each packet in the track: its duration less what the decoder skips
+		std::vector<int64_t> starts(packets.size() + 1, 0);
+		int64_t skip_pending = 0;
+		for (size_t j = 0; j < packets.size(); j++)
+		{
+			int64_t n = av_rescale_q(packets[j]->duration, stream->time_base, { 1, sample_rate });
+			int size = 0;
+			uint8_t* skip = av_packet_get_side_data(packets[j], AV_PKT_DATA_SKIP_SAMPLES, &size);
+			starts[j + 1] = starts[j] + s_frames_kept(n, skip, size, skip_pending);
+		}
 
-		sample_rate = p_codec_ctx_audio->sample_rate;
+		std::vector<DecodeSegment> segments(num_segments);
+		for (size_t k = 0; k < num_segments; k++)
+		{
+			DecodeSegment& seg = segments[k];
+			seg.begin = packets.size() * k / num_segments;
+			seg.end = packets.size() * (k + 1) / num_segments;
+			seg.pos = starts[seg.begin];
+			seg.produced = 0;
+			seg.ok = false;
+		}
 
-		p_frm_raw_audio = av_frame_alloc();
-		p_frm_f32_audio = av_frame_alloc();
+		track = new TrackBuffer(sample_rate, 2);
+		std::vector<std::thread> threads;
+		for (size_t k = 0; k < num_segments; k++)
+			threads.push_back(std::thread(s_decode_segment, stream->codecpar, std::cref(packets), std::ref(segments[k]), track));
+		for (size_t k = 0; k < num_segments; k++)
+			threads[k].join();
 
-		int64_t layout_in = av_get_default_channel_layout(p_codec_ctx_audio->channels);
-		swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, sample_rate, layout_in, p_codec_ctx_audio->sample_fmt, sample_rate, 0, nullptr);
-		swr_init(swr_ctx);		
+		// Every segment has to end where the next one was placed, otherwise the estimate
+		// was off, and what it decoded past its end has to be what the next one begins
+		// with, otherwise the pre-roll did not bring the decoder to the same state.
+		bool consistent = true;
+		for (size_t k = 0; k < num_segments; k++)
+		{
+			const DecodeSegment& seg = segments[k];
+			if (!seg.ok) consistent = false;
+			if (k + 1 == num_segments) continue;
+			const DecodeSegment& next = segments[k + 1];
+			if (seg.pos + seg.produced != next.pos || seg.tail_frames != next.head_frames || seg.tail_sum != next.head_sum)
+				consistent = false;
+		}
+		if (consistent)
+		{
+			const DecodeSegment& seg = segments[num_segments - 1];
+			track->SetCursor((float)(seg.pos + seg.produced));
+		}
+		else
+		{
+			delete track;
+			track = nullptr;
+		}
 	}
-	else
+
+	for (size_t j = 0; j < packets.size(); j++)
+		av_packet_free(&packets[j]);
+	avformat_close_input(&p_fmt_ctx);
+
+	// short files and streams without usable timestamps are decoded serially
+	if (track == nullptr) return ReadAudioFromFile(fileName);
+
+	AudioCache::s_store(fileName, track);
+	return track;
+}
+
+// Decodes pages of a file on demand. One scan of the demuxer at open builds an index
+// of the packets: byte position, timestamp and first frame in the track. A read seeks
+// to the packet holding its first frame, decodes with the same pre-roll as the
+// parallel loader, and keeps what was decoded past its end for the next read.
+// The first frames come from the packet durations, which have to agree with the
+// timestamps, and the reads check that what they decode is where the index put it.
+// After a mismatch a thread decodes the file serially, the reads come from there once
+// it is done and the track reads its pages again.
+class LazyDecoder : public TrackBuffer::Source
+{
+public:
+	static LazyDecoder* s_open(const char* fileName);
+	~LazyDecoder();
+
+	unsigned rate() const { return m_rate; }
+	unsigned length() const { return (unsigned)m_index.back().start; }
+
+	// the track reading from the decoder, reloaded when the serial decode takes over
+	void set_track(TrackBuffer* track) { m_track = track; }
+
+	virtual void Read(unsigned pos, unsigned count, float* data);
+
+private:
+	struct Entry
 	{
-		printf("%s is not an audio file!\n", fileName);
+		int64_t pos;
+		int64_t pts;
+		int64_t duration;
+		int64_t start; // first frame in the track
+		uint32_t skip_start;
+		uint32_t skip_end;
+	};
+
+	std::mutex m_mutex;
+	AVFormatContext* m_fmt_ctx = nullptr;
+	int m_a_idx = -1;
+	AVCodecContext* m_codec_ctx = nullptr;
+	SwrContext* m_swr_ctx = nullptr;
+	AVFrame* m_frame = nullptr;
+	AVPacket* m_packet = nullptr;
+	unsigned m_rate = 0;
+
+	// the packets, and one past the last with the length in start
+	std::vector<Entry> m_index;
+
+	// decoding state: the next packet to send, the first timestamp kept after a seek,
+	// and the decoded frames [m_dec_begin, m_dec_begin + m_decoded.size() / 2)
+	bool m_positioned = false;
+	bool m_pending = false;
+	size_t m_next = 0;
+	int64_t m_keep_pts = 0;
+	int64_t m_dec_begin = 0;
+	std::vector<float> m_decoded;
+	std::vector<float> m_conv;
+
+	// the serial decode after a mismatch, m_serial set under m_mutex once complete
+	std::string m_file_name;
+	TrackBuffer* m_track = nullptr;
+	std::thread m_serial_thread;
+	std::atomic<bool> m_stop;
+	std::atomic<bool> m_mismatch;
+	TrackBuffer* m_serial = nullptr;
+
+	LazyDecoder() : m_stop(false), m_mismatch(false) {}
+	bool _read_packet();
+	bool _seek(size_t j);
+	bool _decode_next();
+	bool _placed(int64_t pts, int64_t pos) const;
+	bool _decode_serial(TrackBuffer* track);
+	void _serial_thread_func();
+};
+
+// gap in frames still decoded through rather than seeked over
+static const int64_t s_max_decode_gap = 65536;
+
+LazyDecoder* LazyDecoder::s_open(const char* fileName)
+{
+	if (!exists_test(fileName)) return nullptr;
+
+	LazyDecoder* dec = new LazyDecoder;
+	dec->m_file_name = fileName;
+	if (avformat_open_input(&dec->m_fmt_ctx, fileName, nullptr, nullptr) != 0)
+	{
+		delete dec;
 		return nullptr;
 	}
+	avformat_find_stream_info(dec->m_fmt_ctx, nullptr);
 
-	TrackBuffer* track = new TrackBuffer(sample_rate, 2);
-
-	NoteBuffer buf;
-	buf.m_sampleRate = (float)sample_rate;
-	buf.m_channelNum = 2;
+	for (unsigned i = 0; i < dec->m_fmt_ctx->nb_streams; i++)
+	{
+		if (dec->m_fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+		{
+			dec->m_a_idx = i;
+		}
+	}
+	if (dec->m_a_idx < 0)
+	{
+		delete dec;
+		return nullptr;
+	}
+	AVStream* stream = dec->m_fmt_ctx->streams[dec->m_a_idx];
+	dec->m_rate = stream->codecpar->sample_rate;
 
+	// the index, from the packets without decoding them
+	bool indexed = true;
+	int64_t start = 0;
+	int64_t skip_pending = 0;
+	int64_t duration_sum = 0;
 	AVPacket packet;
-	while (av_read_frame(p_fmt_ctx, &packet) == 0)
+	while (indexed && av_read_frame(dec->m_fmt_ctx, &packet) == 0)
 	{
-		if (packet.stream_index == a_idx)
+		if (packet.stream_index == dec->m_a_idx)
 		{
-			avcodec_send_packet(p_codec_ctx_audio, &packet);
-			while (avcodec_receive_frame(p_codec_ctx_audio, p_frm_raw_audio) == 0)
+			if (packet.pts == AV_NOPTS_VALUE || packet.duration <= 0 || packet.pos < 0 ||
+				(dec->m_index.size() > 0 && packet.pts <= dec->m_index.back().pts))
+				indexed = false;
+
+			Entry e = { packet.pos, packet.pts, packet.duration, start, 0, 0 };
+			int size = 0;
+			uint8_t* skip = av_packet_get_side_data(&packet, AV_PKT_DATA_SKIP_SAMPLES, &size);
+			if (skip != nullptr && size >= 8)
 			{
-				int in_length = p_frm_raw_audio->nb_samples;
-				if (buf.m_data == nullptr || buf.m_sampleNum != in_length)
-				{
-					buf.m_sampleNum = in_length;
-					buf.m_cursorDelta = (float)in_length;
-					buf.Allocate();
-					av_samples_fill_arrays(p_frm_f32_audio->data, p_frm_f32_audio->linesize, (const uint8_t*)buf.m_data, 2, in_length, AV_SAMPLE_FMT_FLT, 0);
-				}				
-				swr_convert(swr_ctx, p_frm_f32_audio->data, in_length, (const uint8_t **)p_frm_raw_audio->data, in_length);
-				track->WriteBlend(buf);				
+				e.skip_start = AV_RL32(skip);
+				e.skip_end = AV_RL32(skip + 4);
 			}
+			int64_t n = av_rescale_q(packet.duration, stream->time_base, { 1, (int)dec->m_rate });
+			start += s_frames_kept(n, skip, size, skip_pending);
+			dec->m_index.push_back(e);
+
+			// a duration that disagrees with the timestamps moves every frame after it
+			if (packet.pts - dec->m_index[0].pts != duration_sum)
+				indexed = false;
+			duration_sum += packet.duration;
 		}
 		av_packet_unref(&packet);
 	}
+	if (!indexed || dec->m_index.size() == 0 || start <= 0 || start >= (int64_t)UINT32_MAX)
+	{
+		delete dec;
+		return nullptr;
+	}
+	Entry end = { -1, AV_NOPTS_VALUE, 0, start, 0, 0 };
+	dec->m_index.push_back(end);
 
-	swr_free(&swr_ctx);
-	av_frame_free(&p_frm_f32_audio);
-	av_frame_free(&p_frm_raw_audio);
-	avcodec_free_context(&p_codec_ctx_audio);
-	avformat_close_input(&p_fmt_ctx);
+	AVCodec* p_codec = avcodec_find_decoder(stream->codecpar->codec_id);
+	dec->m_codec_ctx = avcodec_alloc_context3(p_codec);
+	avcodec_parameters_to_context(dec->m_codec_ctx, stream->codecpar);
+	dec->m_codec_ctx->pkt_timebase = stream->time_base;
+	if (avcodec_open2(dec->m_codec_ctx, p_codec, nullptr) != 0)
+	{
+		delete dec;
+		return nullptr;
+	}
+
+	int64_t layout_in = av_get_default_channel_layout(dec->m_codec_ctx->channels);
+	dec->m_swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, dec->m_rate, layout_in, dec->m_codec_ctx->sample_fmt, dec->m_rate, 0, nullptr);
+	swr_init(dec->m_swr_ctx);
+
+	dec->m_frame = av_frame_alloc();
+	dec->m_packet = av_packet_alloc();
+	dec->m_conv.resize(4608 * 2);
+	return dec;
+}
+
+LazyDecoder::~LazyDecoder()
+{
+	m_stop = true;
+	if (m_serial_thread.joinable()) m_serial_thread.join();
+	delete m_serial;
+	av_packet_free(&m_packet);
+	av_frame_free(&m_frame);
+	swr_free(&m_swr_ctx);
+	avcodec_free_context(&m_codec_ctx);
+	avformat_close_input(&m_fmt_ctx);
+}
 
+bool LazyDecoder::_read_packet()
+{
+	while (av_read_frame(m_fmt_ctx, m_packet) == 0)
+	{
+		if (m_packet->stream_index == m_a_idx) return true;
+		av_packet_unref(m_packet);
+	}
+	return false;
+}
+
+// Positions the demuxer on packet j, found again by its byte position.
+bool LazyDecoder::_seek(size_t j)
+{
+	const Entry& e = m_index[j];
+	bool by_byte = (m_fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK) == 0;
+	int ret = by_byte ? av_seek_frame(m_fmt_ctx, -1, e.pos, AVSEEK_FLAG_BYTE | AVSEEK_FLAG_BACKWARD)
+		: av_seek_frame(m_fmt_ctx, m_a_idx, e.pts, AVSEEK_FLAG_BACKWARD);
+
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (ret >= 0)
+		{
+			while (_read_packet())
+			{
+				if (m_packet->pos == e.pos)
+				{
+					m_pending = true;
+					return true;
+				}
+				bool past = m_packet->pos > e.pos;
+				av_packet_unref(m_packet);
+				if (past) break;
+			}
+		}
+		// landed after the packet, read up to it from the start
+		ret = by_byte ? av_seek_frame(m_fmt_ctx, -1, m_index[0].pos, AVSEEK_FLAG_BYTE | AVSEEK_FLAG_BACKWARD)
+			: av_seek_frame(m_fmt_ctx, m_a_idx, m_index[0].pts, AVSEEK_FLAG_BACKWARD);
+	}
+	return false;
+}
+
+bool LazyDecoder::_decode_next()
+{
+	size_t num_packets = m_index.size() - 1;
+	if (m_next >= num_packets) return false;
+
+	if (!m_pending && !_read_packet())
+	{
+		m_next = num_packets;
+		return false;
+	}
+	m_pending = false;
+
+	// timestamps and skips as found by the scan, a demuxer may not restore them after a seek
+	const Entry& e = m_index[m_next];
+	m_packet->pts = e.pts;
+	m_packet->dts = e.pts;
+	m_packet->duration = e.duration;
+	if ((e.skip_start != 0 || e.skip_end != 0) && av_packet_get_side_data(m_packet, AV_PKT_DATA_SKIP_SAMPLES, nullptr) == nullptr)
+	{
+		uint8_t* skip = av_packet_new_side_data(m_packet, AV_PKT_DATA_SKIP_SAMPLES, 10);
+		if (skip != nullptr)
+		{
+			AV_WL32(skip, e.skip_start);
+			AV_WL32(skip + 4, e.skip_end);
+			skip[8] = 0;
+			skip[9] = 0;
+		}
+	}
+	avcodec_send_packet(m_codec_ctx, m_packet);
+	av_packet_unref(m_packet);
+	m_next++;
+	if (m_next == num_packets) avcodec_send_packet(m_codec_ctx, nullptr);
+
+	while (avcodec_receive_frame(m_codec_ctx, m_frame) == 0)
+	{
+		if (m_frame->pts != AV_NOPTS_VALUE && m_frame->pts < m_keep_pts) continue;
+		if (!_placed(m_frame->pts, m_dec_begin + (int64_t)m_decoded.size() / 2)) m_mismatch = true;
+		int converted = s_convert_frame(m_swr_ctx, m_frame, m_conv);
+		m_decoded.insert(m_decoded.end(), m_conv.begin(), m_conv.begin() + converted * 2);
+	}
+	return true;
+}
+
+// A frame with the timestamp of a packet has to be at the first frame of the packet.
+// Others, shifted by a skip at the start, are not checked.
+bool LazyDecoder::_placed(int64_t pts, int64_t pos) const
+{
+	Entry key = { 0, pts, 0, 0, 0, 0 };
+	auto iter = std::lower_bound(m_index.begin(), m_index.end() - 1, key, [](const Entry& a, const Entry& b) { return a.pts < b.pts; });
+	return pts == AV_NOPTS_VALUE || iter == m_index.end() - 1 || iter->pts != pts || iter->start == pos;
+}
+
+// Decodes like ReadAudioFromFile into track. False when the file cannot be opened or
+// when stopped.
+bool LazyDecoder::_decode_serial(TrackBuffer* track)
+{
+	AudioInput in;
+	if (!s_open_input(m_file_name.c_str(), in)) return false;
+	bool complete = s_decode_input(in, track, [this](double) -> bool { return !m_stop; });
+	s_close_input(in);
+	return complete;
+}
+
+void LazyDecoder::_serial_thread_func()
+{
+	TrackBuffer* serial = new TrackBuffer(m_rate, 2);
+	if (!_decode_serial(serial))
+	{
+		delete serial;
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_serial = serial;
+	}
+	m_track->ReloadSource();
+}
+
+void LazyDecoder::Read(unsigned pos, unsigned count, float* data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_serial != nullptr)
+	{
+		// the track keeps the length of the index, with silence past the decoded frames
+		memset(data, 0, sizeof(float) * count * 2);
+		unsigned length = m_serial->NumberOfSamples();
+		if (pos < length) m_serial->GetSamples(pos, std::min(count, length - pos), data);
+		return;
+	}
+
+	int64_t dec_end = m_dec_begin + (int64_t)m_decoded.size() / 2;
+
+	if (!m_positioned || (int64_t)pos < m_dec_begin || (int64_t)pos > dec_end + s_max_decode_gap)
+	{
+		// the packet holding pos, decoding starts a few packets before it
+		Entry key = { 0, 0, 0, (int64_t)pos, 0, 0 };
+		auto iter = std::upper_bound(m_index.begin(), m_index.end() - 1, key, [](const Entry& a, const Entry& b) { return a.start < b.start; });
+		size_t j = (size_t)(iter - m_index.begin()) - 1;
+		size_t j0 = j > s_preroll_packets ? j - s_preroll_packets : 0;
+
+		avcodec_flush_buffers(m_codec_ctx);
+		m_pending = false;
+		m_positioned = _seek(j0);
+		m_next = m_positioned ? j0 : m_index.size() - 1;
+		m_keep_pts = m_index[j].pts;
+		m_dec_begin = m_index[j].start;
+		m_decoded.clear();
+		dec_end = m_dec_begin;
+	}
+
+	while (dec_end < (int64_t)pos + (int64_t)count && _decode_next())
+		dec_end = m_dec_begin + (int64_t)m_decoded.size() / 2;
+	if (m_mismatch && !m_serial_thread.joinable())
+		m_serial_thread = std::thread(&LazyDecoder::_serial_thread_func, this);
+
+	int64_t copy_begin = std::max((int64_t)pos, m_dec_begin);
+	int64_t copy_end = std::min((int64_t)pos + (int64_t)count, dec_end);
+	memset(data, 0, sizeof(float) * count * 2);
+	if (copy_end > copy_begin)
+		memcpy(data + (copy_begin - pos) * 2, m_decoded.data() + (copy_begin - m_dec_begin) * 2, sizeof(float) * (size_t)(copy_end - copy_begin) * 2);
+
+	// keep what lies past this read for the next one
+	int64_t drop = std::min((int64_t)pos + (int64_t)count, dec_end) - m_dec_begin;
+	if (drop > 0)
+	{
+		m_decoded.erase(m_decoded.begin(), m_decoded.begin() + drop * 2);
+		m_dec_begin += drop;
+	}
+}
+
+TrackBuffer* OpenAudioFile(const char* fileName)
+{
+	TrackBuffer* cached = AudioCache::s_open(fileName);
+	if (cached != nullptr) return cached;
+
+	LazyDecoder* dec = LazyDecoder::s_open(fileName);
+	if (dec == nullptr) return ReadAudioFromFileParallel(fileName);
+	TrackBuffer* track = new TrackBuffer(dec, dec->rate(), 2, dec->length());
+	dec->set_track(track);
 	return track;
 }
 
@@ -129,100 +861,499 @@ inline AVFrame *alloc_audio_frame(enum AVSampleFormat sample_fmt, uint64_t chann
 	return frame;
 }
 
-void WriteAudioToFile(TrackBuffer* track, const char* fileName, int bit_rate)
+// An output file being encoded to, see AudioEncoder
+struct AudioOutput
 {
-	unsigned num_samples = track->NumberOfSamples();
-	unsigned chn = track->NumberOfChannels();
-	unsigned sample_rate = track->Rate();
+	AVFormatContext* p_fmt_ctx = nullptr;
+	AVStream* stream = nullptr;
+	AVCodecContext* p_codec_ctx_audio = nullptr;
+	AVFrame* frame = nullptr;
+	SwrContext* swr_ctx = nullptr;
+	bool file_opened = false;
+	int64_t samples_count = 0;
+};
 
-	AVOutputFormat *output_format = av_guess_format("mp3", nullptr, fileName);
+static void s_free_output(AudioOutput* out)
+{
+	avcodec_free_context(&out->p_codec_ctx_audio);
+	av_frame_free(&out->frame);
+	swr_free(&out->swr_ctx);
+	if (out->file_opened)
+		avio_closep(&out->p_fmt_ctx->pb);
+	avformat_free_context(out->p_fmt_ctx);
+	delete out;
+}
 
-	AVFormatContext *p_fmt_ctx;
-	avformat_alloc_output_context2(&p_fmt_ctx, output_format, nullptr, fileName);
-	output_format = p_fmt_ctx->oformat;
+// Opens a stereo encoder. bits_per_sample is that of integer formats padded to 32 bits,
+// 0 for the others. Without the bit reservoir every MP3 frame is complete in itself.
+static AVCodecContext* s_open_encoder(AVCodecID codec_id, AVSampleFormat sample_fmt, unsigned sample_rate, int bit_rate, int bits_per_sample, bool global_header, bool reservoir = true)
+{
+	AVCodec *audio_codec = avcodec_find_encoder(codec_id);
+	if (audio_codec == nullptr) return nullptr;
 
-	AVCodec *audio_codec = avcodec_find_encoder(audio_codec_id);
-	AVStream* stream = avformat_new_stream(p_fmt_ctx, nullptr);
-	stream->id = p_fmt_ctx->nb_streams - 1;
 	AVCodecContext *p_codec_ctx_audio = avcodec_alloc_context3(audio_codec);
 	p_codec_ctx_audio->sample_fmt = sample_fmt;
 	p_codec_ctx_audio->bit_rate = bit_rate;
+	if (bits_per_sample > 0)
+		p_codec_ctx_audio->bits_per_raw_sample = bits_per_sample;
 	p_codec_ctx_audio->sample_rate = sample_rate;
 	p_codec_ctx_audio->channel_layout = AV_CH_LAYOUT_STEREO;
 	p_codec_ctx_audio->channels = av_get_channel_layout_nb_channels(p_codec_ctx_audio->channel_layout);
-	stream->time_base = { 1, (int)sample_rate };
-	if (p_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+	if (global_header)
 		p_codec_ctx_audio->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-	avcodec_open2(p_codec_ctx_audio, audio_codec, nullptr);
-	int frame_size = p_codec_ctx_audio->frame_size;
-
-	AVFrame *frame = alloc_audio_frame(p_codec_ctx_audio->sample_fmt, p_codec_ctx_audio->channel_layout, p_codec_ctx_audio->sample_rate, frame_size);
-	AVFrame *tmp_frame = alloc_audio_frame(AV_SAMPLE_FMT_FLT, p_codec_ctx_audio->channel_layout, p_codec_ctx_audio->sample_rate, frame_size);
+	AVDictionary* options = nullptr;
+	if (!reservoir)
+		av_dict_set(&options, "reservoir", "0", 0);
+	int ret = avcodec_open2(p_codec_ctx_audio, audio_codec, &options);
+	av_dict_free(&options);
+	if (ret < 0)
+	{
+		avcodec_free_context(&p_codec_ctx_audio);
+		return nullptr;
+	}
+	return p_codec_ctx_audio;
+}
 
-	avcodec_parameters_from_context(stream->codecpar, p_codec_ctx_audio);
-	SwrContext *swr_ctx = swr_alloc();
+// Resampler from interleaved floats to the format of the encoder
+static SwrContext* s_open_encoder_swr(const AVCodecContext* p_codec_ctx_audio, int bits_per_sample, bool dither)
+{
+	SwrContext* swr_ctx = swr_alloc();
 	av_opt_set_int(swr_ctx, "in_channel_count", p_codec_ctx_audio->channels, 0);
 	av_opt_set_int(swr_ctx, "in_sample_rate", p_codec_ctx_audio->sample_rate, 0);
 	av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
 	av_opt_set_int(swr_ctx, "out_channel_count", p_codec_ctx_audio->channels, 0);
 	av_opt_set_int(swr_ctx, "out_sample_rate", p_codec_ctx_audio->sample_rate, 0);
 	av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", p_codec_ctx_audio->sample_fmt, 0);
-
+	if (dither)
+	{
+		// triangular dither at the last bit kept
+		av_opt_set_int(swr_ctx, "dither_method", SWR_DITHER_TRIANGULAR, 0);
+		if (bits_per_sample > 0 && bits_per_sample < 32)
+			av_opt_set_double(swr_ctx, "dither_scale", (double)(1 << (32 - bits_per_sample)), 0);
+	}
 	swr_init(swr_ctx);
+	return swr_ctx;
+}
 
-	av_dump_format(p_fmt_ctx, 0, fileName, 1);
-	if (!(output_format->flags & AVFMT_NOFILE))
-		avio_open(&p_fmt_ctx->pb, fileName, AVIO_FLAG_WRITE);
-	avformat_write_header(p_fmt_ctx, nullptr);
+// Opens fileName for the encoder, with a resampler from interleaved floats to its format.
+// bits_per_sample is that of integer formats padded to 32 bits, 0 for the others.
+static AudioOutput* s_open_output(const char* fileName, const char* format_name, AVCodecID codec_id, AVSampleFormat sample_fmt, unsigned sample_rate, int bit_rate, int bits_per_sample, bool dither, int& frame_size, bool reservoir = true)
+{
+	AudioOutput* out = new AudioOutput;
+	AVOutputFormat *output_format = av_guess_format(format_name, nullptr, fileName);
+	avformat_alloc_output_context2(&out->p_fmt_ctx, output_format, nullptr, fileName);
+	if (out->p_fmt_ctx != nullptr)
+		out->p_codec_ctx_audio = s_open_encoder(codec_id, sample_fmt, sample_rate, bit_rate, bits_per_sample, (out->p_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) != 0, reservoir);
+	if (out->p_codec_ctx_audio == nullptr)
+	{
+		printf("Failed writing %s\n", fileName);
+		avformat_free_context(out->p_fmt_ctx);
+		delete out;
+		return nullptr;
+	}
+	output_format = out->p_fmt_ctx->oformat;
+	AVCodecContext *p_codec_ctx_audio = out->p_codec_ctx_audio;
 
-	float *buffer = (float*)tmp_frame->data[0];
+	out->stream = avformat_new_stream(out->p_fmt_ctx, nullptr);
+	out->stream->id = out->p_fmt_ctx->nb_streams - 1;
+	out->stream->time_base = { 1, (int)sample_rate };
 
-	unsigned pos = 0;
-	int samples_count = 0;
-	while (num_samples > 0)
+	// encoders taking any number of frames are given them in blocks of this size
+	frame_size = p_codec_ctx_audio->frame_size > 0 ? p_codec_ctx_audio->frame_size : 4096;
+	out->frame = alloc_audio_frame(p_codec_ctx_audio->sample_fmt, p_codec_ctx_audio->channel_layout, p_codec_ctx_audio->sample_rate, frame_size);
+
+	avcodec_parameters_from_context(out->stream->codecpar, p_codec_ctx_audio);
+	out->swr_ctx = s_open_encoder_swr(p_codec_ctx_audio, bits_per_sample, dither);
+
+	av_dump_format(out->p_fmt_ctx, 0, fileName, 1);
+	if (!(output_format->flags & AVFMT_NOFILE))
 	{
-		unsigned writeCount = frame_size;
-		if (writeCount > num_samples) writeCount = num_samples;
-		track->GetSamples(pos, writeCount, buffer);
+		if (avio_open(&out->p_fmt_ctx->pb, fileName, AVIO_FLAG_WRITE) < 0)
+		{
+			printf("Failed writing %s\n", fileName);
+			s_free_output(out);
+			return nullptr;
+		}
+		out->file_opened = true;
+	}
+	if (avformat_write_header(out->p_fmt_ctx, nullptr) < 0)
+	{
+		s_free_output(out);
+		return nullptr;
+	}
 
-		int dst_nb_samples = (int)av_rescale_rnd(swr_get_delay(swr_ctx, sample_rate) + frame_size, sample_rate, sample_rate, AV_ROUND_UP);
-		av_frame_make_writable(frame);
-		swr_convert(swr_ctx, frame->data, dst_nb_samples, (const uint8_t **)tmp_frame->data, tmp_frame->nb_samples);
-		frame->pts = av_rescale_q(samples_count, { 1, (int)sample_rate }, p_codec_ctx_audio->time_base);
-		samples_count += dst_nb_samples;
+	return out;
+}
+
+AudioEncoder* AudioEncoder::s_open(const char* fileName, unsigned sample_rate, int bit_rate)
+{
+	int frame_size;
+	AudioOutput* out = s_open_output(fileName, "mp3", audio_codec_id, sample_fmt, sample_rate, bit_rate, 0, false, frame_size);
+	if (out == nullptr) return nullptr;
 
-		int ret;
+	AudioEncoder* encoder = new AudioEncoder;
+	encoder->m_output = out;
+	encoder->m_frame_size = (unsigned)frame_size;
+	return encoder;
+}
+
+AudioEncoder* AudioEncoder::s_open_flac(const char* fileName, unsigned sample_rate, int bits, bool dither)
+{
+	// 24-bit samples go to the encoder in the top of 32 bits
+	bool s16 = bits <= 16;
+	int frame_size;
+	AudioOutput* out = s_open_output(fileName, "flac", AV_CODEC_ID_FLAC, s16 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32, sample_rate, 0, s16 ? 0 : 24, dither, frame_size);
+	if (out == nullptr) return nullptr;
+
+	AudioEncoder* encoder = new AudioEncoder;
+	encoder->m_output = out;
+	encoder->m_frame_size = (unsigned)frame_size;
+	return encoder;
+}
+
+AudioEncoder::~AudioEncoder()
+{
+	close();
+}
+
+// Sends count frames to the encoder, or flushes it for no frames, and writes the packets out.
+bool AudioEncoder::_encode(const float* frames, unsigned count)
+{
+	AudioOutput* out = m_output;
+	AVCodecContext* p_codec_ctx_audio = out->p_codec_ctx_audio;
+	int ret;
+	if (frames != nullptr)
+	{
+		AVFrame* frame = out->frame;
+		av_frame_make_writable(frame);
+		frame->nb_samples = (int)count;
+		const uint8_t* in = (const uint8_t*)frames;
+		swr_convert(out->swr_ctx, frame->data, (int)count, &in, (int)count);
+		frame->pts = av_rescale_q(out->samples_count, { 1, p_codec_ctx_audio->sample_rate }, p_codec_ctx_audio->time_base);
+		out->samples_count += count;
 		ret = avcodec_send_frame(p_codec_ctx_audio, frame);
-		while (ret >= 0)
+	}
+	else
+	{
+		ret = avcodec_send_frame(p_codec_ctx_audio, nullptr);
+	}
+	if (ret < 0) return false;
+
+	while (true)
+	{
+		AVPacket packet = { 0 };
+		ret = avcodec_receive_packet(p_codec_ctx_audio, &packet);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			break;
+		if (ret < 0) return false;
+		av_packet_rescale_ts(&packet, p_codec_ctx_audio->time_base, out->stream->time_base);
+		packet.stream_index = out->stream->index;
+		ret = av_interleaved_write_frame(out->p_fmt_ctx, &packet);
+		av_packet_unref(&packet);
+		if (ret < 0) return false;
+	}
+	return true;
+}
+
+bool AudioEncoder::write(const float* frames, unsigned count)
+{
+	if (m_output == nullptr) return false;
+	bool ok = true;
+	while (count > 0 && ok)
+	{
+		// whole encoder frames straight from the input, the rest is held until filled
+		if (m_pending.empty() && count >= m_frame_size)
+		{
+			ok = _encode(frames, m_frame_size);
+			frames += m_frame_size * 2;
+			count -= m_frame_size;
+			continue;
+		}
+		unsigned take = std::min(count, m_frame_size - (unsigned)(m_pending.size() / 2));
+		m_pending.insert(m_pending.end(), frames, frames + take * 2);
+		frames += take * 2;
+		count -= take;
+		if (m_pending.size() == m_frame_size * 2)
+		{
+			ok = _encode(m_pending.data(), m_frame_size);
+			m_pending.clear();
+		}
+	}
+	return ok;
+}
+
+bool AudioEncoder::close()
+{
+	if (m_output == nullptr) return false;
+
+	bool ok = true;
+	if (!m_pending.empty())
+	{
+		// a short last frame, padded with silence where the encoder needs whole frames
+		unsigned count = (unsigned)(m_pending.size() / 2);
+		if (!(m_output->p_codec_ctx_audio->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE)))
+		{
+			m_pending.resize(m_frame_size * 2, 0.0f);
+			count = m_frame_size;
+		}
+		ok = _encode(m_pending.data(), count);
+		m_pending.clear();
+	}
+	ok = _encode(nullptr, 0) && ok;
+	ok = av_write_trailer(m_output->p_fmt_ctx) == 0 && ok;
+
+	s_free_output(m_output);
+	m_output = nullptr;
+	return ok;
+}
+
+// MP3 frames encoded by ParallelMp3Encoder on each side of a segment and thrown away.
+// They cover the encoder delay (576 frames of LAME and 529 of the decoder), the MDCT
+// window and the lookahead of the psychoacoustic model.
+static const unsigned s_encode_overlap_packets = 4;
+
+// MP3 frames of a segment, about ten seconds
+static const unsigned s_encode_segment_packets = 384;
+
+// A segment of a ParallelMp3Encoder, from the first frame encoded with it
+struct EncodeSegment
+{
+	std::vector<float> frames;
+	int64_t pos = 0; // of the first frame in the file
+	unsigned skip = 0; // packets of the overlap before the segment
+	unsigned keep = 0; // packets of the segment, all the rest for the last one
+	bool last = false;
+	std::vector<AVPacket*> packets;
+	bool ok = false;
+	std::thread thread;
+};
+
+// Encodes the frames of the segment with a new encoder set up like p_codec_ctx, and
+// keeps its packets with timestamps relative to the first frame.
+static void s_encode_segment(const AVCodecContext* p_codec_ctx, EncodeSegment* seg)
+{
+	AVCodecContext* p_codec_ctx_audio = s_open_encoder(p_codec_ctx->codec_id, p_codec_ctx->sample_fmt, p_codec_ctx->sample_rate, (int)p_codec_ctx->bit_rate, 0, (p_codec_ctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER) != 0, false);
+	if (p_codec_ctx_audio == nullptr) return;
+	unsigned frame_size = (unsigned)p_codec_ctx_audio->frame_size;
+	AVFrame* frame = alloc_audio_frame(p_codec_ctx_audio->sample_fmt, p_codec_ctx_audio->channel_layout, p_codec_ctx_audio->sample_rate, frame_size);
+	SwrContext* swr_ctx = s_open_encoder_swr(p_codec_ctx_audio, 0, false);
+
+	bool ok = true;
+	unsigned received = 0;
+	auto receive = [&]()
+	{
+		while (ok)
 		{
 			AVPacket packet = { 0 };
-			ret = avcodec_receive_packet(p_codec_ctx_audio, &packet);
+			int ret = avcodec_receive_packet(p_codec_ctx_audio, &packet);
 			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
 				break;
-			av_packet_rescale_ts(&packet, p_codec_ctx_audio->time_base, stream->time_base);
-			packet.stream_index = stream->index;
-			av_interleaved_write_frame(p_fmt_ctx, &packet);
+			if (ret < 0)
+			{
+				ok = false;
+				break;
+			}
+			if (received >= seg->skip && (seg->last || received < seg->skip + seg->keep))
+				seg->packets.push_back(av_packet_clone(&packet));
+			received++;
 			av_packet_unref(&packet);
 		}
+	};
 
+	// all frames are whole but the last one of the file
+	unsigned num_frames = (unsigned)(seg->frames.size() / 2);
+	bool small_last_frame = (p_codec_ctx_audio->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) != 0;
+	for (unsigned pos = 0; pos < num_frames && ok; pos += frame_size)
+	{
+		unsigned count = std::min(frame_size, num_frames - pos);
+		const float* frames = seg->frames.data() + (size_t)pos * 2;
+		if (count < frame_size && !small_last_frame)
+		{
+			seg->frames.resize(((size_t)pos + frame_size) * 2, 0.0f);
+			frames = seg->frames.data() + (size_t)pos * 2;
+			count = frame_size;
+		}
+		av_frame_make_writable(frame);
+		frame->nb_samples = (int)count;
+		const uint8_t* in = (const uint8_t*)frames;
+		swr_convert(swr_ctx, frame->data, (int)count, &in, (int)count);
+		frame->pts = av_rescale_q(pos, { 1, p_codec_ctx_audio->sample_rate }, p_codec_ctx_audio->time_base);
+		ok = avcodec_send_frame(p_codec_ctx_audio, frame) >= 0;
+		receive();
+	}
+	ok = ok && avcodec_send_frame(p_codec_ctx_audio, nullptr) >= 0;
+	receive();
+	seg->ok = ok && (seg->last || seg->packets.size() == seg->keep);
 
-		num_samples -= writeCount;
-		pos += writeCount;
+	swr_free(&swr_ctx);
+	av_frame_free(&frame);
+	avcodec_free_context(&p_codec_ctx_audio);
+}
+
+ParallelMp3Encoder* ParallelMp3Encoder::s_open(const char* fileName, unsigned sample_rate, int bit_rate, int num_threads)
+{
+	int frame_size;
+	AudioOutput* out = s_open_output(fileName, "mp3", audio_codec_id, sample_fmt, sample_rate, bit_rate, 0, false, frame_size, false);
+	if (out == nullptr) return nullptr;
+
+	if (num_threads <= 0) num_threads = (int)std::thread::hardware_concurrency();
+	ParallelMp3Encoder* encoder = new ParallelMp3Encoder;
+	encoder->m_output = out;
+	encoder->m_frame_size = (unsigned)frame_size;
+	encoder->m_num_threads = (size_t)std::max(num_threads, 1);
+	return encoder;
+}
+
+ParallelMp3Encoder::~ParallelMp3Encoder()
+{
+	close();
+}
+
+// Hands the pending frames of the next segment to a thread, keeping those encoded
+// again with the one after it.
+void ParallelMp3Encoder::_start_segment(bool last)
+{
+	unsigned overlap = s_encode_overlap_packets * m_frame_size;
+	unsigned length = s_encode_segment_packets * m_frame_size;
+	unsigned before = m_pending_pos > 0 ? overlap : 0;
+
+	EncodeSegment* seg = new EncodeSegment;
+	seg->pos = m_pending_pos;
+	seg->skip = before / m_frame_size;
+	seg->keep = s_encode_segment_packets;
+	seg->last = last;
+	if (last)
+	{
+		seg->frames.swap(m_pending);
+		m_pending_pos += (int64_t)(seg->frames.size() / 2);
+	}
+	else
+	{
+		size_t used = (size_t)before + length + overlap;
+		seg->frames.assign(m_pending.begin(), m_pending.begin() + used * 2);
+		size_t done = (size_t)before + length - overlap;
+		m_pending.erase(m_pending.begin(), m_pending.begin() + done * 2);
+		m_pending_pos += (int64_t)done;
 	}
+	seg->thread = std::thread(s_encode_segment, m_output->p_codec_ctx_audio, seg);
+	m_segments.push_back(seg);
+}
 
-	av_write_trailer(p_fmt_ctx);
+// Waits for the first segment and writes its packets out
+void ParallelMp3Encoder::_write_segment()
+{
+	EncodeSegment* seg = m_segments.front();
+	m_segments.pop_front();
+	seg->thread.join();
+	m_ok = m_ok && seg->ok;
 
-	avcodec_free_context(&p_codec_ctx_audio);
-	av_frame_free(&frame);
-	av_frame_free(&tmp_frame);	
-	swr_free(&swr_ctx);
+	AVCodecContext* p_codec_ctx_audio = m_output->p_codec_ctx_audio;
+	int64_t offset = av_rescale_q(seg->pos, { 1, p_codec_ctx_audio->sample_rate }, p_codec_ctx_audio->time_base);
+	for (size_t j = 0; j < seg->packets.size(); j++)
+	{
+		AVPacket* packet = seg->packets[j];
+		if (m_ok)
+		{
+			packet->pts += offset;
+			packet->dts += offset;
+			av_packet_rescale_ts(packet, p_codec_ctx_audio->time_base, m_output->stream->time_base);
+			packet->stream_index = m_output->stream->index;
+			m_ok = av_interleaved_write_frame(m_output->p_fmt_ctx, packet) >= 0;
+		}
+		av_packet_free(&packet);
+	}
+	delete seg;
+}
 
-	if (!(output_format->flags & AVFMT_NOFILE))
-		avio_closep(&p_fmt_ctx->pb);
-	avformat_free_context(p_fmt_ctx);
+bool ParallelMp3Encoder::write(const float* frames, unsigned count)
+{
+	if (m_output == nullptr) return false;
+	m_pending.insert(m_pending.end(), frames, frames + (size_t)count * 2);
+
+	size_t overlap = (size_t)s_encode_overlap_packets * m_frame_size;
+	size_t length = (size_t)s_encode_segment_packets * m_frame_size;
+	while (m_ok && m_pending.size() / 2 >= (m_pending_pos > 0 ? overlap : 0) + length + overlap)
+	{
+		if (m_segments.size() >= m_num_threads)
+			_write_segment();
+		_start_segment(false);
+	}
+	return m_ok;
+}
+
+bool ParallelMp3Encoder::close()
+{
+	if (m_output == nullptr) return false;
+
+	_start_segment(true);
+	while (!m_segments.empty())
+		_write_segment();
+	bool ok = av_write_trailer(m_output->p_fmt_ctx) == 0 && m_ok;
+
+	s_free_output(m_output);
+	m_output = nullptr;
+	return ok;
+}
+
+ResampleWriter::ResampleWriter(AudioWriter* writer, unsigned rate_in, unsigned rate_out) : m_writer(writer)
+{
+	m_swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, rate_out, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, rate_in, 0, nullptr);
+	swr_init(m_swr_ctx);
+}
+
+ResampleWriter::~ResampleWriter()
+{
+	swr_free(&m_swr_ctx);
+}
+
+// converts the frames, or flushes the resampler for none, into the writer
+bool ResampleWriter::_convert(const float* frames, unsigned count)
+{
+	int max_out = swr_get_out_samples(m_swr_ctx, (int)count);
+	if (max_out <= 0) return true;
+	m_buf.resize((size_t)max_out * 2);
+	const uint8_t* in = (const uint8_t*)frames;
+	uint8_t* out = (uint8_t*)m_buf.data();
+	int converted = swr_convert(m_swr_ctx, &out, max_out, frames != nullptr ? &in : nullptr, (int)count);
+	if (converted < 0) return false;
+	return converted == 0 || m_writer->write(m_buf.data(), (unsigned)converted);
 }
 
+bool ResampleWriter::write(const float* frames, unsigned count)
+{
+	return _convert(frames, count);
+}
+
+bool ResampleWriter::close()
+{
+	if (m_closed) return false;
+	m_closed = true;
+	bool ok = _convert(nullptr, 0);
+	return m_writer->close() && ok;
+}
+
+void WriteAudioToFile(TrackBuffer* track, const char* fileName, int bit_rate, int num_threads)
+{
+	AudioWriter* encoder;
+	if (num_threads == 1)
+		encoder = AudioEncoder::s_open(fileName, track->Rate(), bit_rate);
+	else
+		encoder = ParallelMp3Encoder::s_open(fileName, track->Rate(), bit_rate, num_threads);
+	if (encoder == nullptr) return;
+
+	unsigned num_samples = track->NumberOfSamples();
+	unsigned buffer_size = track->GetLocalBufferSize();
+	std::vector<float> buffer(buffer_size * 2);
+	for (unsigned pos = 0; pos < num_samples; pos += buffer_size)
+	{
+		unsigned count = std::min(buffer_size, num_samples - pos);
+		track->GetSamples(pos, count, buffer.data());
+		encoder->write(buffer.data(), count);
+	}
+	encoder->close();
+	delete encoder;
+}
 
 void DumpAudioToRawFile(TrackBuffer* track, const char* fileName)
 {
@@ -247,4 +1378,124 @@ void DumpAudioToRawFile(TrackBuffer* track, const char* fileName)
 
 	delete[] buffer;
 
-}
\ No newline at end of file
+}
+
+TrackResampler::TrackResampler(TrackBuffer* in, TrackBuffer* out) : m_in(in), m_out(out)
+{
+	int64_t layout_in = av_get_default_channel_layout(in->NumberOfChannels());
+	m_swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, out->Rate(), layout_in, AV_SAMPLE_FMT_FLT, in->Rate(), 0, nullptr);
+	if (m_swr_ctx != nullptr && swr_init(m_swr_ctx) < 0)
+		swr_free(&m_swr_ctx);
+}
+
+TrackResampler::~TrackResampler()
+{
+	swr_free(&m_swr_ctx);
+}
+
+// converts count input frames from m_pos, or flushes the resampler for none,
+// appending at most max_out frames in total to the output
+bool TrackResampler::_convert(unsigned count, uint64_t max_out)
+{
+	if (m_swr_ctx == nullptr) return false;
+	const uint8_t* in = nullptr;
+	if (count > 0)
+	{
+		m_in_buf.resize((size_t)count * m_in->NumberOfChannels());
+		m_in->GetSamples(m_pos, count, m_in_buf.data());
+		in = (const uint8_t*)m_in_buf.data();
+	}
+	// the input is taken in one call, a flush may need several
+	do
+	{
+		int space = swr_get_out_samples(m_swr_ctx, (int)count);
+		if (space <= 0) break;
+		m_out_buf.resize((size_t)space * 2);
+		uint8_t* out = (uint8_t*)m_out_buf.data();
+		int converted = swr_convert(m_swr_ctx, &out, space, in != nullptr ? &in : nullptr, (int)count);
+		if (converted < 0) return false;
+		uint64_t keep = std::min((uint64_t)converted, max_out - std::min(max_out, m_out_pos));
+		if (keep > 0)
+			m_out->Append(m_out_buf.data(), (unsigned)keep);
+		m_out_pos += keep;
+		if (converted == 0) break;
+	} while (in == nullptr);
+	m_pos += count;
+	return true;
+}
+
+bool TrackResampler::convert(unsigned end)
+{
+	unsigned buffer_size = m_in->GetLocalBufferSize();
+	while (m_pos < end)
+	{
+		if (!_convert(std::min(buffer_size, end - m_pos), UINT64_MAX)) return false;
+	}
+	return true;
+}
+
+bool TrackResampler::finish()
+{
+	unsigned length = m_in->NumberOfSamples();
+	if (!convert(length)) return false;
+	uint64_t num_out = (uint64_t)av_rescale_rnd(length, m_out->Rate(), m_in->Rate(), AV_ROUND_UP);
+	if (!_convert(0, num_out)) return false;
+
+	// the resampler may end a little short
+	if (m_out_pos < num_out)
+	{
+		std::vector<float> silence((size_t)(num_out - m_out_pos) * 2, 0.0f);
+		m_out->Append(silence.data(), (unsigned)(num_out - m_out_pos));
+		m_out_pos = num_out;
+	}
+	return true;
+}
+
+bool ResampleToBuffer(TrackBuffer* track, unsigned sample_rate, std::vector<float>& frames)
+{
+	unsigned num_samples = track->NumberOfSamples();
+	unsigned chn = track->NumberOfChannels();
+	unsigned rate_in = track->Rate();
+	int num_out = (int)av_rescale_rnd(num_samples, sample_rate, rate_in, AV_ROUND_UP);
+	frames.assign((size_t)num_out * 2, 0.0f);
+
+	int64_t layout_in = av_get_default_channel_layout(chn);
+	SwrContext *swr_ctx = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, sample_rate, layout_in, AV_SAMPLE_FMT_FLT, rate_in, 0, nullptr);
+	if (swr_ctx == nullptr || swr_init(swr_ctx) < 0)
+	{
+		swr_free(&swr_ctx);
+		frames.clear();
+		return false;
+	}
+
+	unsigned buffer_size = track->GetLocalBufferSize();
+	float *buffer = new float[buffer_size*chn];
+
+	unsigned pos = 0;
+	int out_pos = 0;
+	bool ok = true;
+	while (out_pos < num_out)
+	{
+		unsigned readCount = buffer_size;
+		if (readCount > num_samples - pos) readCount = num_samples - pos;
+		track->GetSamples(pos, readCount, buffer);
+		pos += readCount;
+
+		// an empty input flushes the resampler
+		const uint8_t* in = (const uint8_t*)buffer;
+		uint8_t* out = (uint8_t*)(frames.data() + (size_t)out_pos * 2);
+		int converted = swr_convert(swr_ctx, &out, num_out - out_pos, readCount > 0 ? &in : nullptr, (int)readCount);
+		if (converted < 0)
+		{
+			frames.resize((size_t)out_pos * 2);
+			ok = false;
+			break;
+		}
+		if (readCount == 0 && converted == 0) break;
+		out_pos += converted;
+	}
+
+	delete[] buffer;
+	swr_free(&swr_ctx);
+	return ok;
+}
@@ -1,7 +1,209 @@
 #pragma once
 
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include "AudioExport.h"
+
 class TrackBuffer;
+struct AudioInput;
+struct AudioOutput;
+struct SwrContext;
+struct EncodeSegment;
 
+// These map the decoded track from the AudioCache when it has the file, and store it
+// there after decoding otherwise.
 TrackBuffer* ReadAudioFromFile(const char* fileName);
-void WriteAudioToFile(TrackBuffer* track, const char* fileName, int bit_rate=192000);
+
+// Decodes segments of the file on num_threads threads (0 for one per core), each
+// starting a few packets early so the result is the same as ReadAudioFromFile.
+// Every segment also decodes a little past its end, and the frames there have to
+// match the start of the next segment, in place and content. Falls back to
+// ReadAudioFromFile when they do not, for short files and formats without packet timestamps.
+TrackBuffer* ReadAudioFromFileParallel(const char* fileName, int num_threads = 0);
+
+// Decodes a file on a thread of its own into a track that can be read while it grows.
+class AudioLoader
+{
+public:
+	// Called on the loading thread, or in s_start for a file found in the AudioCache.
+	class Listener
+	{
+	public:
+		virtual ~Listener() {}
+		virtual void load_progress(double fraction) = 0;
+		virtual void load_finished(bool complete) = 0;
+	};
+
+	// Opens the file and starts decoding it, or returns nullptr when it cannot be opened
+	// as audio. The track is there right away, loading until the decoding ends.
+	static AudioLoader* s_start(const char* fileName, Listener* listener = nullptr);
+
+	// Cancels a load still running and waits for it. The track is not deleted: it belongs
+	// to the caller, who deletes the loader first.
+	~AudioLoader();
+
+	TrackBuffer* track() const { return m_track; }
+
+	// Stops the decoding, the track keeps what was decoded so far.
+	void cancel() { m_cancel = true; }
+
+	// fraction of the file read
+	double progress() const { return m_progress; }
+	bool finished() const { return m_finished; }
+
+	// finished and not cancelled, known once the track is no longer loading
+	bool complete() const { return m_complete; }
+
+private:
+	AudioLoader();
+
+	AudioInput* m_input = nullptr;
+	TrackBuffer* m_track = nullptr;
+	Listener* m_listener = nullptr;
+	std::string m_file_name;
+
+	std::atomic<bool> m_cancel;
+	std::atomic<bool> m_finished;
+	std::atomic<bool> m_complete;
+	std::atomic<double> m_progress;
+
+	std::thread m_thread;
+	void _thread_func();
+};
+
+// Opens the file as a read-only track decoded page by page as it is read, after one
+// pass over the packets to index them, or maps it from the AudioCache. Falls back to
+// ReadAudioFromFileParallel when the packets cannot be indexed, or their durations
+// disagree with their timestamps. When a read decodes frames that are not where the
+// index put them, the file is decoded serially on a thread of its own and the pages
+// come from there once it is done, with the length of the index. The track is not
+// stored in the AudioCache: ReadAudioFromFile or an AudioLoader decodes and stores it.
+TrackBuffer* OpenAudioFile(const char* fileName);
+// Encodes interleaved stereo frames to an MP3 or FLAC file as they are written, in
+// whole frames of the encoder.
+class AudioEncoder : public AudioWriter
+{
+public:
+	// nullptr when the file cannot be written
+	static AudioEncoder* s_open(const char* fileName, unsigned sample_rate, int bit_rate = 192000);
+
+	// FLAC of 16 or 24 bits, with triangular dither from libswresample when asked
+	static AudioEncoder* s_open_flac(const char* fileName, unsigned sample_rate, int bits = 16, bool dither = true);
+
+	// closes the file when still open
+	~AudioEncoder();
+
+	virtual bool write(const float* frames, unsigned count);
+
+	// encodes what is left and the encoder's delay, and finishes the file
+	virtual bool close();
+
+private:
+	AudioEncoder() {}
+
+	AudioOutput* m_output = nullptr;
+	unsigned m_frame_size = 0;
+	std::vector<float> m_pending;
+	bool _encode(const float* frames, unsigned count);
+};
+
+// Encodes MP3 like AudioEncoder, on several threads. The frames are cut into segments of
+// whole MP3 frames, each encoded on a thread of its own along with a few frames before and
+// after it, so that the encoder is primed and has its lookahead. Only the packets of the
+// segment itself are kept and written out in order, with the timestamps of a single
+// encoder, so the encoder delay and the padding of the file are those of one encoder and
+// the file plays gaplessly. The bit reservoir is off, since a frame could otherwise refer
+// to bytes of the frames before it in its own segment.
+class ParallelMp3Encoder : public AudioWriter
+{
+public:
+	// At most num_threads segments are encoded at once, 0 for one per core.
+	// nullptr when the file cannot be written.
+	static ParallelMp3Encoder* s_open(const char* fileName, unsigned sample_rate, int bit_rate = 192000, int num_threads = 0);
+
+	// closes the file when still open
+	~ParallelMp3Encoder();
+
+	virtual bool write(const float* frames, unsigned count);
+
+	// encodes the last segment and waits for all of them to be written
+	virtual bool close();
+
+private:
+	ParallelMp3Encoder() {}
+
+	AudioOutput* m_output = nullptr;
+	unsigned m_frame_size = 0;
+	size_t m_num_threads = 1;
+	std::vector<float> m_pending; // from the first frame encoded with the next segment
+	int64_t m_pending_pos = 0; // of the first pending frame in the file
+	std::deque<EncodeSegment*> m_segments; // being encoded, in file order
+	bool m_ok = true;
+
+	void _start_segment(bool last);
+	void _write_segment();
+};
+
+// Converts interleaved stereo frames from rate_in to rate_out with libswresample on
+// the way to another writer, which stays the caller's.
+class ResampleWriter : public AudioWriter
+{
+public:
+	ResampleWriter(AudioWriter* writer, unsigned rate_in, unsigned rate_out);
+	~ResampleWriter();
+
+	virtual bool write(const float* frames, unsigned count);
+
+	// writes what the resampler holds back and closes the writer
+	virtual bool close();
+
+private:
+	AudioWriter* m_writer;
+	SwrContext* m_swr_ctx;
+	std::vector<float> m_buf;
+	bool m_closed = false;
+	bool _convert(const float* frames, unsigned count);
+};
+
+// Converts a track to interleaved stereo at the rate of another track with libswresample,
+// appending to it as the input grows. convert may be called whenever more of the input
+// is there, finish flushes the resampler once all of it is. Both tracks stay the caller's.
+class TrackResampler
+{
+public:
+	TrackResampler(TrackBuffer* in, TrackBuffer* out);
+	~TrackResampler();
+
+	// converts the input up to frame end, false when libswresample fails
+	bool convert(unsigned end);
+
+	// converts what is left and what the resampler holds back, up to the length of the
+	// whole input at the output rate
+	bool finish();
+
+	// input frames converted so far
+	unsigned input_pos() const { return m_pos; }
+
+private:
+	TrackBuffer* m_in;
+	TrackBuffer* m_out;
+	SwrContext* m_swr_ctx;
+	unsigned m_pos = 0;
+	uint64_t m_out_pos = 0;
+	std::vector<float> m_in_buf;
+	std::vector<float> m_out_buf;
+	bool _convert(unsigned count, uint64_t max_out);
+};
+
+// Encodes the whole track through an AudioEncoder, or a ParallelMp3Encoder on
+// num_threads threads when that is not 1 (0 for one per core)
+void WriteAudioToFile(TrackBuffer* track, const char* fileName, int bit_rate=192000, int num_threads=1);
 void DumpAudioToRawFile(TrackBuffer* track, const char* fileName);
+
+// Converts the whole track to interleaved stereo frames at sample_rate using libswresample.
+// False when the conversion fails, the frames then end where it did.
+bool ResampleToBuffer(TrackBuffer* track, unsigned sample_rate, std::vector<float>& frames);
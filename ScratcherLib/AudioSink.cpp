@@ -0,0 +1,164 @@
+#include <chrono>
+#include <algorithm>
+#include "AudioSink.h"
+#include "AudioExport.h"
+
+inline int64_t time_nano_sec()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// frames played after elapsed_ns of playing, up to what the device has been given
+static uint64_t s_played(int64_t elapsed_ns, unsigned sample_rate, uint64_t given)
+{
+	if (elapsed_ns <= 0) return 0;
+	uint64_t played = (uint64_t)elapsed_ns * sample_rate / 1000000000;
+	return std::min(played, given);
+}
+
+NullAudioSink::NullAudioSink(unsigned sample_rate, int period, bool realtime)
+	: m_sample_rate(sample_rate), m_period(period), m_realtime(realtime)
+	, m_frames_played(0), m_idle(false), m_num_underruns(0), m_quit(false)
+	, m_callbacks(0), m_max_callback(0), m_total_callback(0), m_max_wake_delay(0)
+{
+}
+
+NullAudioSink::~NullAudioSink()
+{
+	stop();
+}
+
+bool NullAudioSink::start(Source* source)
+{
+	stop();
+	m_source = source;
+	m_frames_played = 0;
+	m_idle = false;
+	m_num_underruns = 0;
+	m_callbacks = 0;
+	m_max_callback = 0;
+	m_total_callback = 0;
+	m_max_wake_delay = 0;
+	m_quit = false;
+	m_thread = std::thread(&NullAudioSink::_thread_func, this);
+	return true;
+}
+
+void NullAudioSink::stop()
+{
+	if (m_thread.joinable())
+	{
+		m_quit = true;
+		m_thread.join();
+	}
+}
+
+NullAudioSink::Stats NullAudioSink::stats() const
+{
+	Stats stats;
+	stats.callbacks = m_callbacks;
+	stats.max_callback = m_max_callback;
+	stats.total_callback = m_total_callback;
+	stats.max_wake_delay = m_max_wake_delay;
+	return stats;
+}
+
+// The simulated device holds two periods: the one playing and the one after it.
+// Pull k is made as period k-1 starts playing and has to be back before it ends.
+// When late, the device is silent for that long and goes on from there.
+void NullAudioSink::_thread_func()
+{
+	std::vector<float> buf(m_period * 2);
+	int64_t period_ns = (int64_t)m_period * 1000000000 / (int64_t)m_sample_rate;
+	int64_t origin = time_nano_sec();
+	uint64_t pulled = 0;
+
+	for (uint64_t k = 0; !m_quit; k++)
+	{
+		int64_t due = origin + (int64_t)k * period_ns;
+		if (m_realtime)
+		{
+			int64_t t = time_nano_sec();
+			bool slept = false;
+			while (t < due && !m_quit)
+			{
+				m_frames_played = s_played(t - origin - period_ns, m_sample_rate, pulled);
+				std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(due - t, (int64_t)1000000)));
+				t = time_nano_sec();
+				slept = true;
+			}
+			uint64_t wake_delay = slept && t >= due ? (uint64_t)((t - due) / 1000) : 0;
+			if (wake_delay > m_max_wake_delay) m_max_wake_delay = wake_delay;
+			m_frames_played = s_played(t - origin - period_ns, m_sample_rate, pulled);
+		}
+
+		int64_t t0 = time_nano_sec();
+		bool more = m_source->pull(buf.data(), m_period);
+		int64_t t1 = time_nano_sec();
+
+		uint64_t duration = (uint64_t)((t1 - t0) / 1000);
+		m_callbacks++;
+		m_total_callback += duration;
+		if (duration > m_max_callback) m_max_callback = duration;
+
+		if (!more)
+		{
+			m_frames_played = pulled;
+			m_idle = true;
+			break;
+		}
+		_consume(buf.data(), m_period);
+		pulled += (uint64_t)m_period;
+
+		if (m_realtime)
+		{
+			int64_t deadline = due + period_ns;
+			if (t1 > deadline)
+			{
+				m_num_underruns++;
+				origin += t1 - deadline;
+			}
+		}
+		else
+		{
+			m_frames_played = pulled;
+		}
+	}
+}
+
+WavAudioSink::WavAudioSink(const char* filename, unsigned sample_rate, int period, bool realtime)
+	: NullAudioSink(sample_rate, period, realtime)
+{
+	m_fp = fopen(filename, "wb");
+	if (m_fp != nullptr) _write_header();
+}
+
+WavAudioSink::~WavAudioSink()
+{
+	stop();
+	if (m_fp != nullptr) fclose(m_fp);
+}
+
+void WavAudioSink::stop()
+{
+	NullAudioSink::stop();
+	if (m_fp != nullptr)
+	{
+		fseek(m_fp, 0, SEEK_SET);
+		_write_header();
+		fseek(m_fp, 0, SEEK_END);
+		fflush(m_fp);
+	}
+}
+
+void WavAudioSink::_consume(const float* buf, int count)
+{
+	if (m_fp == nullptr) return;
+	fwrite(buf, sizeof(float), count * 2, m_fp);
+	m_frames_written += (uint64_t)count;
+}
+
+void WavAudioSink::_write_header()
+{
+	WriteWavHeader(m_fp, sample_rate(), 32, m_frames_written);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+// Where playback goes. A sink pulls interleaved stereo frames from its source
+// at its own pace, the way a sound device calls back for the next period.
+class AudioSink
+{
+public:
+	class Source
+	{
+	public:
+		virtual ~Source() {}
+
+		// Fills count frames, padding with silence when short.
+		// Returns false once there is nothing more to play.
+		virtual bool pull(float* buf, int count) = 0;
+	};
+
+	virtual ~AudioSink() {}
+
+	virtual unsigned sample_rate() const = 0;
+	virtual bool start(Source* source) = 0;
+	virtual void stop() = 0;
+
+	// frames played since start, the clock of the device: what has been heard,
+	// not counting frames pulled and still queued in the device
+	virtual uint64_t frames_played() const = 0;
+
+	// the source has ended and everything from it has been played
+	virtual bool idle() const = 0;
+
+	// times the device ran out of frames before the source ended
+	virtual unsigned num_underruns() const = 0;
+};
+
+// A sound device without sound. Pulls period frames at a time on its own thread,
+// paced like a device playing at sample_rate, or as fast as the source delivers
+// when realtime is false. A pull that returns later than the device would
+// have run dry is counted as an underrun.
+class NullAudioSink : public AudioSink
+{
+public:
+	NullAudioSink(unsigned sample_rate, int period = 512, bool realtime = true);
+	virtual ~NullAudioSink();
+
+	virtual unsigned sample_rate() const { return m_sample_rate; }
+	virtual bool start(Source* source);
+	virtual void stop();
+	virtual uint64_t frames_played() const { return m_frames_played; }
+	virtual bool idle() const { return m_idle; }
+	virtual unsigned num_underruns() const { return m_num_underruns; }
+
+	int period() const { return m_period; }
+
+	// timing of the pulls since start, in microseconds
+	struct Stats
+	{
+		uint64_t callbacks;
+		uint64_t max_callback;
+		uint64_t total_callback;
+		uint64_t max_wake_delay;
+	};
+	Stats stats() const;
+
+protected:
+	// every period pulled, on the sink thread
+	virtual void _consume(const float* buf, int count) {}
+
+private:
+	unsigned m_sample_rate;
+	int m_period;
+	bool m_realtime;
+	Source* m_source = nullptr;
+
+	std::atomic<uint64_t> m_frames_played;
+	std::atomic<bool> m_idle;
+	std::atomic<unsigned> m_num_underruns;
+	std::atomic<bool> m_quit;
+
+	std::atomic<uint64_t> m_callbacks;
+	std::atomic<uint64_t> m_max_callback;
+	std::atomic<uint64_t> m_total_callback;
+	std::atomic<uint64_t> m_max_wake_delay;
+
+	std::thread m_thread;
+	void _thread_func();
+};
+
+// Plays into a 32 bit float WAV file, as fast as possible by default.
+class WavAudioSink : public NullAudioSink
+{
+public:
+	WavAudioSink(const char* filename, unsigned sample_rate, int period = 512, bool realtime = false);
+	virtual ~WavAudioSink();
+
+	bool is_open() const { return m_fp != nullptr; }
+	virtual void stop();
+
+protected:
+	virtual void _consume(const float* buf, int count);
+
+private:
+	FILE* m_fp;
+	uint64_t m_frames_written = 0;
+	void _write_header();
+};
@@ -1,7 +1,55 @@
+#include <cmath>
 #include <algorithm>
 #include "CHSpline.h"
 
-void CHSpline::left_bound(float& x, float& y, float& slope)
+static bool s_less(const CHSpline::Sample& lhs, const CHSpline::Sample& rhs)
+{
+	return lhs.x < rhs.x;
+}
+
+void CHSpline::segment(const Sample& s0, const Sample& s1, float x, float& y, float& slope)
+{
+	float x0 = s0.x;
+	float y0 = s0.y;
+	float x1 = s1.x;
+	float y1 = s1.y;
+	float t = (x - x0) / (x1 - x0);
+
+	if (s0.kind == ConstantSpeed)
+	{
+		y = y0 + (y1 - y0) * t;
+		slope = (y1 - y0) / (x1 - x0);
+		return;
+	}
+
+	if (s0.kind == Oscillation)
+	{
+		static const float s_two_pi = 6.283185307f;
+		float cycles = std::max(1.0f, floorf(s0.rate * (x1 - x0) + 0.5f));
+		float w = s_two_pi * cycles;
+		y = y0 + (y1 - y0) * t + s0.depth * sinf(w * t);
+		slope = (y1 - y0 + s0.depth * w * cosf(w * t)) / (x1 - x0);
+		return;
+	}
+
+	float s_0 = s0.slope;
+	float s_1 = s1.slope;
+	float t2 = t * t;
+	float t3 = t2 * t;
+
+	y = (2.0f*t3 - 3.0f*t2 + 1)*y0 + (-2.0f*t3 + 3.0f*t2)*y1
+		+ (x1 - x0)*((t3 - 2.0f*t2 + t) * s_0 + (t3 - t2) * s_1);
+
+	slope = ((6.0f*t2 - 6.0f*t) * y0 + (-6.0f*t2 + 6.0f*t)*y1) / (x1 - x0)
+		+ (3.0f*t2 - 4.0f*t + 1.0f)*s_0 + (3.0f*t2 - 2.0f*t)*s_1;
+}
+
+void CHSpline::Load(const Sample* samples, size_t count)
+{
+	m_samples.assign(samples, count);
+}
+
+void CHSpline::left_bound(float& x, float& y, float& slope) const
 {
 	const auto& sample = m_samples[0];
 	x = sample.x;
@@ -9,7 +57,7 @@ void CHSpline::left_bound(float& x, float& y, float& slope)
 	slope = sample.slope;
 }
 
-void CHSpline::right_bound(float& x, float& y, float& slope)
+void CHSpline::right_bound(float& x, float& y, float& slope) const
 {
 	const auto& sample = m_samples[m_samples.size() - 1];
 	x = sample.x;
@@ -20,11 +68,8 @@ void CHSpline::right_bound(float& x, float& y, float& slope)
 int CHSpline::Add(float x, float y)
 {
 	Sample temp = { x, y, 0.0f };
-	auto iter = std::upper_bound(m_samples.begin(), m_samples.end(), temp, [](const Sample& lhs, const Sample& rhs) -> bool { return lhs.x < rhs.x; });
-	size_t i = m_samples.size();
-	if (iter != m_samples.end())
-		i = iter - m_samples.begin();
-	m_samples.insert(m_samples.begin() + i, temp);		
+	size_t i = m_samples.upper_bound(temp, s_less);
+	m_samples.insert(i, temp);		
 	return i;
 }
 
@@ -48,88 +93,105 @@ void CHSpline::SetSlope(size_t i, float slope)
 	m_samples[i].slope = slope;
 }
 
-void CHSpline::Remove(size_t i)
+void CHSpline::SetSegment(size_t i, int kind, float rate, float depth)
 {
-	m_samples.erase(m_samples.begin() + i);
+	m_samples[i].kind = kind;
+	m_samples[i].rate = rate;
+	m_samples[i].depth = depth;
 }
 
-
-bool CHSpline::f(float x, float& y, float& slope)
+void CHSpline::Remove(size_t i)
 {
-	Sample temp = { x, y, 0.0f };
-	auto iter = std::upper_bound(m_samples.begin(), m_samples.end(), temp, [](const Sample& lhs, const Sample& rhs) -> bool { return lhs.x < rhs.x; });
-	if (iter == m_samples.begin() || iter == m_samples.end()) return false;
-	size_t i = iter - m_samples.begin() - 1;
-
-	float x0 = m_samples[i].x;
-	float y0 = m_samples[i].y;
-	float s0 = m_samples[i].slope;
-	float x1 = m_samples[i + 1].x;
-	float y1 = m_samples[i + 1].y;
-	float s1 = m_samples[i + 1].slope;
-	float t = (x - x0) / (x1 - x0);
-	float t2 = t * t;
-	float t3 = t2 * t;
+	m_samples.erase(i);
+}
 
 
-	y = (2.0f*t3 - 3.0f*t2 + 1)*y0 + (-2.0f*t3 + 3.0f*t2)*y1
-		+ (x1 - x0)*((t3 - 2.0f*t2 + t) * s0 + (t3 - t2) * s1);
+bool CHSpline::f(float x, float& y, float& slope) const
+{
+	Cursor hint;
+	return f(x, y, slope, hint);
+}
 
-	slope = ((6.0f*t2 - 6.0f*t) * y0 + (-6.0f*t2 + 6.0f*t)*y1) / (x1 - x0)
-		+ (3.0f*t2 - 4.0f*t + 1.0f)*s0 + (3.0f*t2 - 2.0f*t)*s1;
+bool CHSpline::f(float x, float& y, float& slope, Cursor& hint) const
+{
+	Sample temp = { x, y, 0.0f };
+	m_samples.seek_upper_bound(temp, s_less, hint);
+	if (hint.index() == 0 || hint.index() == m_samples.size()) return false;
 
+	Cursor c = hint;
+	const Sample& s1 = *c;
+	const Sample& s0 = *--c;
+	segment(s0, s1, x, y, slope);
 	return true;
 }
 
-void CHSpline::uniform_samples(float interval, float start_x, std::vector<float>& v)
+void CHSpline::uniform_samples(float interval, float start_x, std::vector<float>& v) const
 {
 	Sample temp = { start_x, 0.0f, 0.0f };
-	auto iter = std::upper_bound(m_samples.begin(), m_samples.end(), temp, [](const Sample& lhs, const Sample& rhs) -> bool { return lhs.x < rhs.x; });
-	if (iter == m_samples.begin() || iter == m_samples.end()) return;
-	size_t i = iter - m_samples.begin() - 1;
+	Cursor c;
+	m_samples.seek_upper_bound(temp, s_less, c);
+	if (c.index() == 0 || c.index() == m_samples.size()) return;
+	--c;
 	float x = start_x;
 	v.clear();
-	while (i < m_samples.size() - 1)
+	while (c.index() < m_samples.size() - 1)
 	{
-		float x0 = m_samples[i].x;
-		float y0 = m_samples[i].y;
-		float s0 = m_samples[i].slope;
-		float x1 = m_samples[i + 1].x;
-		float y1 = m_samples[i + 1].y;
-		float s1 = m_samples[i + 1].slope;
-
-		while (x < x1)
+		const Sample& s0 = *c;
+		const Sample& s1 = *++c;
+		while (x < s1.x)
 		{
-			float t = (x - x0) / (x1 - x0);
-			float t2 = t * t;
-			float t3 = t2 * t;
-
-			float y = (2.0f*t3 - 3.0f*t2 + 1)*y0 + (-2.0f*t3 + 3.0f*t2)*y1
-				+ (x1 - x0)*((t3 - 2.0f*t2 + t) * s0 + (t3 - t2) * s1);
-
+			float y, slope;
+			segment(s0, s1, x, y, slope);
 			v.push_back(y);
-
 			x += interval;
 		}
-		i++;
 	}
 }
 
-
-void CHSpline::serialize(FILE* fp)
+// Maps without parametric segments keep the original record of x, y and slope.
+// Otherwise the count is written negated and followed by full records.
+void CHSpline::serialize(FILE* fp) const
 {
-	int num_samples = (int)(m_samples.size());
-	fwrite(&num_samples, sizeof(int), 1, fp);
-	fwrite(m_samples.data(), sizeof(Sample), m_samples.size(), fp);
+	std::vector<Sample> samples(m_samples.size());
+	m_samples.copy_to(samples.data());
+	bool parametric = false;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		if (samples[i].kind != Hermite) parametric = true;
+	}
+
+	int num_samples = (int)(samples.size());
+	if (parametric)
+	{
+		num_samples = -num_samples;
+		fwrite(&num_samples, sizeof(int), 1, fp);
+		fwrite(samples.data(), sizeof(Sample), samples.size(), fp);
+	}
+	else
+	{
+		fwrite(&num_samples, sizeof(int), 1, fp);
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			fwrite(&samples[i].x, sizeof(float), 3, fp);
+		}
+	}
 }
 
 void CHSpline::deserialize(FILE* fp)
 {
 	int num_samples;
 	fread(&num_samples, sizeof(int), 1, fp);
-	m_samples.resize(num_samples);
-	fread(m_samples.data(), sizeof(Sample), m_samples.size(), fp);
+	std::vector<Sample> samples(num_samples < 0 ? -num_samples : num_samples);
+	if (num_samples < 0)
+	{
+		fread(samples.data(), sizeof(Sample), samples.size(), fp);
+	}
+	else
+	{
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			fread(&samples[i].x, sizeof(float), 3, fp);
+		}
+	}
+	m_samples.assign(samples.data(), samples.size());
 }
-
-
-
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <vector>
+#include "ChunkedVector.h"
 
 class CHSpline
 {
@@ -9,30 +10,54 @@ public:
 	CHSpline() {}
 	~CHSpline() {}
 
+	// How the segment from a sample to the next one is evaluated
+	enum SegmentKind
+	{
+		Hermite = 0,
+		ConstantSpeed = 1, // straight line between the two ends
+		Oscillation = 2, // straight line plus a sine of "depth" seconds, rounded to whole cycles at "rate" Hz
+	};
+
 	struct Sample
 	{
 		float x;
 		float y;
 		float slope;
+		int kind;
+		float rate;
+		float depth;
 	};
 
+	typedef ChunkedVector<Sample>::Cursor Cursor;
+
 	size_t num_samples() const { return m_samples.size(); }
 	const Sample& sample(size_t i) const { return m_samples[i]; }
-	void left_bound(float& x, float& y, float& slope);
-	void right_bound(float& x, float& y, float& slope);
+	// for walking the samples in order, see ChunkedVector::Cursor
+	Cursor cursor(size_t i) const { return m_samples.cursor(i); }
+	void left_bound(float& x, float& y, float& slope) const;
+	void right_bound(float& x, float& y, float& slope) const;
+
+	// replaces all samples, expects them sorted by x
+	void Load(const Sample* samples, size_t count);
 
 	int Add(float x, float y);
 	void Move(size_t i, float y);
 	float Move(size_t i, float x, float y);
 	void SetSlope(size_t i, float slope);
+	void SetSegment(size_t i, int kind, float rate, float depth);
 	void Remove(size_t i);
 
-	bool f(float x, float& y, float& slope);
-	void uniform_samples(float interval, float start_x, std::vector<float>& v);
+	// value and slope at x of the segment from s0 to s1, evaluated as s0.kind says
+	static void segment(const Sample& s0, const Sample& s1, float x, float& y, float& slope);
+
+	bool f(float x, float& y, float& slope) const;
+	// the same, starting the search from the segment of the last call with this hint
+	bool f(float x, float& y, float& slope, Cursor& hint) const;
+	void uniform_samples(float interval, float start_x, std::vector<float>& v) const;
 
-	void serialize(FILE* fp);
+	void serialize(FILE* fp) const;
 	void deserialize(FILE* fp);
 
 private:
-	std::vector<Sample> m_samples;
+	ChunkedVector<Sample> m_samples;
 };
\ No newline at end of file
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+// Ordered sequence stored as a list of bounded contiguous chunks.
+// Insert and erase only move elements inside one chunk, lookups by value
+// are a binary search over the chunks followed by one inside a chunk.
+// Copies share their chunks, a chunk is duplicated when first modified.
+template <class T>
+class ChunkedVector
+{
+public:
+	static const size_t s_max_chunk = 1024;
+
+	// Read-only position in the sequence, valid until the sequence is changed.
+	// Stepping to a neighbour is O(1) where operator[] searches the chunks,
+	// for the loops that walk neighbouring elements.
+	class Cursor
+	{
+	public:
+		size_t index() const { return m_index; }
+		const T& operator*() const { return (*m_owner->m_chunks[m_chunk])[m_pos]; }
+		const T* operator->() const { return &**this; }
+
+		Cursor& operator++()
+		{
+			m_index++;
+			if (++m_pos == m_owner->m_chunks[m_chunk]->size())
+			{
+				m_chunk++;
+				m_pos = 0;
+			}
+			return *this;
+		}
+
+		Cursor& operator--()
+		{
+			m_index--;
+			if (m_pos == 0)
+			{
+				m_chunk--;
+				m_pos = m_owner->m_chunks[m_chunk]->size();
+			}
+			m_pos--;
+			return *this;
+		}
+
+	private:
+		friend class ChunkedVector;
+		const ChunkedVector* m_owner = nullptr;
+		size_t m_chunk = 0;
+		size_t m_pos = 0;
+		size_t m_index = 0;
+	};
+
+	// at element i, or at the end for size()
+	Cursor cursor(size_t i) const
+	{
+		Cursor c;
+		c.m_owner = this;
+		c.m_index = i;
+		if (i >= m_size)
+		{
+			c.m_chunk = m_chunks.size();
+			c.m_index = m_size;
+		}
+		else
+		{
+			c.m_chunk = _find(i);
+			c.m_pos = i - m_offsets[c.m_chunk];
+		}
+		return c;
+	}
+
+	size_t size() const { return m_size; }
+
+	const T& operator[](size_t i) const
+	{
+		size_t c = _find(i);
+		return (*m_chunks[c])[i - m_offsets[c]];
+	}
+
+	T& operator[](size_t i)
+	{
+		size_t c = _find(i);
+		return _chunk(c)[i - m_offsets[c]];
+	}
+
+	void clear()
+	{
+		m_chunks.clear();
+		m_offsets.clear();
+		m_size = 0;
+	}
+
+	// bulk load, chunks are filled to half so that later inserts do not split at once
+	void assign(const T* data, size_t count)
+	{
+		clear();
+		size_t fill = s_max_chunk / 2;
+		for (size_t i = 0; i < count; i += fill)
+		{
+			size_t n = std::min(fill, count - i);
+			m_chunks.push_back(std::make_shared<std::vector<T>>(data + i, data + i + n));
+			m_offsets.push_back(i);
+		}
+		m_size = count;
+	}
+
+	void copy_to(T* data) const
+	{
+		for (size_t c = 0; c < m_chunks.size(); c++)
+		{
+			std::copy(m_chunks[c]->begin(), m_chunks[c]->end(), data + m_offsets[c]);
+		}
+	}
+
+	void insert(size_t i, const T& v)
+	{
+		if (m_chunks.empty())
+		{
+			m_chunks.push_back(std::make_shared<std::vector<T>>(1, v));
+			m_offsets.push_back(0);
+			m_size = 1;
+			return;
+		}
+
+		size_t c = i < m_size ? _find(i) : m_chunks.size() - 1;
+		std::vector<T>& chunk = _chunk(c);
+		chunk.insert(chunk.begin() + (i - m_offsets[c]), v);
+		m_size++;
+
+		if (chunk.size() > s_max_chunk)
+		{
+			size_t half = chunk.size() / 2;
+			std::shared_ptr<std::vector<T>> upper = std::make_shared<std::vector<T>>(chunk.begin() + half, chunk.end());
+			chunk.resize(half);
+			m_chunks.insert(m_chunks.begin() + c + 1, upper);
+			m_offsets.insert(m_offsets.begin() + c + 1, 0);
+		}
+		_update_offsets(c);
+	}
+
+	void erase(size_t i)
+	{
+		size_t c = _find(i);
+		std::vector<T>& chunk = _chunk(c);
+		chunk.erase(chunk.begin() + (i - m_offsets[c]));
+		m_size--;
+
+		if (chunk.empty())
+		{
+			m_chunks.erase(m_chunks.begin() + c);
+			m_offsets.erase(m_offsets.begin() + c);
+			if (c > 0) c--;
+		}
+		_update_offsets(c);
+	}
+
+	// index of the first element greater than v
+	template <class Less>
+	size_t upper_bound(const T& v, Less less) const
+	{
+		Cursor c;
+		seek_upper_bound(v, less, c);
+		return c.index();
+	}
+
+	// Moves c to the first element greater than v. A cursor of this sequence is stepped
+	// forward when v is a little past it, as in a loop over increasing values,
+	// anything else is searched for.
+	template <class Less>
+	void seek_upper_bound(const T& v, Less less, Cursor& c) const
+	{
+		static const int s_max_steps = 4;
+		if (c.m_owner == this && c.m_index <= m_size)
+		{
+			for (int k = 0; k < s_max_steps && c.m_index < m_size && !less(v, *c); k++) ++c;
+			bool below = c.m_index == m_size || less(v, *c);
+			bool above = c.m_index == 0;
+			if (!above)
+			{
+				Cursor prev = c;
+				--prev;
+				above = !less(v, *prev);
+			}
+			if (below && above) return;
+		}
+
+		c = Cursor();
+		c.m_owner = this;
+		size_t lo = 0;
+		size_t hi = m_chunks.size();
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (less(v, m_chunks[mid]->back())) hi = mid;
+			else lo = mid + 1;
+		}
+		c.m_chunk = lo;
+		if (lo == m_chunks.size())
+		{
+			c.m_index = m_size;
+			return;
+		}
+		const std::vector<T>& chunk = *m_chunks[lo];
+		c.m_pos = std::upper_bound(chunk.begin(), chunk.end(), v, less) - chunk.begin();
+		c.m_index = m_offsets[lo] + c.m_pos;
+	}
+
+private:
+	std::vector<std::shared_ptr<std::vector<T>>> m_chunks;
+	std::vector<size_t> m_offsets;
+	size_t m_size = 0;
+
+	size_t _find(size_t i) const
+	{
+		return std::upper_bound(m_offsets.begin(), m_offsets.end(), i) - m_offsets.begin() - 1;
+	}
+
+	std::vector<T>& _chunk(size_t c)
+	{
+		if (m_chunks[c].use_count() > 1)
+			m_chunks[c] = std::make_shared<std::vector<T>>(*m_chunks[c]);
+		return *m_chunks[c];
+	}
+
+	void _update_offsets(size_t from)
+	{
+		for (size_t c = from; c < m_chunks.size(); c++)
+		{
+			m_offsets[c] = c > 0 ? m_offsets[c - 1] + m_chunks[c - 1]->size() : 0;
+		}
+	}
+};
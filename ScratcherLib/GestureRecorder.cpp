@@ -0,0 +1,136 @@
+#include <cmath>
+#include "GestureRecorder.h"
+#include "SamplerScratch.h"
+#include "CHSpline.h"
+
+static CHSpline::Sample s_spline_sample(const GestureRecorder::Point& p)
+{
+	CHSpline::Sample s = { p.x, p.y, p.slope, CHSpline::Hermite, 0.0f, 0.0f };
+	return s;
+}
+
+GestureRecorder::GestureRecorder(float tolerance) : m_tolerance(tolerance)
+{
+}
+
+void GestureRecorder::begin()
+{
+	m_num_samples = 0;
+	m_pending.clear();
+	m_points.clear();
+	m_candidate = Point();
+}
+
+void GestureRecorder::add_sample(float t, float pos)
+{
+	if (!m_pending.empty() && t <= m_pending.back().x) return;
+	Sample s = { t, pos };
+	m_pending.push_back(s);
+	m_num_samples++;
+
+	size_t n = m_pending.size();
+	if (m_points.empty())
+	{
+		if (n < 2) return;
+		Point first = { m_pending[0].x, m_pending[0].y, _slope(0, 1) };
+		m_points.push_back(first);
+	}
+	if (n < 3) return;
+
+	// try to end the current segment at the previous sample, which has a neighbour on both sides
+	Point end = { m_pending[n - 2].x, m_pending[n - 2].y, _slope(n - 3, n - 1) };
+	if (n <= s_max_pending && _fits(end, n - 2))
+	{
+		m_candidate = end;
+		return;
+	}
+
+	// the last segment that fitted is final, the next one starts from its end
+	m_points.push_back(m_candidate);
+	m_pending.erase(m_pending.begin(), m_pending.begin() + (n - 3));
+	Point next = { m_pending[1].x, m_pending[1].y, _slope(0, 2) };
+	m_candidate = next;
+}
+
+void GestureRecorder::end()
+{
+	size_t n = m_pending.size();
+	if (n >= 2)
+	{
+		Point last = { m_pending[n - 1].x, m_pending[n - 1].y, _slope(n - 2, n - 1) };
+		if (n >= 3 && !_fits(last, n - 1))
+			m_points.push_back(m_candidate);
+		m_points.push_back(last);
+	}
+	m_pending.clear();
+}
+
+bool GestureRecorder::apply(SamplerScratch* sampler) const
+{
+	if (m_points.size() < 2) return false;
+	float x_begin = m_points.front().x;
+	float x_end = m_points.back().x;
+
+	size_t num_old = sampler->num_control_points();
+	std::vector<float> x, y, slope;
+	x.reserve(num_old + m_points.size());
+	y.reserve(num_old + m_points.size());
+	slope.reserve(num_old + m_points.size());
+
+	size_t j = 0;
+	for (; j < num_old; j++)
+	{
+		float px, py, ps;
+		sampler->control_point(j, px, py, ps);
+		if (px >= x_begin) break;
+		x.push_back(px);
+		y.push_back(py);
+		slope.push_back(ps);
+	}
+
+	// a gesture from the very start also moves the start point
+	size_t first = x_begin <= 0.0f ? 1 : 0;
+	for (size_t i = first; i < m_points.size(); i++)
+	{
+		x.push_back(m_points[i].x);
+		y.push_back(m_points[i].y);
+		slope.push_back(m_points[i].slope);
+	}
+
+	for (; j < num_old; j++)
+	{
+		float px, py, ps;
+		sampler->control_point(j, px, py, ps);
+		if (px <= x_end) continue;
+		x.push_back(px);
+		y.push_back(py);
+		slope.push_back(ps);
+	}
+
+	if (first > 0)
+		sampler->set_time_map(m_points[0].y, m_points[0].slope, x.size(), x.data(), y.data(), slope.data());
+	else
+		sampler->set_control_points(x.size(), x.data(), y.data(), slope.data());
+	return true;
+}
+
+float GestureRecorder::_slope(size_t i0, size_t i1) const
+{
+	const Sample& a = m_pending[i0];
+	const Sample& b = m_pending[i1];
+	return (b.y - a.y) / (b.x - a.x);
+}
+
+bool GestureRecorder::_fits(const Point& end, size_t count) const
+{
+	CHSpline::Sample s0 = s_spline_sample(m_points.back());
+	CHSpline::Sample s1 = s_spline_sample(end);
+	for (size_t i = 1; i < count; i++)
+	{
+		const Sample& s = m_pending[i];
+		float y, slope;
+		CHSpline::segment(s0, s1, s.x, y, slope);
+		if (fabsf(y - s.y) > m_tolerance) return false;
+	}
+	return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+class SamplerScratch;
+
+// Turns a stream of (output time, source position) samples from a mouse drag
+// or a jog wheel into a few Hermite control points. Each segment is grown
+// sample by sample for as long as the curve through its ends stays within
+// the tolerance of every raw sample it covers.
+class GestureRecorder
+{
+public:
+	struct Point
+	{
+		float x;
+		float y;
+		float slope;
+	};
+
+	GestureRecorder(float tolerance = 0.002f);
+
+	float tolerance() const { return m_tolerance; }
+	void set_tolerance(float tolerance) { m_tolerance = tolerance; }
+
+	void begin();
+	// samples not later than the previous one are dropped
+	void add_sample(float t, float pos);
+	void end();
+
+	size_t num_samples() const { return m_num_samples; }
+	size_t num_points() const { return m_points.size(); }
+	const Point& point(size_t i) const { return m_points[i]; }
+
+	// Replaces the control points of the sampler between the first and the last recorded point.
+	// A gesture starting at time 0 also sets the start position and slope.
+	bool apply(SamplerScratch* sampler) const;
+
+private:
+	struct Sample
+	{
+		float x;
+		float y;
+	};
+
+	static const size_t s_max_pending = 512;
+
+	float m_tolerance;
+	size_t m_num_samples = 0;
+	std::vector<Sample> m_pending;
+	std::vector<Point> m_points;
+	Point m_candidate = Point(); // end of the longest segment that fitted so far
+
+	float _slope(size_t i0, size_t i1) const;
+	bool _fits(const Point& end, size_t count) const;
+};
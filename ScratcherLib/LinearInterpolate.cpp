@@ -1,14 +1,22 @@
+#include <cmath>
 #include <algorithm>
 #include "LinearInterpolate.h"
 
+static bool s_less(const LinearInterpolate::Sample& lhs, const LinearInterpolate::Sample& rhs)
+{
+	return lhs.x < rhs.x;
+}
+
+void LinearInterpolate::Load(const Sample* samples, size_t count)
+{
+	m_samples.assign(samples, count);
+}
+
 int LinearInterpolate::Add(float x, float y)
 {
 	Sample temp = { x, y  };
-	auto iter = std::upper_bound(m_samples.begin(), m_samples.end(), temp, [](const Sample& lhs, const Sample& rhs) -> bool { return lhs.x < rhs.x; });
-	size_t i = m_samples.size();
-	if (iter != m_samples.end())
-		i = iter - m_samples.begin();
-	m_samples.insert(m_samples.begin() + i, temp);
+	size_t i = m_samples.upper_bound(temp, s_less);
+	m_samples.insert(i, temp);
 	return i;
 }
 
@@ -26,40 +34,126 @@ float LinearInterpolate::Move(size_t i, float x, float y)
 	return x;
 }
 
+void LinearInterpolate::SetSegment(size_t i, int kind, float rate, float duty)
+{
+	m_samples[i].kind = kind;
+	m_samples[i].rate = rate;
+	m_samples[i].duty = duty;
+}
+
 void LinearInterpolate::Remove(size_t i)
 {
-	m_samples.erase(m_samples.begin() + i);
+	m_samples.erase(i);
 }
 
-bool LinearInterpolate::f(float x, float& y)
+bool LinearInterpolate::f(float x, float& y) const
+{
+	Cursor hint;
+	return f(x, y, hint);
+}
+
+bool LinearInterpolate::f(float x, float& y, Cursor& hint) const
 {
 	Sample temp = { x, y };
-	auto iter = std::upper_bound(m_samples.begin(), m_samples.end(), temp, [](const Sample& lhs, const Sample& rhs) -> bool { return lhs.x < rhs.x; });
-	if (iter == m_samples.begin() || iter == m_samples.end()) return false;
-	size_t i = iter - m_samples.begin() - 1;
-
-	float x0 = m_samples[i].x;
-	float y0 = m_samples[i].y;
-	float x1 = m_samples[i + 1].x;
-	float y1 = m_samples[i + 1].y;
+	m_samples.seek_upper_bound(temp, s_less, hint);
+	if (hint.index() == 0 || hint.index() == m_samples.size()) return false;
+
+	Cursor c = hint;
+	const Sample& s1 = *c;
+	const Sample& s0 = *--c;
+	float x0 = s0.x;
+	float y0 = s0.y;
+	float x1 = s1.x;
+	float y1 = s1.y;
 	float t = (x - x0) / (x1 - x0);
 	y = y0 * (1.0f - t) + y1 * t;
 
+	if (s0.kind == Gate)
+	{
+		float phase = (x - x0) * s0.rate;
+		if (phase - floorf(phase) >= s0.duty) y = 0.0f;
+	}
+
 	return true;
 }
 
-void LinearInterpolate::serialize(FILE* fp)
+size_t LinearInterpolate::gate_edges(double rate, double x_begin, double x_end, size_t max_edges, std::vector<int>& frames, size_t first) const
 {
-	int num_samples = (int)(m_samples.size());
-	fwrite(&num_samples, sizeof(int), 1, fp);
-	fwrite(m_samples.data(), sizeof(Sample), m_samples.size(), fp);
+	size_t count = 0;
+	if (first + 1 >= m_samples.size()) return count;
+	Cursor c = m_samples.cursor(first);
+	for (size_t i = first; i + 1 < m_samples.size(); i++)
+	{
+		const Sample& s0 = *c;
+		const Sample& s1 = *++c;
+		if (s0.kind != Gate || s0.rate <= 0.0f) continue;
+		double x0 = s0.x;
+		double x1 = std::min((double)s1.x, x_end);
+		if (x1 <= x_begin) continue;
+		double period = 1.0 / s0.rate;
+		// periods are counted rather than summed, so a short period far from 0 still advances
+		double n = x_begin > x0 ? floor((x_begin - x0) / period) : 0.0;
+		for (double x = x0 + n * period; x < x1; n += 1.0, x = x0 + n * period)
+		{
+			double edges[2] = { x, x + period * s0.duty };
+			for (int e = 0; e < 2; e++)
+			{
+				if (edges[e] >= x1 || edges[e] < x_begin) continue;
+				if (count >= max_edges) return count;
+				int frame = (int)ceil(edges[e] * rate);
+				frames.push_back(frame - 1);
+				frames.push_back(frame);
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+// Maps without gates keep the original record of x and y.
+// Otherwise the count is written negated and followed by full records.
+void LinearInterpolate::serialize(FILE* fp) const
+{
+	std::vector<Sample> samples(m_samples.size());
+	m_samples.copy_to(samples.data());
+	bool parametric = false;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		if (samples[i].kind != Linear) parametric = true;
+	}
+
+	int num_samples = (int)(samples.size());
+	if (parametric)
+	{
+		num_samples = -num_samples;
+		fwrite(&num_samples, sizeof(int), 1, fp);
+		fwrite(samples.data(), sizeof(Sample), samples.size(), fp);
+	}
+	else
+	{
+		fwrite(&num_samples, sizeof(int), 1, fp);
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			fwrite(&samples[i].x, sizeof(float), 2, fp);
+		}
+	}
 }
 
 void LinearInterpolate::deserialize(FILE* fp)
 {
 	int num_samples;
 	fread(&num_samples, sizeof(int), 1, fp);
-	m_samples.resize(num_samples);
-	fread(m_samples.data(), sizeof(Sample), m_samples.size(), fp);
+	std::vector<Sample> samples(num_samples < 0 ? -num_samples : num_samples);
+	if (num_samples < 0)
+	{
+		fread(samples.data(), sizeof(Sample), samples.size(), fp);
+	}
+	else
+	{
+		for (size_t i = 0; i < samples.size(); i++)
+		{
+			fread(&samples[i].x, sizeof(float), 2, fp);
+		}
+	}
+	m_samples.assign(samples.data(), samples.size());
 }
-
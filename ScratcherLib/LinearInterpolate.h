@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <vector>
+#include "ChunkedVector.h"
 
 class LinearInterpolate
 {
@@ -9,25 +10,51 @@ public:
 	LinearInterpolate() {}
 	~LinearInterpolate() {}
 	
+	// How the segment from a sample to the next one is evaluated
+	enum SegmentKind
+	{
+		Linear = 0,
+		Gate = 1, // the linear value is switched off for the last (1 - duty) of every period at "rate" Hz
+	};
+
 	struct Sample
 	{
 		float x;
 		float y;
+		int kind;
+		float rate;
+		float duty;
 	};
 
+	typedef ChunkedVector<Sample>::Cursor Cursor;
+
 	size_t num_samples() const { return m_samples.size(); }
 	const Sample& sample(size_t i) const { return m_samples[i]; }
+	// for walking the samples in order, see ChunkedVector::Cursor
+	Cursor cursor(size_t i) const { return m_samples.cursor(i); }
+
+	// replaces all samples, expects them sorted by x
+	void Load(const Sample* samples, size_t count);
 
 	int Add(float x, float y);
 	void Move(size_t i, float y);
 	float Move(size_t i, float x, float y);
+	void SetSegment(size_t i, int kind, float rate, float duty);
 	void Remove(size_t i);
 
-	bool f(float x, float& y);
+	bool f(float x, float& y) const;
+	// the same, starting the search from the segment of the last call with this hint
+	bool f(float x, float& y, Cursor& hint) const;
+
+	// Frames around every gate switch at the given frame rate: the last frame
+	// before the edge and the first one after, so knots placed there keep the step sharp.
+	// Only edges in [x_begin, x_end) are listed, at most max_edges of them; returns the count.
+	// The segments before first are skipped.
+	size_t gate_edges(double rate, double x_begin, double x_end, size_t max_edges, std::vector<int>& frames, size_t first = 0) const;
 
-	void serialize(FILE* fp);
+	void serialize(FILE* fp) const;
 	void deserialize(FILE* fp);
 
 private:
-	std::vector<Sample> m_samples;
+	ChunkedVector<Sample> m_samples;
 };
@@ -0,0 +1,254 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "LiveJog.h"
+#include "SamplerScratch.h"
+#include "TrackBuffer.h"
+
+static const size_t s_queue_size = 1024; // power of 2
+
+// alpha-beta gains of the position events
+static const double s_alpha = 0.5;
+static const double s_beta = 0.1;
+
+// a held platter that gets no event for this long (seconds) is taken as standing still
+static const double s_hold_timeout = 0.02;
+
+// time constant (seconds) of pulling the rendered position onto the prediction
+static const double s_smoothing = 0.002;
+
+// frames rendered along one straight line of positions
+static const int s_sub_block = 32;
+
+// frames rendered per call to SamplerScratch::render_positions
+static const int s_block = 256;
+
+// crossfade when engaging and releasing, no longer than s_block
+static const int s_fade_frames = 128;
+
+uint64_t LiveJog::s_now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LiveJog::LiveJog(Sampler* passthrough, SamplerScratch* scratch)
+	: m_passthrough(passthrough), m_scratch(scratch)
+	, m_prediction(0.0), m_queue(s_queue_size)
+	, m_queue_write(0), m_queue_read(0)
+	, m_engaged_out(false), m_position_out(0.0)
+{
+	m_sample_rate_in = scratch->buffer()->Rate();
+}
+
+LiveJog::~LiveJog()
+{
+}
+
+bool LiveJog::push(const Event& e)
+{
+	uint64_t w = m_queue_write.load(std::memory_order_relaxed);
+	uint64_t r = m_queue_read.load(std::memory_order_acquire);
+	if (w - r >= s_queue_size) return false;
+	m_queue[w & (s_queue_size - 1)] = e;
+	m_queue_write.store(w + 1, std::memory_order_release);
+	return true;
+}
+
+bool LiveJog::s_read_events(const char* filename, std::vector<Event>& events)
+{
+	FILE* fp = fopen(filename, "r");
+	if (fp == nullptr) return false;
+
+	static const char* s_kinds[] = { "engage", "position", "velocity", "release" };
+	events.clear();
+	char line[256];
+	bool ok = true;
+	while (fgets(line, sizeof(line), fp) != nullptr)
+	{
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+		double time, value = 0.0;
+		char kind[32];
+		if (sscanf(line, "%lf %31s %lf", &time, kind, &value) < 2 || time < 0.0)
+		{
+			ok = false;
+			break;
+		}
+		int k = 0;
+		for (; k < 4; k++)
+		{
+			if (strcmp(kind, s_kinds[k]) == 0) break;
+		}
+		if (k == 4)
+		{
+			ok = false;
+			break;
+		}
+		Event e = { (uint64_t)(time * 1000000.0 + 0.5), k, value };
+		events.push_back(e);
+	}
+	fclose(fp);
+	return ok;
+}
+
+double LiveJog::get_duration()
+{
+	return m_passthrough->get_duration();
+}
+
+void LiveJog::set_sample_rate(unsigned sample_rate)
+{
+	m_sample_rate_out = sample_rate;
+	m_passthrough->set_sample_rate(sample_rate);
+}
+
+bool LiveJog::get_sample(int i, float& l, float& r)
+{
+	float v[2];
+	bool res = get_samples(i, 1, v) == 1;
+	l = res ? v[0] : 0.0f;
+	r = res ? v[1] : 0.0f;
+	return res;
+}
+
+double LiveJog::_predict(uint64_t t) const
+{
+	double dt = ((double)t - (double)m_t) / 1000000.0;
+	if (m_held) dt = std::min(dt, s_hold_timeout);
+	return m_x + m_v * dt;
+}
+
+void LiveJog::_apply(const Event& e)
+{
+	switch (e.kind)
+	{
+	case Event_Engage:
+		if (!m_engaged)
+		{
+			m_engaged = true;
+			m_fade = s_fade_frames;
+			m_pos = e.value * (double)m_sample_rate_in;
+		}
+		m_x = e.value;
+		m_v = 0.0;
+		m_t = e.time;
+		m_held = true;
+		break;
+	case Event_Position:
+		if (m_engaged)
+		{
+			double dt = ((double)e.time - (double)m_t) / 1000000.0;
+			double x_pred = _predict(e.time);
+			// grabbing a spinning platter, or moving again after a pause, starts from rest
+			if (!m_held || dt > s_hold_timeout) m_v = 0.0;
+			double r = e.value - x_pred;
+			m_x = x_pred + s_alpha * r;
+			if (dt > 0.0001) m_v += s_beta * r / dt;
+			m_t = e.time;
+			m_held = true;
+		}
+		break;
+	case Event_Velocity:
+		if (m_engaged)
+		{
+			m_x = _predict(e.time);
+			m_v = e.value;
+			m_t = e.time;
+			m_held = false;
+		}
+		break;
+	case Event_Release:
+		if (m_engaged)
+		{
+			m_engaged = false;
+			m_fade = s_fade_frames;
+		}
+		break;
+	}
+}
+
+void LiveJog::_render_live(int i, int count, float* buf)
+{
+	double rate_in = (double)m_sample_rate_in;
+	double rate_out = (double)m_sample_rate_out;
+	double gain = 1.0 - exp(-(double)s_sub_block / (s_smoothing * rate_out));
+
+	// frame k of this call is heard at about now + k / rate_out + the prediction
+	double t_base = (double)s_now() + m_prediction.load(std::memory_order_relaxed) * 1000000.0;
+
+	double pos[s_block];
+	double step[s_block];
+	for (int done = 0; done < count; done += s_block)
+	{
+		int n = std::min(s_block, count - done);
+		for (int j = 0; j < n; j += s_sub_block)
+		{
+			int m = std::min(s_sub_block, n - j);
+			uint64_t t = (uint64_t)(t_base + (double)(done + j + m) / rate_out * 1000000.0);
+
+			// carry on at the estimated velocity and pull towards the predicted position
+			double v = (m_held && (double)t - (double)m_t > s_hold_timeout * 1000000.0) ? 0.0 : m_v;
+			double expected = m_pos + v * rate_in / rate_out * (double)m;
+			double target = _predict(t) * rate_in;
+			double next = expected + (target - expected) * gain;
+
+			double d = (next - m_pos) / (double)m;
+			for (int k = 0; k < m; k++)
+			{
+				pos[j + k] = m_pos + d * (double)k;
+				step[j + k] = d;
+			}
+			m_pos = next;
+		}
+		m_scratch->render_positions(i + done, pos, step, n, buf + done * 2);
+	}
+	m_position_out = m_pos / rate_in;
+}
+
+int LiveJog::get_samples(int i, int count, float* buf)
+{
+	uint64_t r = m_queue_read.load(std::memory_order_relaxed);
+	uint64_t w = m_queue_write.load(std::memory_order_acquire);
+	for (; r < w; r++)
+		_apply(m_queue[r & (s_queue_size - 1)]);
+	m_queue_read.store(r, std::memory_order_release);
+	m_engaged_out = m_engaged;
+
+	int n;
+	if (m_engaged)
+	{
+		// endless while engaged
+		n = count;
+		_render_live(i, count, buf);
+	}
+	else
+	{
+		n = m_passthrough->get_samples(i, count, buf);
+	}
+
+	if (m_fade > 0)
+	{
+		// the other mode fades out over what is left of the crossfade
+		int f = std::min(m_fade, n);
+		float other[s_fade_frames * 2];
+		if (m_engaged)
+		{
+			int m = m_passthrough->get_samples(i, f, other);
+			memset(other + m * 2, 0, sizeof(float) * (f - m) * 2);
+		}
+		else
+		{
+			_render_live(i, f, other);
+		}
+		for (int k = 0; k < f; k++)
+		{
+			float w_other = (float)(m_fade - k) / (float)s_fade_frames;
+			buf[k * 2] += (other[k * 2] - buf[k * 2]) * w_other;
+			buf[k * 2 + 1] += (other[k * 2 + 1] - buf[k * 2 + 1]) * w_other;
+		}
+		m_fade -= f;
+		if (n == 0) m_fade = 0;
+	}
+	return n;
+}
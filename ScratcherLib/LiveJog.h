@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include "Sampler.h"
+
+class SamplerScratch;
+
+// Live jog / scratch control. Plays another Sampler (the time map) through until a
+// jog engages, then the source position follows timestamped platter events instead:
+// positions while the record is held, velocities while it spins on its own.
+// Events go through a lock-free queue from one control thread (mouse, MIDI, a replayed
+// event file) and are smoothed by an alpha-beta filter that predicts where the platter
+// will be when the frames being rendered are heard.
+class LiveJog : public Sampler
+{
+public:
+	enum EventKind
+	{
+		Event_Engage,	// grabs the platter at value (source seconds)
+		Event_Position,	// platter at value (source seconds)
+		Event_Velocity,	// platter turning at value (source seconds per second, 1 is normal speed)
+		Event_Release	// back to the time map
+	};
+
+	struct Event
+	{
+		uint64_t time; // steady clock in microseconds, see s_now()
+		int kind;
+		double value;
+	};
+
+	// passthrough is what plays while not engaged, scratch renders the live positions.
+	// Both normally render the same SamplerScratch, passthrough possibly cached.
+	LiveJog(Sampler* passthrough, SamplerScratch* scratch);
+	~LiveJog();
+
+	static uint64_t s_now();
+
+	// From a single control thread. Fails when the queue is full.
+	bool push(const Event& e);
+	bool push(int kind, double value) { Event e = { s_now(), kind, value }; return push(e); }
+
+	// How far ahead (seconds) the platter is predicted, normally the output latency.
+	void set_prediction(double seconds) { m_prediction = seconds; }
+	double prediction() const { return m_prediction; }
+
+	bool engaged() const { return m_engaged_out; }
+
+	// live source position in seconds, as last rendered
+	double position() const { return m_position_out; }
+
+	// Reads a text file of events, one "time kind value" per line with time in seconds
+	// from the start of the file and kind one of engage, position, velocity, release.
+	// Times are returned in microseconds from the start, to be offset by the replayer.
+	static bool s_read_events(const char* filename, std::vector<Event>& events);
+
+	virtual double get_duration();
+	virtual void set_sample_rate(unsigned sample_rate);
+	virtual bool get_sample(int i, float& l, float& r);
+	virtual int get_samples(int i, int count, float* buf);
+
+private:
+	Sampler* m_passthrough;
+	SamplerScratch* m_scratch;
+	unsigned m_sample_rate_in;
+	unsigned m_sample_rate_out = 44100;
+	std::atomic<double> m_prediction;
+
+	// single producer, single consumer
+	std::vector<Event> m_queue;
+	std::atomic<uint64_t> m_queue_write;
+	std::atomic<uint64_t> m_queue_read;
+
+	// filter state, on the render thread only. Estimate m_x (source seconds) and
+	// m_v (source seconds per second) as of m_t (microseconds).
+	bool m_engaged = false;
+	bool m_held = false;
+	double m_x = 0.0;
+	double m_v = 0.0;
+	uint64_t m_t = 0;
+	void _apply(const Event& e);
+	double _predict(uint64_t t) const;
+
+	// rendered position in source frames, and the crossfade between the two modes
+	double m_pos = 0.0;
+	int m_fade = 0;
+	void _render_live(int i, int count, float* buf);
+
+	std::atomic<bool> m_engaged_out;
+	std::atomic<double> m_position_out;
+};
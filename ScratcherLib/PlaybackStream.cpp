@@ -0,0 +1,248 @@
+#include <chrono>
+#include <thread>
+#include <memory.h>
+#include <algorithm>
+#include "PlaybackStream.h"
+#include "Sampler.h"
+#include "RTCheck.h"
+
+inline uint64_t time_micro_sec()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+PlaybackStream::PlaybackStream(Sampler* sampler, AudioSink* sink, uint64_t start_pos, int buffer_frames, int depth, RenderAhead::Priority priority, bool no_wait)
+	: m_sink(sink), m_sample_rate(sink->sample_rate()), m_lossless(false), m_eof(false)
+	, m_seek_pos(0), m_seek_gen(0)
+	, m_sync_seq(0), m_start_time((uint64_t)(-1)), m_start_pos(start_pos)
+	, m_base_pos(start_pos), m_latency_us(0)
+{
+	sampler->set_sample_rate(m_sample_rate);
+	m_i = (int)((double)start_pos / 1000000.0 * (double)m_sample_rate);
+
+	buffer_frames = std::max(buffer_frames, 64);
+	int chunk = std::min(std::max(buffer_frames / 4, 64), 1024);
+	m_render_ahead = new RenderAhead(sampler, m_i, std::max(depth, buffer_frames), chunk, priority, buffer_frames, no_wait);
+	m_base_fill = m_render_ahead->fill();
+
+	// the sink is started next, its first pull finds a full buffer
+	m_render_ahead->wait_filled();
+}
+
+PlaybackStream::~PlaybackStream()
+{
+	delete m_render_ahead;
+}
+
+void PlaybackStream::seek(uint64_t pos)
+{
+	m_seek_pos.store(pos, std::memory_order_relaxed);
+	m_seek_gen.fetch_add(1, std::memory_order_release);
+}
+
+void PlaybackStream::_apply_seek()
+{
+	unsigned gen = m_seek_gen.load(std::memory_order_acquire);
+	if (gen == m_seek_done) return;
+	m_seek_done = gen;
+
+	uint64_t pos = m_seek_pos.load(std::memory_order_relaxed);
+	m_i = (int)((double)pos / 1000000.0 * (double)m_sample_rate);
+	m_render_ahead->seek(m_i);
+	m_eof = false;
+
+	// the sink keeps counting from the start, move the origin so that it reports pos now
+	m_base_pos = pos - (_played_pos() - m_base_pos);
+	m_synced = false;
+	_set_sync_point(time_micro_sec(), pos);
+}
+
+bool PlaybackStream::pull(float* buf, int count)
+{
+	RTCheck::Section rt;
+
+	_apply_seek();
+	if (m_eof)
+	{
+		memset(buf, 0, sizeof(float) * count * 2);
+		return false;
+	}
+
+	int n = 0;
+	if (m_lossless)
+	{
+		// in pieces of what is there, the ring may be kept filled less than count ahead
+		while (n < count)
+		{
+			int available = m_render_ahead->frames_buffered();
+			if (available == 0 && !m_render_ahead->done())
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+				continue;
+			}
+			int k = m_render_ahead->read(buf + n * 2, available > 0 ? std::min(available, count - n) : count - n);
+			n += k;
+			if (k == 0) break;
+		}
+	}
+	else
+	{
+		// the render thread keeps the ring ahead, a short read is padded with silence
+		n = m_render_ahead->read(buf, count);
+	}
+	m_i += n;
+	if (n < count)
+		_add_padding(m_sink_pos + (uint64_t)n, (uint64_t)(count - n));
+	m_sink_pos += (uint64_t)count;
+
+	if (n < count && m_render_ahead->eof())
+	{
+		m_eof = true;
+	}
+
+	_sync_clock();
+	_adapt_fill(count);
+	_measure_latency();
+	return true;
+}
+
+void PlaybackStream::_add_padding(uint64_t sink_pos, uint64_t count)
+{
+	if (m_num_paddings == s_max_paddings)
+	{
+		// too many pending, the oldest is taken as played
+		m_padding_played += m_paddings[0].count;
+		for (int k = 1; k < m_num_paddings; k++)
+			m_paddings[k - 1] = m_paddings[k];
+		m_num_paddings--;
+	}
+	Padding& padding = m_paddings[m_num_paddings++];
+	padding.sink_pos = sink_pos;
+	padding.count = count;
+}
+
+uint64_t PlaybackStream::_played_pos()
+{
+	uint64_t played = m_sink->frames_played();
+	int done = 0;
+	for (; done < m_num_paddings && m_paddings[done].sink_pos < played; done++)
+	{
+		Padding& padding = m_paddings[done];
+		uint64_t end = padding.sink_pos + padding.count;
+		if (end > played)
+		{
+			// partly played, the rest stays pending
+			m_padding_played += played - padding.sink_pos;
+			padding.count = end - played;
+			padding.sink_pos = played;
+			break;
+		}
+		m_padding_played += padding.count;
+	}
+	for (int k = done; k < m_num_paddings; k++)
+		m_paddings[k - done] = m_paddings[k];
+	m_num_paddings -= done;
+
+	uint64_t source_played = played > m_padding_played ? played - m_padding_played : 0;
+	return m_base_pos + source_played * 1000000 / m_sample_rate;
+}
+
+// The sink reports how much it has played. Between reports the clock runs on
+// the steady clock, and each report pulls it 1/8 of the way to the sink so
+// that the coarse granularity of the reports does not show as jitter.
+void PlaybackStream::_sync_clock()
+{
+	static const int64_t s_max_drift = 20000;
+
+	uint64_t now = time_micro_sec();
+	uint64_t device_pos = _played_pos();
+
+	uint64_t start_time, start_pos;
+	_get_sync_point(start_time, start_pos);
+	if (!m_synced || start_time == (uint64_t)(-1))
+	{
+		_set_sync_point(now, device_pos);
+		m_synced = true;
+		return;
+	}
+
+	int64_t predicted = (int64_t)(start_pos + (now - start_time));
+	int64_t error = (int64_t)device_pos - predicted;
+	if (error > s_max_drift || error < -s_max_drift)
+		_set_sync_point(now, device_pos);
+	else
+		_set_sync_point(now, (uint64_t)(predicted + error / 8));
+}
+
+uint64_t PlaybackStream::position() const
+{
+	uint64_t start_time, start_pos;
+	_get_sync_point(start_time, start_pos);
+	if (start_time == (uint64_t)(-1)) return start_pos;
+	return start_pos + (time_micro_sec() - start_time);
+}
+
+// A short read from the ring means rendering could not keep up with how little
+// was buffered, each one lets the ring run another chunk further ahead. After a
+// while without one, it is brought back a chunk at a time to where it started,
+// so that a passing stall does not cost latency for the rest of the playback.
+void PlaybackStream::_adapt_fill(int count)
+{
+	static const unsigned s_decay_seconds = 2;
+
+	unsigned underruns = m_render_ahead->num_underruns();
+	if (underruns != m_underruns_seen)
+	{
+		m_underruns_seen = underruns;
+		m_frames_since_underrun = 0;
+		m_render_ahead->set_fill(m_render_ahead->fill() + m_render_ahead->chunk());
+		return;
+	}
+
+	m_frames_since_underrun += (uint64_t)count;
+	int fill = m_render_ahead->fill();
+	if (m_frames_since_underrun >= (uint64_t)m_sample_rate * s_decay_seconds && fill > m_base_fill)
+	{
+		m_frames_since_underrun = 0;
+		m_render_ahead->set_fill(std::max(fill - m_render_ahead->chunk(), m_base_fill));
+	}
+}
+
+// Rendered frames wait in the ring and then in the sink, whatever has been
+// handed to the sink and not played yet is ahead of the played position.
+void PlaybackStream::_measure_latency()
+{
+	double sample_rate = (double)m_sample_rate;
+	uint64_t written_pos = (uint64_t)((double)m_i / sample_rate * 1000000.0);
+	uint64_t device_pos = _played_pos();
+	int64_t queued = written_pos > device_pos ? (int64_t)(written_pos - device_pos) : 0;
+	int64_t latency = queued + (int64_t)((double)m_render_ahead->frames_buffered() / sample_rate * 1000000.0);
+
+	int last = m_latency_us.load(std::memory_order_relaxed);
+	if (last == 0)
+		m_latency_us.store((int)latency, std::memory_order_relaxed);
+	else
+		m_latency_us.store(last + (int)(latency - last) / 8, std::memory_order_relaxed);
+}
+
+void PlaybackStream::_set_sync_point(uint64_t start_time, uint64_t start_pos)
+{
+	unsigned seq = m_sync_seq.load(std::memory_order_relaxed);
+	m_sync_seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	m_start_time.store(start_time, std::memory_order_relaxed);
+	m_start_pos.store(start_pos, std::memory_order_relaxed);
+	m_sync_seq.store(seq + 2, std::memory_order_release);
+}
+
+void PlaybackStream::_get_sync_point(uint64_t& start_time, uint64_t& start_pos) const
+{
+	unsigned seq;
+	do
+	{
+		seq = m_sync_seq.load(std::memory_order_acquire);
+		start_time = m_start_time.load(std::memory_order_relaxed);
+		start_pos = m_start_pos.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while ((seq & 1) != 0 || seq != m_sync_seq.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include "AudioSink.h"
+#include "RenderAhead.h"
+
+class Sampler;
+
+// Playback of a Sampler into an AudioSink. Rendering runs ahead on its own thread,
+// the position clock follows what the sink reports as played, less the silence
+// padded into pulls that came up short, and how far ahead is rendered grows
+// when that happens and shrinks back once it has stopped happening.
+class PlaybackStream : public AudioSink::Source
+{
+public:
+	// start_pos in microseconds. buffer_frames is how much the sink buffers, the
+	// ring is kept that far ahead at first, and rendered in quarters of it.
+	// Returns once that much is rendered, so the sink can be started right after.
+	// no_wait renders under TrackBuffer::NoWait from the start, see RenderAhead::set_no_wait.
+	PlaybackStream(Sampler* sampler, AudioSink* sink, uint64_t start_pos, int buffer_frames,
+		int depth = 16384, RenderAhead::Priority priority = RenderAhead::Priority_High, bool no_wait = false);
+	~PlaybackStream();
+
+	virtual bool pull(float* buf, int count);
+
+	// Moves playback to pos (microseconds) without stopping the sink, from any thread.
+	// Applied with the next pull.
+	void seek(uint64_t pos);
+
+	// Position being heard in microseconds, between pulls it runs on the steady clock.
+	uint64_t position() const;
+
+	// Waits for the render thread instead of padding with silence, for sinks
+	// that run faster than real time and must get every frame.
+	void set_lossless(bool lossless) { m_lossless = lossless; }
+
+	bool eof() const { return m_eof; }
+	unsigned num_underruns() const { return m_render_ahead->num_underruns(); }
+
+	// measured latency in microseconds from rendering a frame to hearing it
+	int latency() const { return m_latency_us; }
+
+	RenderAhead* render_ahead() const { return m_render_ahead; }
+
+private:
+	AudioSink* m_sink;
+	RenderAhead* m_render_ahead;
+	unsigned m_sample_rate;
+	std::atomic<bool> m_lossless;
+
+	// frames delivered to the sink, in frames of the sampler
+	int m_i;
+	std::atomic<bool> m_eof;
+
+	std::atomic<uint64_t> m_seek_pos;
+	std::atomic<unsigned> m_seek_gen;
+	unsigned m_seek_done = 0;
+	void _apply_seek();
+
+	// Sync point of the position clock: playback was at start_pos (microseconds)
+	// at start_time on the steady clock. Written by the pulling thread only,
+	// read without locks through a sequence counter that is odd while writing.
+	std::atomic<unsigned> m_sync_seq;
+	std::atomic<uint64_t> m_start_time;
+	std::atomic<uint64_t> m_start_pos;
+	void _set_sync_point(uint64_t start_time, uint64_t start_pos);
+	void _get_sync_point(uint64_t& start_time, uint64_t& start_pos) const;
+
+	// position of the first frame, the sink reports its progress from there
+	uint64_t m_base_pos;
+	bool m_synced = false;
+	void _sync_clock();
+
+	// Silence padded into short pulls, at frames of the sink. Played padding does
+	// not move the position, a stretch is kept until the sink has played past it.
+	struct Padding
+	{
+		uint64_t sink_pos;
+		uint64_t count;
+	};
+	static const int s_max_paddings = 16;
+	Padding m_paddings[s_max_paddings];
+	int m_num_paddings = 0;
+	uint64_t m_padding_played = 0;
+	uint64_t m_sink_pos = 0;
+	void _add_padding(uint64_t sink_pos, uint64_t count);
+
+	unsigned m_underruns_seen = 0;
+	uint64_t m_frames_since_underrun = 0;
+	int m_base_fill = 0;
+	std::atomic<int> m_latency_us;
+	void _adapt_fill(int count);
+	void _measure_latency();
+
+	// the played position in microseconds, from the frames the sink has played less the padding
+	uint64_t _played_pos();
+};
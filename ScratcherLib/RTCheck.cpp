@@ -0,0 +1,463 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
+#include "RTCheck.h"
+
+#ifdef SCRATCHER_RT_CHECK
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// malloc, locks and file I/O are intercepted for the whole process, see the end
+#define RT_CHECK_INTERPOSE
+#endif
+
+enum SiteKind
+{
+	Site_Alloc,
+	Site_Free,
+	Site_Lock,
+	Site_IO
+};
+
+static const char* s_kind_names[] = { "allocation", "free", "lock", "file I/O" };
+
+static const int s_max_frames = 12;
+static const int s_max_sites = 128;
+
+// A distinct offence: kind, label and stack. The table is fixed so that
+// recording one does not allocate, a spin lock keeps it consistent.
+struct Site
+{
+	SiteKind kind;
+	const char* name;
+	int num_frames;
+	void* frames[s_max_frames];
+	uint64_t count;
+};
+
+static Site s_sites[s_max_sites];
+static int s_num_sites = 0;
+static std::atomic_flag s_sites_lock = ATOMIC_FLAG_INIT;
+
+static std::atomic<uint64_t> s_sections(0);
+static std::atomic<uint64_t> s_allocations(0);
+static std::atomic<uint64_t> s_allocated_bytes(0);
+static std::atomic<uint64_t> s_frees(0);
+static std::atomic<uint64_t> s_locks(0);
+static std::atomic<uint64_t> s_io(0);
+static std::atomic<uint64_t> s_dropped_sites(0);
+
+static thread_local int s_depth = 0;
+static thread_local bool s_in_hook = false;
+
+#ifdef RT_CHECK_INTERPOSE
+static const char* s_watched = "malloc, calloc, realloc, free, pthread_mutex_lock, pthread_cond_wait, pthread_cond_timedwait, pthread_cond_clockwait, read, write, fread, fwrite";
+#else
+static const char* s_watched = "operator new and delete, and the locks and I/O marked with RT_CHECK_LOCK and RT_CHECK_IO";
+#endif
+
+static int s_capture(void** frames, int max_frames)
+{
+#ifdef _WIN32
+	return (int)CaptureStackBackTrace(2, (DWORD)max_frames, frames, nullptr);
+#elif defined(__GLIBC__)
+	void* all[s_max_frames + 2];
+	int n = backtrace(all, s_max_frames + 2) - 2;
+	if (n <= 0) return 0;
+	n = n < max_frames ? n : max_frames;
+	memcpy(frames, all + 2, sizeof(void*) * n);
+	return n;
+#else
+	(void)frames;
+	(void)max_frames;
+	return 0;
+#endif
+}
+
+#if defined(__GLIBC__) && !defined(_WIN32)
+// the first backtrace() loads the unwinder, which allocates, so it is done before any section
+static struct UnwinderLoader
+{
+	UnwinderLoader()
+	{
+		void* frame;
+		backtrace(&frame, 1);
+	}
+} s_unwinder_loader;
+#endif
+
+static void s_record(SiteKind kind, const char* name)
+{
+	void* frames[s_max_frames];
+	int num_frames = s_capture(frames, s_max_frames);
+
+	while (s_sites_lock.test_and_set(std::memory_order_acquire));
+	int found = -1;
+	for (int i = 0; i < s_num_sites; i++)
+	{
+		const Site& site = s_sites[i];
+		if (site.kind == kind && site.name == name && site.num_frames == num_frames
+			&& memcmp(site.frames, frames, sizeof(void*) * num_frames) == 0)
+		{
+			found = i;
+			break;
+		}
+	}
+	if (found < 0 && s_num_sites < s_max_sites)
+	{
+		found = s_num_sites++;
+		Site& site = s_sites[found];
+		site.kind = kind;
+		site.name = name;
+		site.num_frames = num_frames;
+		memcpy(site.frames, frames, sizeof(void*) * num_frames);
+		site.count = 0;
+	}
+	if (found >= 0)
+		s_sites[found].count++;
+	else
+		s_dropped_sites++;
+	s_sites_lock.clear(std::memory_order_release);
+}
+
+bool RTCheck::enabled()
+{
+	return true;
+}
+
+void RTCheck::enter()
+{
+	if (s_depth++ == 0) s_sections++;
+}
+
+void RTCheck::leave()
+{
+	s_depth--;
+}
+
+static void s_event(SiteKind kind, const char* name, size_t size)
+{
+	if (s_depth == 0 || s_in_hook) return;
+	s_in_hook = true;
+	switch (kind)
+	{
+	case Site_Alloc:
+		s_allocations++;
+		s_allocated_bytes += size;
+		break;
+	case Site_Free:
+		s_frees++;
+		break;
+	case Site_Lock:
+		s_locks++;
+		break;
+	case Site_IO:
+		s_io++;
+		break;
+	}
+	s_record(kind, name);
+	s_in_hook = false;
+}
+
+// With the calls intercepted, the hooks would count them a second time.
+#ifdef RT_CHECK_INTERPOSE
+
+void RTCheck::on_alloc(size_t) {}
+void RTCheck::on_free() {}
+void RTCheck::on_lock(const char*) {}
+void RTCheck::on_io(const char*) {}
+
+#else
+
+void RTCheck::on_alloc(size_t size)
+{
+	s_event(Site_Alloc, "operator new", size);
+}
+
+void RTCheck::on_free()
+{
+	s_event(Site_Free, "operator delete", 0);
+}
+
+void RTCheck::on_lock(const char* site)
+{
+	s_event(Site_Lock, site, 0);
+}
+
+void RTCheck::on_io(const char* site)
+{
+	s_event(Site_IO, site, 0);
+}
+
+#endif
+
+RTCheck::Stats RTCheck::stats()
+{
+	Stats stats;
+	stats.sections = s_sections;
+	stats.allocations = s_allocations;
+	stats.allocated_bytes = s_allocated_bytes;
+	stats.frees = s_frees;
+	stats.locks = s_locks;
+	stats.io = s_io;
+	stats.dropped_sites = s_dropped_sites;
+	return stats;
+}
+
+void RTCheck::reset()
+{
+	while (s_sites_lock.test_and_set(std::memory_order_acquire));
+	s_num_sites = 0;
+	s_sections = 0;
+	s_allocations = 0;
+	s_allocated_bytes = 0;
+	s_frees = 0;
+	s_locks = 0;
+	s_io = 0;
+	s_dropped_sites = 0;
+	s_sites_lock.clear(std::memory_order_release);
+}
+
+void RTCheck::report(FILE* fp)
+{
+	Stats st = stats();
+	fprintf(fp, "real-time sections: %llu, watching %s\n", (unsigned long long)st.sections, s_watched);
+	fprintf(fp, "  allocations: %llu (%llu bytes), frees: %llu\n", (unsigned long long)st.allocations,
+		(unsigned long long)st.allocated_bytes, (unsigned long long)st.frees);
+	fprintf(fp, "  locks: %llu, file I/O: %llu\n", (unsigned long long)st.locks, (unsigned long long)st.io);
+
+	// copied out, symbolizing allocates and must not happen under the spin lock
+	Site* sites = new Site[s_max_sites];
+	while (s_sites_lock.test_and_set(std::memory_order_acquire));
+	int num_sites = s_num_sites;
+	memcpy(sites, s_sites, sizeof(Site) * num_sites);
+	s_sites_lock.clear(std::memory_order_release);
+
+	for (int i = 0; i < num_sites; i++)
+	{
+		const Site& site = sites[i];
+		fprintf(fp, "\n%s at %s, %llu times\n", s_kind_names[site.kind], site.name, (unsigned long long)site.count);
+#if defined(__GLIBC__) && !defined(_WIN32)
+		char** symbols = backtrace_symbols(site.frames, site.num_frames);
+		for (int j = 0; j < site.num_frames; j++)
+			fprintf(fp, "    %s\n", symbols != nullptr ? symbols[j] : "?");
+		free(symbols);
+#else
+		for (int j = 0; j < site.num_frames; j++)
+			fprintf(fp, "    %p\n", site.frames[j]);
+#endif
+	}
+	if (st.dropped_sites > 0)
+		fprintf(fp, "\n%llu more not kept, the site table is full\n", (unsigned long long)st.dropped_sites);
+	delete[] sites;
+}
+
+#ifdef RT_CHECK_INTERPOSE
+
+// Definitions of the C library functions in the program come before those of libc,
+// for the calls from any library too. They count the call and go on to libc: the
+// allocator through its own entry points, as dlsym may allocate, the others through
+// dlsym(RTLD_NEXT), resolved on first use.
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void __libc_free(void* p);
+
+template <typename F>
+static F s_next(std::atomic<F>& f, const char* name)
+{
+	F next = f.load(std::memory_order_relaxed);
+	if (next == nullptr)
+	{
+		next = (F)dlsym(RTLD_NEXT, name);
+		f.store(next, std::memory_order_relaxed);
+	}
+	return next;
+}
+
+typedef int (*MutexLockFunc)(pthread_mutex_t*);
+typedef int (*CondWaitFunc)(pthread_cond_t*, pthread_mutex_t*);
+typedef int (*CondTimedWaitFunc)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+typedef int (*CondClockWaitFunc)(pthread_cond_t*, pthread_mutex_t*, clockid_t, const struct timespec*);
+typedef ssize_t (*ReadFunc)(int, void*, size_t);
+typedef ssize_t (*WriteFunc)(int, const void*, size_t);
+typedef size_t (*FReadFunc)(void*, size_t, size_t, FILE*);
+typedef size_t (*FWriteFunc)(const void*, size_t, size_t, FILE*);
+
+static std::atomic<MutexLockFunc> s_mutex_lock(nullptr);
+static std::atomic<CondWaitFunc> s_cond_wait(nullptr);
+static std::atomic<CondTimedWaitFunc> s_cond_timedwait(nullptr);
+static std::atomic<CondClockWaitFunc> s_cond_clockwait(nullptr);
+static std::atomic<ReadFunc> s_read(nullptr);
+static std::atomic<WriteFunc> s_write(nullptr);
+static std::atomic<FReadFunc> s_fread(nullptr);
+static std::atomic<FWriteFunc> s_fwrite(nullptr);
+
+extern "C" void* malloc(size_t size) noexcept
+{
+	s_event(Site_Alloc, "malloc", size);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) noexcept
+{
+	s_event(Site_Alloc, "calloc", count * size);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size) noexcept
+{
+	s_event(Site_Alloc, "realloc", size);
+	return __libc_realloc(p, size);
+}
+
+extern "C" void free(void* p) noexcept
+{
+	if (p != nullptr) s_event(Site_Free, "free", 0);
+	__libc_free(p);
+}
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept
+{
+	s_event(Site_Lock, "pthread_mutex_lock", 0);
+	return s_next(s_mutex_lock, "pthread_mutex_lock")(mutex);
+}
+
+extern "C" int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+	s_event(Site_Lock, "pthread_cond_wait", 0);
+	return s_next(s_cond_wait, "pthread_cond_wait")(cond, mutex);
+}
+
+extern "C" int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime)
+{
+	s_event(Site_Lock, "pthread_cond_timedwait", 0);
+	return s_next(s_cond_timedwait, "pthread_cond_timedwait")(cond, mutex, abstime);
+}
+
+// what std::condition_variable waits for a duration with since glibc 2.30
+#if __GLIBC_PREREQ(2, 30)
+extern "C" int pthread_cond_clockwait(pthread_cond_t* cond, pthread_mutex_t* mutex, clockid_t clock, const struct timespec* abstime)
+{
+	s_event(Site_Lock, "pthread_cond_clockwait", 0);
+	return s_next(s_cond_clockwait, "pthread_cond_clockwait")(cond, mutex, clock, abstime);
+}
+#endif
+
+extern "C" ssize_t read(int fd, void* buf, size_t count)
+{
+	s_event(Site_IO, "read", 0);
+	return s_next(s_read, "read")(fd, buf, count);
+}
+
+extern "C" ssize_t write(int fd, const void* buf, size_t count)
+{
+	s_event(Site_IO, "write", 0);
+	return s_next(s_write, "write")(fd, buf, count);
+}
+
+extern "C" size_t fread(void* ptr, size_t size, size_t count, FILE* fp)
+{
+	s_event(Site_IO, "fread", 0);
+	return s_next(s_fread, "fread")(ptr, size, count, fp);
+}
+
+extern "C" size_t fwrite(const void* ptr, size_t size, size_t count, FILE* fp)
+{
+	s_event(Site_IO, "fwrite", 0);
+	return s_next(s_fwrite, "fwrite")(ptr, size, count, fp);
+}
+
+#else
+
+// Replacements of the global allocation functions, they only add the hooks.
+// malloc() itself is not intercepted, the library allocates through new.
+
+void* operator new(std::size_t size)
+{
+	RTCheck::on_alloc(size);
+	void* p = malloc(size > 0 ? size : 1);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	RTCheck::on_alloc(size);
+	return malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) noexcept
+{
+	if (p == nullptr) return;
+	RTCheck::on_free();
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+	operator delete(p);
+}
+
+#endif
+
+#else
+
+bool RTCheck::enabled()
+{
+	return false;
+}
+
+RTCheck::Stats RTCheck::stats()
+{
+	Stats stats;
+	memset(&stats, 0, sizeof(Stats));
+	return stats;
+}
+
+void RTCheck::reset()
+{
+}
+
+void RTCheck::report(FILE* fp)
+{
+	fprintf(fp, "real-time checks are not built in, configure with SCRATCHER_RT_CHECK\n");
+}
+
+void RTCheck::enter() {}
+void RTCheck::leave() {}
+void RTCheck::on_alloc(size_t) {}
+void RTCheck::on_free() {}
+void RTCheck::on_lock(const char*) {}
+void RTCheck::on_io(const char*) {}
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+// Debugging aid for the real-time paths: the audio callback and the render-ahead thread.
+// When built with SCRATCHER_RT_CHECK, whatever a thread does inside an RTCheck::Section
+// is watched: heap allocations and frees, lock acquisitions and file I/O are counted,
+// and each distinct call site is kept with its stack. With glibc, the program's own
+// definitions of malloc, calloc, realloc, free, pthread_mutex_lock, the condition
+// waits, read, write, fread and fwrite see the calls from any code, libraries included.
+// Elsewhere only operator new/delete and the sites marked with RT_CHECK_LOCK and
+// RT_CHECK_IO are seen, so unmarked locks and I/O and direct malloc calls go unnoticed.
+// Other system calls and page faults on mapped files are never counted.
+// Without SCRATCHER_RT_CHECK, sections and hooks compile to nothing.
+class RTCheck
+{
+public:
+	struct Stats
+	{
+		uint64_t sections;
+		uint64_t allocations;
+		uint64_t allocated_bytes;
+		uint64_t frees;
+		uint64_t locks;
+		uint64_t io;
+		uint64_t dropped_sites;
+	};
+
+	static bool enabled();
+	static Stats stats();
+	static void reset();
+
+	// totals, then each offending call site with its count and stack
+	static void report(FILE* fp);
+
+	// Marks the current thread as real-time while alive, sections may nest.
+	class Section
+	{
+	public:
+#ifdef SCRATCHER_RT_CHECK
+		Section() { RTCheck::enter(); }
+		~Section() { RTCheck::leave(); }
+#else
+		Section() {}
+#endif
+	};
+
+	// hooks, through the macros below; with glibc the calls themselves are seen instead
+	static void enter();
+	static void leave();
+	static void on_alloc(size_t size);
+	static void on_free();
+	static void on_lock(const char* site);
+	static void on_io(const char* site);
+};
+
+#ifdef SCRATCHER_RT_CHECK
+#define RT_CHECK_LOCK(site) RTCheck::on_lock(site)
+#define RT_CHECK_IO(site) RTCheck::on_io(site)
+#else
+#define RT_CHECK_LOCK(site)
+#define RT_CHECK_IO(site)
+#endif
@@ -0,0 +1,217 @@
+#include <memory.h>
+#include <chrono>
+#include <algorithm>
+#include "RenderAhead.h"
+#include "Sampler.h"
+#include "RTCheck.h"
+#include "TrackBuffer.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+RenderAhead::RenderAhead(Sampler* sampler, int start_frame, int depth, int chunk, Priority priority, int fill, bool no_wait)
+	: m_sampler(sampler), m_start_frame(start_frame), m_chunk(chunk), m_priority(priority)
+	, m_priority_applied(false), m_write_pos(0), m_read_pos(0), m_done(false), m_quit(false), m_no_wait(no_wait), m_reading(false)
+	, m_seek_frame(start_frame), m_seek_gen(0), m_flush_gen(0), m_flush_pos(0)
+	, m_num_underruns(0), m_num_underrun_frames(0)
+{
+	m_fade.resize(s_fade_frames * 2);
+	m_depth = 1;
+	while (m_depth < (uint64_t)std::max(depth, chunk)) m_depth <<= 1;
+	m_mask = m_depth * 2 - 1;
+	m_fill = m_depth;
+	if (fill > 0) set_fill(fill);
+	m_ring.resize((m_mask + 1) * 2);
+	m_thread = std::thread(&RenderAhead::_thread_func, this);
+}
+
+RenderAhead::~RenderAhead()
+{
+	m_quit = true;
+	m_thread.join();
+}
+
+void RenderAhead::seek(int frame)
+{
+	m_seek_frame.store(frame, std::memory_order_relaxed);
+	m_seek_gen.fetch_add(1, std::memory_order_release);
+}
+
+void RenderAhead::set_fill(int frames)
+{
+	uint64_t fill = (uint64_t)std::max(frames, m_chunk);
+	m_fill.store(std::min(fill, m_depth), std::memory_order_relaxed);
+}
+
+bool RenderAhead::wait_filled(int timeout_ms)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	// the render thread stops short of the fill by less than a chunk
+	while (frames_buffered() + m_chunk <= fill() && !done())
+	{
+		if (std::chrono::steady_clock::now() >= deadline) return false;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	return true;
+}
+
+void RenderAhead::_copy_out(uint64_t pos, int count, float* buf) const
+{
+	uint64_t offset = pos & m_mask;
+	int first = (int)std::min((uint64_t)count, m_mask + 1 - offset);
+	memcpy(buf, m_ring.data() + offset * 2, sizeof(float) * first * 2);
+	memcpy(buf + first * 2, m_ring.data(), sizeof(float) * (count - first) * 2);
+}
+
+int RenderAhead::read(float* buf, int count)
+{
+	m_reading.store(true, std::memory_order_relaxed);
+
+	// a seek acknowledged by the render thread: keep a little of the old stream
+	// to fade out and skip to the frames rendered for the new position
+	unsigned flush_gen = m_flush_gen.load(std::memory_order_acquire);
+	if (flush_gen != m_read_gen)
+	{
+		uint64_t r = m_read_pos.load(std::memory_order_relaxed);
+		uint64_t flush_pos = m_flush_pos.load(std::memory_order_relaxed);
+		if (m_write_pos.load(std::memory_order_acquire) == flush_pos && !m_done.load(std::memory_order_acquire))
+		{
+			// nothing for the new position yet: the old stream goes on, then
+			// silence, which is the seek taking its time and not an underrun
+			int n = (int)std::min((uint64_t)count, flush_pos - r);
+			_copy_out(r, n, buf);
+			memset(buf + n * 2, 0, sizeof(float) * (count - n) * 2);
+			m_read_pos.store(r + n, std::memory_order_release);
+			return n;
+		}
+		m_read_gen = flush_gen;
+		m_fade_len = (int)std::min((uint64_t)s_fade_frames, flush_pos - r);
+		m_fade_done = 0;
+		for (int k = 0; k < m_fade_len; k++)
+		{
+			uint64_t offset = (r + k) & m_mask;
+			m_fade[k * 2] = m_ring[offset * 2];
+			m_fade[k * 2 + 1] = m_ring[offset * 2 + 1];
+		}
+		m_read_pos.store(flush_pos, std::memory_order_release);
+	}
+
+	bool done = m_done.load(std::memory_order_acquire) && flush_gen == m_seek_gen.load(std::memory_order_acquire);
+	uint64_t r = m_read_pos.load(std::memory_order_relaxed);
+	uint64_t w = m_write_pos.load(std::memory_order_acquire);
+	int n = (int)std::min((uint64_t)count, w - r);
+	_copy_out(r, n, buf);
+	m_read_pos.store(r + n, std::memory_order_release);
+
+	for (int k = 0; k < n && m_fade_done < m_fade_len; k++, m_fade_done++)
+	{
+		float g = (float)m_fade_done / (float)m_fade_len;
+		buf[k * 2] = buf[k * 2] * g + m_fade[m_fade_done * 2] * (1.0f - g);
+		buf[k * 2 + 1] = buf[k * 2 + 1] * g + m_fade[m_fade_done * 2 + 1] * (1.0f - g);
+	}
+
+	if (n < count)
+	{
+		memset(buf + n * 2, 0, sizeof(float) * (count - n) * 2);
+		if (!done)
+		{
+			m_num_underruns++;
+			m_num_underrun_frames += (uint64_t)(count - n);
+		}
+	}
+	return n;
+}
+
+bool RenderAhead::done() const
+{
+	return m_done.load(std::memory_order_acquire) && m_flush_gen.load() == m_seek_gen.load();
+}
+
+bool RenderAhead::eof() const
+{
+	return done() && m_read_pos.load() == m_write_pos.load();
+}
+
+bool RenderAhead::_apply_priority()
+{
+	if (m_priority == Priority_Normal) return true;
+#ifdef _WIN32
+	int priority = m_priority == Priority_RealTime ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+	return SetThreadPriority(GetCurrentThread(), priority) != 0;
+#else
+	// usually needs rtprio permission, playback goes on at normal priority otherwise
+	int policy = m_priority == Priority_RealTime ? SCHED_FIFO : SCHED_RR;
+	sched_param param;
+	int p_min = sched_get_priority_min(policy);
+	int p_max = sched_get_priority_max(policy);
+	param.sched_priority = m_priority == Priority_RealTime ? p_max : (p_min + p_max) / 2;
+	return pthread_setschedparam(pthread_self(), policy, &param) == 0;
+#endif
+}
+
+void RenderAhead::_thread_func()
+{
+	m_priority_applied = _apply_priority();
+
+	uint64_t capacity = m_mask + 1;
+	std::vector<float> chunk(m_chunk * 2);
+	unsigned gen = 0;
+	int frame = m_start_frame;
+	while (!m_quit)
+	{
+		uint64_t w = m_write_pos.load(std::memory_order_relaxed);
+		unsigned seek_gen = m_seek_gen.load(std::memory_order_acquire);
+		if (seek_gen != gen)
+		{
+			// everything from w on belongs to the new position
+			gen = seek_gen;
+			frame = m_seek_frame.load(std::memory_order_relaxed);
+			m_done.store(false, std::memory_order_relaxed);
+			m_flush_pos.store(w, std::memory_order_relaxed);
+			m_flush_gen.store(gen, std::memory_order_release);
+		}
+
+		// filled up to the fill past the reader, or past the seek until the reader gets there
+		uint64_t r = m_read_pos.load(std::memory_order_acquire);
+		uint64_t base = std::max(r, m_flush_pos.load(std::memory_order_relaxed));
+		uint64_t fill = m_fill.load(std::memory_order_relaxed);
+		if (m_done.load(std::memory_order_relaxed) || w + m_chunk > base + fill || w + m_chunk > r + capacity)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		int n;
+		bool missed;
+		{
+			RTCheck::Section rt;
+			TrackBuffer::NoWait no_wait(m_no_wait.load(std::memory_order_relaxed));
+			unsigned misses = TrackBuffer::NoWait::Misses();
+			n = m_sampler->get_samples(frame, m_chunk, chunk.data());
+			missed = TrackBuffer::NoWait::Misses() != misses;
+		}
+
+		// no deadline before the first read, the prefetcher loads the pages meanwhile
+		if (missed && !m_reading.load(std::memory_order_relaxed))
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		frame += n;
+
+		uint64_t offset = w & m_mask;
+		int first = (int)std::min((uint64_t)n, capacity - offset);
+		memcpy(m_ring.data() + offset * 2, chunk.data(), sizeof(float) * first * 2);
+		memcpy(m_ring.data(), chunk.data() + first * 2, sizeof(float) * (n - first) * 2);
+		m_write_pos.store(w + n, std::memory_order_release);
+
+		// stays alive at the end, a seek may start it again
+		if (n < m_chunk)
+			m_done.store(true, std::memory_order_release);
+	}
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+class Sampler;
+
+// Renders a Sampler on its own thread into a lock-free single-producer /
+// single-consumer ring of interleaved stereo frames, so that the audio
+// callback only copies out of memory and never waits on the sampler.
+class RenderAhead
+{
+public:
+	enum Priority
+	{
+		Priority_Normal,
+		Priority_High,
+		Priority_RealTime
+	};
+
+	// depth is rounded up to a power of 2 frames, chunk is the size of each render call.
+	// The ring holds twice the depth, so that after a seek the frames for the new
+	// position can be rendered while the old ones have not been dropped yet.
+	// fill is the initial set_fill(), 0 for the whole depth. no_wait is the initial
+	// set_no_wait(), in effect from the first chunk rendered.
+	RenderAhead(Sampler* sampler, int start_frame, int depth = 16384, int chunk = 512, Priority priority = Priority_High, int fill = 0, bool no_wait = false);
+	~RenderAhead();
+
+	int depth() const { return (int)m_depth; }
+	int chunk() const { return m_chunk; }
+
+	// How far past the reader the ring is kept filled, at least a chunk and at most
+	// the depth (the default). Smaller means edits are heard sooner, safe to change any time.
+	void set_fill(int frames);
+	int fill() const { return (int)m_fill.load(std::memory_order_relaxed); }
+
+	// Waits up to timeout_ms for the ring to be filled as far as fill() asks, or for
+	// rendering to be done. For before the consumer starts, so that it does not begin
+	// with an underrun. Returns false on timeout.
+	bool wait_filled(int timeout_ms = 1000);
+
+	// Renders under TrackBuffer::NoWait, so that a page of the source that is not in
+	// memory reads as silence instead of holding up the ring. Only for samplers whose
+	// pages are loaded ahead, by a SourcePrefetcher. Until the first read a chunk that
+	// missed pages is rendered again, so the prefill waits for them without the render
+	// thread loading any. Safe to change any time.
+	void set_no_wait(bool no_wait) { m_no_wait = no_wait; }
+
+	static const int s_fade_frames = 256;
+	bool priority_applied() const { return m_priority_applied; }
+
+	// Consumer side, copies up to count frames and fills the rest with silence.
+	// Returns the number of rendered frames copied. A short count is an underrun,
+	// unless at eof() or while a seek waits for the first frames of its position.
+	int read(float* buf, int count);
+	bool eof() const;
+
+	// rendered to the end, what is buffered is all there is left
+	bool done() const;
+
+	// Moves rendering to another frame without stopping. Whatever is buffered is
+	// dropped once the render thread has started over, with a short crossfade.
+	// Safe to call from any thread.
+	void seek(int frame);
+
+	unsigned num_underruns() const { return m_num_underruns; }
+	uint64_t num_underrun_frames() const { return m_num_underrun_frames; }
+	int frames_buffered() const { return (int)(m_write_pos.load() - m_read_pos.load()); }
+
+private:
+	Sampler* m_sampler;
+	int m_start_frame;
+	int m_chunk;
+	Priority m_priority;
+	std::atomic<bool> m_priority_applied;
+
+	std::vector<float> m_ring;
+	uint64_t m_depth;
+	uint64_t m_mask;
+	std::atomic<uint64_t> m_fill;
+	std::atomic<uint64_t> m_write_pos;
+	std::atomic<uint64_t> m_read_pos;
+	std::atomic<bool> m_done;
+	std::atomic<bool> m_quit;
+	std::atomic<bool> m_no_wait;
+	std::atomic<bool> m_reading;
+
+	// seek requests are numbered, the render thread acknowledges one by
+	// reporting where in the ring the frames for the new position begin
+	std::atomic<int> m_seek_frame;
+	std::atomic<unsigned> m_seek_gen;
+	std::atomic<unsigned> m_flush_gen;
+	std::atomic<uint64_t> m_flush_pos;
+	unsigned m_read_gen = 0;
+
+	// tail of the old stream being faded out after a seek, consumer side
+	std::vector<float> m_fade;
+	int m_fade_len = 0;
+	int m_fade_done = 0;
+
+	std::atomic<unsigned> m_num_underruns;
+	std::atomic<uint64_t> m_num_underrun_frames;
+
+	std::thread m_thread;
+
+	// count frames of the ring from pos on, wrapping around
+	void _copy_out(uint64_t pos, int count, float* buf) const;
+	bool _apply_priority();
+	void _thread_func();
+};
@@ -19,22 +19,11 @@ void SampleToTrackBuffer(Sampler& sampler, TrackBuffer& track, int buf_size)
 	int pos = 0;
 	while (reading)
 	{
-		int i = 0;
-		for (; i < buf_size; i++)
-		{
-			float l, r;
-			bool res = sampler.get_sample(pos, l, r);
-			pos++;
-			if (!res)
-			{
-				reading = false;
-				break;
-			}
-			buf.m_data[i * 2] = l;
-			buf.m_data[i * 2 + 1] = r;
-		}
+		int i = sampler.get_samples(pos, buf_size, buf.m_data);
+		pos += i;
 		if (i < buf_size)
 		{
+			reading = false;
 			memset(buf.m_data + i * 2, 0, (buf_size - i) * sizeof(float)* 2);
 		}
 		track.WriteBlend(buf);
@@ -8,4 +8,16 @@ public:
 	virtual double get_duration() = 0;
 	virtual void set_sample_rate(unsigned sample_rate) = 0;
 	virtual bool get_sample(int i, float& l, float& r) = 0;
+
+	// Renders up to "count" interleaved stereo frames starting at frame i.
+	// Returns the number of frames rendered before the end was reached.
+	virtual int get_samples(int i, int count, float* buf)
+	{
+		int j = 0;
+		for (; j < count; j++)
+		{
+			if (!get_sample(i + j, buf[j * 2], buf[j * 2 + 1])) break;
+		}
+		return j;
+	}
 };
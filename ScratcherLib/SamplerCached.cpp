@@ -0,0 +1,294 @@
+#include <memory.h>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
+#include "SamplerCached.h"
+#include "SourcePrefetcher.h"
+#include "RTCheck.h"
+#include "TrackBuffer.h"
+
+// wait of the background thread with nothing to render, for the reader to move on
+static const std::chrono::milliseconds s_idle_wait(20);
+
+SamplerCached::SamplerCached(SamplerScratch* sampler, int block_size, int window_blocks)
+	: m_sampler(sampler), m_block_size(block_size), m_window_blocks((size_t)std::max(window_blocks, 1)), m_sample_rate(sampler->sample_rate())
+{
+	// a buffer for every block of the window, one for a reader's miss and one for
+	// the background thread
+	m_pool.reserve(m_window_blocks + 2);
+	m_pool.resize(m_window_blocks);
+	for (size_t k = 0; k < m_pool.size(); k++)
+		m_pool[k].resize(m_block_size * 2);
+	m_kept.reserve(m_window_blocks + 2);
+	m_miss_data.resize(m_block_size * 2);
+
+	_resize(m_sampler->get_duration());
+	m_sampler->set_listener(this);
+	m_thread = std::thread(&SamplerCached::_thread_func, this);
+}
+
+SamplerCached::~SamplerCached()
+{
+	m_sampler->set_listener(nullptr);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+size_t SamplerCached::num_blocks()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_blocks.size();
+}
+
+size_t SamplerCached::num_dirty_blocks()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t count = 0;
+	for (size_t b = _window_begin(); b < _window_end(); b++)
+	{
+		if (!m_blocks[b].valid) count++;
+	}
+	return count;
+}
+
+double SamplerCached::get_duration()
+{
+	return m_sampler->get_duration();
+}
+
+void SamplerCached::set_sample_rate(unsigned sample_rate)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (sample_rate == m_sample_rate) return;
+	}
+	m_sampler->set_sample_rate(sample_rate);
+	double duration = m_sampler->get_duration();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_sample_rate = sample_rate;
+		_invalidate_all();
+		_resize(duration);
+	}
+	m_cond.notify_one();
+}
+
+bool SamplerCached::get_sample(int i, float& l, float& r)
+{
+	float v[2];
+	bool res = get_samples(i, 1, v) == 1;
+	l = res ? v[0] : 0.0f;
+	r = res ? v[1] : 0.0f;
+	return res;
+}
+
+int SamplerCached::get_samples(int i, int count, float* buf)
+{
+	if (m_prefetcher != nullptr)
+		m_prefetcher->set_position(i);
+
+	int done = 0;
+	while (done < count)
+	{
+		int pos = i + done;
+		size_t b = (size_t)(pos / m_block_size);
+		int offset = pos - (int)b * m_block_size;
+		int n = std::min(count - done, m_block_size - offset);
+
+		bool hit = false;
+		bool known = false;
+		unsigned version = 0;
+		{
+			RT_CHECK_LOCK("SamplerCached::m_mutex");
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_hint_block = b;
+			if (b < m_blocks.size() && m_blocks[b].valid)
+			{
+				const Block& block = m_blocks[b];
+				int copy = std::max(0, std::min(n, block.num_frames - offset));
+				memcpy(buf + done * 2, block.data.data() + offset * 2, sizeof(float) * copy * 2);
+				done += copy;
+				if (copy < n) return done;
+				hit = true;
+			}
+			else if (b < m_blocks.size())
+			{
+				known = true;
+				version = m_blocks[b].version;
+			}
+		}
+		if (hit) continue;
+
+		if (!known)
+		{
+			int rendered = m_sampler->get_samples(pos, n, buf + done * 2);
+			done += rendered;
+			if (rendered < n) break;
+			continue;
+		}
+
+		// a miss renders the whole block and keeps it, unless it was edited meanwhile,
+		// some of its source was not in memory for a reader that does not wait, or no
+		// buffer is free before the background thread recycles those left behind
+		RT_CHECK_LOCK("SamplerCached::m_miss_mutex");
+		std::lock_guard<std::mutex> miss_lock(m_miss_mutex);
+		unsigned misses = TrackBuffer::NoWait::Misses();
+		int num_frames = m_sampler->get_samples((int)b * m_block_size, m_block_size, m_miss_data.data());
+		bool complete = TrackBuffer::NoWait::Misses() == misses;
+		int copy = std::max(0, std::min(n, num_frames - offset));
+		memcpy(buf + done * 2, m_miss_data.data() + offset * 2, sizeof(float) * copy * 2);
+		done += copy;
+		{
+			RT_CHECK_LOCK("SamplerCached::m_mutex");
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (complete && b < m_blocks.size() && m_blocks[b].version == version && !m_blocks[b].valid)
+				_keep(b, m_miss_data, num_frames);
+		}
+		if (copy < n) break;
+	}
+	return done;
+}
+
+void SamplerCached::sampler_invalidated(double t_begin, double t_end)
+{
+	double duration = m_sampler->get_duration();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		_resize(duration);
+
+		// 1 frame of margin for the float rounding of the output time
+		double rate = (double)m_sample_rate;
+		double f_begin = floor((t_begin * rate - 1.0) / (double)m_block_size);
+		size_t b_begin = f_begin > 0.0 ? (size_t)f_begin : 0;
+		size_t b_end = m_blocks.size();
+		if (t_end < duration)
+		{
+			b_end = std::min(b_end, (size_t)((t_end * rate + 1.0) / (double)m_block_size) + 1);
+		}
+		for (size_t b = b_begin; b < b_end; b++)
+		{
+			m_blocks[b].valid = false;
+			m_blocks[b].version = ++m_version;
+		}
+	}
+	m_cond.notify_one();
+}
+
+void SamplerCached::_resize(double duration)
+{
+	size_t num_blocks = (size_t)ceil(duration * (double)m_sample_rate / (double)m_block_size) + 1;
+	size_t old_num = m_blocks.size();
+	for (size_t k = m_kept.size(); k-- > 0;)
+	{
+		if (m_kept[k] >= num_blocks) _release(k);
+	}
+	m_blocks.resize(num_blocks);
+	for (size_t b = old_num; b < num_blocks; b++)
+	{
+		m_blocks[b].version = ++m_version;
+	}
+}
+
+void SamplerCached::_invalidate_all()
+{
+	for (size_t b = 0; b < m_blocks.size(); b++)
+	{
+		m_blocks[b].valid = false;
+		m_blocks[b].version = ++m_version;
+	}
+}
+
+// The window is centered on the last block read
+size_t SamplerCached::_window_begin() const
+{
+	size_t half = m_window_blocks / 2;
+	return m_hint_block > half ? m_hint_block - half : 0;
+}
+
+size_t SamplerCached::_window_end() const
+{
+	return std::min(_window_begin() + m_window_blocks, m_blocks.size());
+}
+
+// Swaps the rendered data into block b, and data gets a buffer back for the next
+// render: the block's own, or one of the pool for a block not kept yet. False when
+// the pool is empty.
+bool SamplerCached::_keep(size_t b, std::vector<float>& data, int num_frames)
+{
+	Block& block = m_blocks[b];
+	if (block.data.empty())
+	{
+		if (m_pool.empty()) return false;
+		block.data.swap(data);
+		data.swap(m_pool.back());
+		m_pool.pop_back();
+		m_kept.push_back(b);
+	}
+	else
+	{
+		block.data.swap(data);
+	}
+	block.num_frames = num_frames;
+	block.valid = true;
+	return true;
+}
+
+// Gives the buffer of the k-th kept block back to the pool
+void SamplerCached::_release(size_t k)
+{
+	Block& block = m_blocks[m_kept[k]];
+	m_pool.emplace_back();
+	m_pool.back().swap(block.data);
+	block.valid = false;
+	m_kept[k] = m_kept.back();
+	m_kept.pop_back();
+}
+
+void SamplerCached::_thread_func()
+{
+	std::vector<float> data(m_block_size * 2);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_quit)
+	{
+		// the blocks the reader left behind give their buffers back
+		size_t begin = _window_begin();
+		size_t end = _window_end();
+		for (size_t k = m_kept.size(); k-- > 0;)
+		{
+			if (m_kept[k] < begin || m_kept[k] >= end) _release(k);
+		}
+
+		// nearest dirty block of the window at or after the last one requested
+		size_t num = end - begin;
+		size_t first = m_hint_block < end ? m_hint_block - begin : 0;
+		size_t b = end;
+		for (size_t k = 0; k < num; k++)
+		{
+			size_t j = begin + (first + k) % num;
+			if (!m_blocks[j].valid)
+			{
+				b = j;
+				break;
+			}
+		}
+		if (b == end)
+		{
+			m_cond.wait_for(lock, s_idle_wait);
+			continue;
+		}
+
+		unsigned version = m_blocks[b].version;
+		lock.unlock();
+
+		int num_frames = m_sampler->get_samples((int)b * m_block_size, m_block_size, data.data());
+
+		lock.lock();
+		if (b < m_blocks.size() && m_blocks[b].version == version)
+			_keep(b, data, num_frames);
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Sampler.h"
+#include "SamplerScratch.h"
+
+class SourcePrefetcher;
+
+// Block-level render cache in front of a SamplerScratch.
+// Edits reported by the sampler only mark the blocks they touch as dirty,
+// a background thread re-renders them, and clean blocks are served from memory.
+// Only a window of window_blocks blocks around the last read is kept, in buffers
+// allocated up front: the background thread recycles those of the blocks left
+// behind, so a reader never allocates.
+class SamplerCached : public Sampler, public SamplerScratch::Listener
+{
+public:
+	SamplerCached(SamplerScratch* sampler, int block_size = 4096, int window_blocks = 512);
+	~SamplerCached();
+
+	SamplerScratch* sampler() const { return m_sampler; }
+
+	// receives the position of every read, so the source can be fetched ahead of it
+	void set_prefetcher(SourcePrefetcher* prefetcher) { m_prefetcher = prefetcher; }
+	int block_size() const { return m_block_size; }
+
+	size_t num_blocks();
+
+	// blocks of the window not rendered yet
+	size_t num_dirty_blocks();
+
+	virtual double get_duration();
+	virtual void set_sample_rate(unsigned sample_rate);
+	virtual bool get_sample(int i, float& l, float& r);
+	virtual int get_samples(int i, int count, float* buf);
+
+	virtual void sampler_invalidated(double t_begin, double t_end);
+
+private:
+	struct Block
+	{
+		std::vector<float> data; // a buffer of the pool while the block is kept
+		int num_frames = 0;
+		bool valid = false;
+		unsigned version = 0;
+	};
+
+	SamplerScratch* m_sampler;
+	int m_block_size;
+	size_t m_window_blocks;
+	unsigned m_sample_rate; // under m_mutex
+	SourcePrefetcher* m_prefetcher = nullptr;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<Block> m_blocks;
+
+	// free buffers of block_size frames, and the blocks holding the others
+	std::vector<std::vector<float>> m_pool;
+	std::vector<size_t> m_kept;
+
+	// block rendered by a reader on a miss
+	std::mutex m_miss_mutex;
+	std::vector<float> m_miss_data;
+
+	size_t m_hint_block = 0;
+	unsigned m_version = 0;
+	bool m_quit = false;
+	std::thread m_thread;
+
+	void _resize(double duration);
+	void _invalidate_all();
+	size_t _window_begin() const;
+	size_t _window_end() const;
+	bool _keep(size_t b, std::vector<float>& data, int num_frames);
+	void _release(size_t k);
+	void _thread_func();
+};
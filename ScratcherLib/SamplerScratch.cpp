@@ -2,86 +2,341 @@
 #include "TrackBuffer.h"
 #include "CHSpline.h"
 #include "LinearInterpolate.h"
+#include "AudioReadWrite.h"
+#include "RTCheck.h"
+#include <memory.h>
 #include <cstdint>
 #include <cmath>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+
+struct SamplerScratch::Params
+{
+	CHSpline timemap;
+	LinearInterpolate volume;
+	TrackBuffer* bgm = nullptr;
+	float bgm_volume = 1.0f;
+	unsigned sample_rate_out = 44100;
+	float bake_max_error = 0.0f;
+	unsigned version = 0;
+
+	// output time ranges changed by the last edits, the newest last, so the baked
+	// table can catch up on them instead of being baked again as a whole
+	struct Edit
+	{
+		unsigned version;
+		double t_begin;
+		double t_end;
+	};
+	std::vector<Edit> edits;
+
+	// the BGM converted once to stereo at the output rate, shared between snapshots.
+	// A track of its own, so only its page cache is kept in memory.
+	std::shared_ptr<TrackBuffer> bgm_premix;
+};
+
+struct SamplerScratch::MapHints
+{
+	CHSpline::Cursor timemap;
+	LinearInterpolate::Cursor volume;
+};
+
+// Read access to the current parameters. The reader is registered in the counter
+// of its epoch before the pointer is loaded, so an edit that sees that counter
+// drained after a flip knows that nobody still holds a snapshot replaced before it.
+class SamplerScratch::Snapshot
+{
+public:
+	Snapshot(const SamplerScratch* sampler) : m_sampler(sampler)
+	{
+		m_epoch = m_sampler->m_epoch.load() & 1;
+		m_sampler->m_num_readers[m_epoch].fetch_add(1);
+		m_params = m_sampler->m_params.load();
+	}
+
+	~Snapshot()
+	{
+		m_sampler->m_num_readers[m_epoch].fetch_sub(1);
+	}
+
+	const Params& operator*() const { return *m_params; }
+	const Params* operator->() const { return m_params; }
+
+private:
+	const SamplerScratch* m_sampler;
+	const Params* m_params;
+	unsigned m_epoch;
+};
 
 SamplerScratch::SamplerScratch(TrackBuffer* buffer)
-	: m_buffer(buffer), m_sample_rate_in(buffer->Rate()), m_sample_rate_out(44100), m_timemap(new CHSpline), m_volume(new LinearInterpolate)
+	: m_buffer(buffer), m_sample_rate_in(buffer->Rate()), m_params(new Params), m_epoch(0), m_premix_stop(false)
 {
-	m_timemap->Add(0.0f, 0.0f);
-	m_volume->Add(0.0f, 1.0f);
+	m_num_readers[0] = 0;
+	m_num_readers[1] = 0;
+	Params* p = m_params.load();
+	p->timemap.Add(0.0f, 0.0f);
+	p->volume.Add(0.0f, 1.0f);
 }
 
 SamplerScratch::~SamplerScratch()
 {
+	_stop_premix();
+	for (size_t k = 0; k < m_retired.size(); k++)
+		delete m_retired[k];
+	for (size_t k = 0; k < m_retired_grace.size(); k++)
+		delete m_retired_grace[k];
+	delete m_params.load();
+}
 
+SamplerScratch::Params* SamplerScratch::_clone()
+{
+	return new Params(*m_params.load());
+}
+
+void SamplerScratch::_publish(Params* params, double t_begin, double t_end)
+{
+	static const size_t s_max_edits = 32;
+	params->version++;
+	if (params->edits.size() >= s_max_edits)
+		params->edits.erase(params->edits.begin());
+	Params::Edit edit = { params->version, t_begin, t_end };
+	params->edits.push_back(edit);
+	m_retired.push_back(m_params.exchange(params));
+	_reclaim();
+}
+
+// A reader of the previous epoch may still hold what was replaced before the
+// last flip, one of the current epoch only what was replaced since. Two rounds,
+// as the readers of the epoch just ended are usually gone right away.
+void SamplerScratch::_reclaim()
+{
+	for (int round = 0; round < 2; round++)
+	{
+		unsigned epoch = m_epoch.load();
+		if (m_num_readers[(epoch + 1) & 1].load() > 0) return;
+		for (size_t k = 0; k < m_retired_grace.size(); k++)
+			delete m_retired_grace[k];
+		m_retired_grace.clear();
+		if (m_retired.empty()) return;
+		m_retired_grace.swap(m_retired);
+		m_epoch.store(epoch + 1);
+	}
+}
+
+size_t SamplerScratch::num_retired()
+{
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	return m_retired.size() + m_retired_grace.size();
 }
 
 float SamplerScratch::start_pos() const
 {
-	return m_timemap->sample(0).y;
+	Snapshot p(this);
+	return p->timemap.sample(0).y;
 }
 
 float SamplerScratch::start_slope() const
 {
-	return m_timemap->sample(0).slope;
+	Snapshot p(this);
+	return p->timemap.sample(0).slope;
 }
 
 size_t SamplerScratch::num_control_points() const
 {
-	return m_timemap->num_samples() - 1;
+	Snapshot p(this);
+	return p->timemap.num_samples() - 1;
 }
 
 void SamplerScratch::control_point(size_t i, float& x, float& y, float& slope) const
 {
-	const auto& sample = m_timemap->sample(i + 1);
+	Snapshot p(this);
+	const auto& sample = p->timemap.sample(i + 1);
 	x = sample.x;
 	y = sample.y;
 	slope = sample.slope;
 }
 
 
+void SamplerScratch::_invalidate(double t_begin, double t_end)
+{
+	if (m_listener != nullptr)
+		m_listener->sampler_invalidated(t_begin, t_end);
+}
+
+// The output between the neighbours of sample j depends on it.
+// The last sample also controls the run-out and the duration.
+void SamplerScratch::_timemap_range(const Params& p, size_t j, double& t_begin, double& t_end)
+{
+	t_begin = j > 0 ? (double)p.timemap.sample(j - 1).x : 0.0;
+	t_end = j + 1 < p.timemap.num_samples() ? (double)p.timemap.sample(j + 1).x : DBL_MAX;
+}
+
+void SamplerScratch::_volume_range(const Params& p, size_t j, double& t_begin, double& t_end)
+{
+	t_begin = j > 0 ? (double)p.volume.sample(j - 1).x : 0.0;
+	t_end = j + 1 < p.volume.num_samples() ? (double)p.volume.sample(j + 1).x : DBL_MAX;
+}
+
 void SamplerScratch::set_start_pos(float y)
 {
-	m_timemap->Move(0, y);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->timemap.Move(0, y);
+	double t_begin, t_end;
+	_timemap_range(*p, 0, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
 }
 
 void SamplerScratch::set_start_slope(float slope)
 {
-	m_timemap->SetSlope(0, slope);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->timemap.SetSlope(0, slope);
+	double t_begin, t_end;
+	_timemap_range(*p, 0, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
 }
 
 int SamplerScratch::add_control_point(float x, float y)
 {
-	return m_timemap->Add(x, y) - 1;
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	int j = p->timemap.Add(x, y);
+	double t_begin, t_end;
+	_timemap_range(*p, j, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+	return j - 1;
 }
 
 void SamplerScratch::move_control_point(size_t i, float y)
 {
-	m_timemap->Move(i + 1, y);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->timemap.Move(i + 1, y);
+	double t_begin, t_end;
+	_timemap_range(*p, i + 1, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
 }
 
 float SamplerScratch::move_control_point(size_t i, float x, float y)
 {
-	return m_timemap->Move(i + 1, x, y);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	x = p->timemap.Move(i + 1, x, y);
+	double t_begin, t_end;
+	_timemap_range(*p, i + 1, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+	return x;
 }
 
 void SamplerScratch::set_control_point_slope(size_t i, float slope)
 {
-	m_timemap->SetSlope(i + 1, slope);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->timemap.SetSlope(i + 1, slope);
+	double t_begin, t_end;
+	_timemap_range(*p, i + 1, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
 }
 
+void SamplerScratch::segment(size_t i, int& kind, float& rate, float& depth) const
+{
+	Snapshot p(this);
+	const auto& sample = p->timemap.sample(i);
+	kind = sample.kind;
+	rate = sample.rate;
+	depth = sample.depth;
+}
+
+void SamplerScratch::set_segment(size_t i, int kind, float rate, float depth)
+{
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->timemap.SetSegment(i, kind, rate, depth);
+	double t_begin, t_end;
+	_timemap_range(*p, i, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+}
 
 void SamplerScratch::remove_control_point(size_t i)
 {
-	m_timemap->Remove(i + 1);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	double t_begin, t_end;
+	_timemap_range(*p, i + 1, t_begin, t_end);
+	p->timemap.Remove(i + 1);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+}
+
+void SamplerScratch::set_control_points(size_t count, const float* x, const float* y, const float* slope)
+{
+	_load_time_map(false, 0.0f, 0.0f, count, x, y, slope);
+}
+
+void SamplerScratch::set_time_map(float start_pos, float start_slope, size_t count, const float* x, const float* y, const float* slope)
+{
+	_load_time_map(true, start_pos, start_slope, count, x, y, slope);
+}
+
+void SamplerScratch::_load_time_map(bool set_start, float start_pos, float start_slope, size_t count, const float* x, const float* y, const float* slope)
+{
+	std::vector<CHSpline::Sample> samples(count + 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		samples[i + 1].x = x[i];
+		samples[i + 1].y = y[i];
+		samples[i + 1].slope = slope[i];
+	}
+	auto less = [](const CHSpline::Sample& lhs, const CHSpline::Sample& rhs) -> bool { return lhs.x < rhs.x; };
+	if (!std::is_sorted(samples.begin() + 1, samples.end(), less))
+		std::stable_sort(samples.begin() + 1, samples.end(), less);
+
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	samples[0] = p->timemap.sample(0);
+	if (set_start)
+	{
+		samples[0].y = start_pos;
+		samples[0].slope = start_slope;
+	}
+	// points kept from the old map keep the segment settings they start
+	size_t num_old = p->timemap.num_samples();
+	CHSpline::Cursor c = p->timemap.cursor(1);
+	for (size_t i = 1; i < samples.size(); i++)
+	{
+		while (c.index() < num_old && c->x < samples[i].x) ++c;
+		if (c.index() == num_old) break;
+		if (c->x != samples[i].x) continue;
+		samples[i].kind = c->kind;
+		samples[i].rate = c->rate;
+		samples[i].depth = c->depth;
+	}
+	p->timemap.Load(samples.data(), samples.size());
+	_publish(p);
+	_invalidate(0.0, DBL_MAX);
 }
 
 double SamplerScratch::get_duration()
+{
+	Snapshot p(this);
+	return _duration(*p);
+}
+
+double SamplerScratch::_duration(const Params& p) const
 {
 	static float acc = 5.0f;
 	float x0, y0, slope0;
-	m_timemap->right_bound(x0, y0, slope0);
+	p.timemap.right_bound(x0, y0, slope0);
 
 	float d_s = 1.0f - slope0;
 	float A = acc;
@@ -97,12 +352,18 @@ double SamplerScratch::get_duration()
 
 void SamplerScratch::time_map(float x, float& y, float& slope)
 {
-	bool res = m_timemap->f(x, y, slope);
+	Snapshot p(this);
+	_time_map(*p, x, y, slope);
+}
+
+void SamplerScratch::_time_map(const Params& p, float x, float& y, float& slope, MapHints* hints) const
+{
+	bool res = hints != nullptr ? p.timemap.f(x, y, slope, hints->timemap) : p.timemap.f(x, y, slope);
 	if (!res)
 	{
 		static float acc = 5.0f;
 		float x0, y0, slope0;
-		m_timemap->right_bound(x0, y0, slope0);
+		p.timemap.right_bound(x0, y0, slope0);
 
 		float t = x - x0;
 
@@ -126,12 +387,13 @@ void SamplerScratch::time_map(float x, float& y, float& slope)
 
 void SamplerScratch::uniform_time_samples(float interval, std::vector<float>& v)
 {
-	m_timemap->uniform_samples(interval, 0.0f, v);
+	Snapshot p(this);
+	p->timemap.uniform_samples(interval, 0.0f, v);
 	float x = interval * (float)v.size();
 
 	static float acc = 5.0f;
 	float x0, y0, slope0;
-	m_timemap->right_bound(x0, y0, slope0);
+	p->timemap.right_bound(x0, y0, slope0);
 
 	float d_s = 1.0f - slope0;
 	float A = acc;
@@ -148,7 +410,7 @@ void SamplerScratch::uniform_time_samples(float interval, std::vector<float>& v)
 
 	y0 = (0.5f * A)*dur*dur + slope0 * dur + y0;
 
-	double total = get_duration();
+	double total = _duration(*p);
 	while (x<total)
 	{
 		float y = x - (x0 + dur) + y0;	
@@ -157,100 +419,599 @@ void SamplerScratch::uniform_time_samples(float interval, std::vector<float>& v)
 	}
 }
 
+bool SamplerScratch::source_span(double t_begin, double t_end, unsigned& begin, unsigned& end)
+{
+	static const int s_num_points = 8;
+
+	Snapshot p(this);
+	double pos_min = DBL_MAX;
+	double pos_max = -DBL_MAX;
+	double step_max = 1.0;
+	for (int k = 0; k <= s_num_points; k++)
+	{
+		float t_out = (float)(t_begin + (t_end - t_begin) * (double)k / (double)s_num_points);
+		float t_in, changing_rate;
+		_time_map(*p, t_out, t_in, changing_rate);
+		double pos = t_in * (double)m_sample_rate_in;
+		double step = fabs(changing_rate * (double)m_sample_rate_in / (double)p->sample_rate_out);
+		if (pos < pos_min) pos_min = pos;
+		if (pos > pos_max) pos_max = pos;
+		if (step > step_max) step_max = step;
+	}
+
+	// filter taps, and overshoot of the curve between the points
+	pos_min -= step_max + 2.0;
+	pos_max += step_max + 2.0;
+
+	double length = (double)m_buffer->NumberOfSamples();
+	if (pos_max < 0.0 || pos_min >= length) return false;
+	begin = pos_min > 0.0 ? (unsigned)pos_min : 0;
+	end = pos_max < length ? (unsigned)pos_max + 1 : (unsigned)length;
+	return true;
+}
+
 float SamplerScratch::start_volume() const
 {
-	return m_volume->sample(0).y;
+	Snapshot p(this);
+	return p->volume.sample(0).y;
 }
 
 size_t SamplerScratch::num_volume_control_points() const
 {
-	return m_volume->num_samples() - 1;
+	Snapshot p(this);
+	return p->volume.num_samples() - 1;
 }
 
 void SamplerScratch::volume_control_point(size_t i, float& x, float& y) const
 {
-	const auto& sample = m_volume->sample(i + 1);
+	Snapshot p(this);
+	const auto& sample = p->volume.sample(i + 1);
 	x = sample.x;
 	y = sample.y;
 }
 
 void SamplerScratch::set_start_volume(float y)
 {
-	m_volume->Move(0, y);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->volume.Move(0, y);
+	double t_begin, t_end;
+	_volume_range(*p, 0, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
 }
 
 int SamplerScratch::add_volume_control_point(float x, float y)
 {
-	return m_volume->Add(x, y) - 1;
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	int j = p->volume.Add(x, y);
+	double t_begin, t_end;
+	_volume_range(*p, j, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+	return j - 1;
 }
 
 void SamplerScratch::move_volume_control_point(size_t i, float y)
 {
-	m_volume->Move(i + 1, y);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->volume.Move(i + 1, y);
+	double t_begin, t_end;
+	_volume_range(*p, i + 1, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
 }
 
 float SamplerScratch::move_volume_control_point(size_t i, float x, float y)
 {
-	return m_volume->Move(i + 1, x, y);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	x = p->volume.Move(i + 1, x, y);
+	double t_begin, t_end;
+	_volume_range(*p, i + 1, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+	return x;
 }
 
 void SamplerScratch::remove_volume_control_point(size_t i)
 {
-	m_volume->Remove(i + 1);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	double t_begin, t_end;
+	_volume_range(*p, i + 1, t_begin, t_end);
+	p->volume.Remove(i + 1);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+}
+
+void SamplerScratch::volume_segment(size_t i, int& kind, float& rate, float& duty) const
+{
+	Snapshot p(this);
+	const auto& sample = p->volume.sample(i);
+	kind = sample.kind;
+	rate = sample.rate;
+	duty = sample.duty;
+}
+
+void SamplerScratch::set_volume_segment(size_t i, int kind, float rate, float duty)
+{
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->volume.SetSegment(i, kind, rate, duty);
+	double t_begin, t_end;
+	_volume_range(*p, i, t_begin, t_end);
+	_publish(p, t_begin, t_end);
+	_invalidate(t_begin, t_end);
+}
+
+void SamplerScratch::set_volume_control_points(size_t count, const float* x, const float* y)
+{
+	std::vector<LinearInterpolate::Sample> samples(count + 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		samples[i + 1].x = x[i];
+		samples[i + 1].y = y[i];
+	}
+	auto less = [](const LinearInterpolate::Sample& lhs, const LinearInterpolate::Sample& rhs) -> bool { return lhs.x < rhs.x; };
+	if (!std::is_sorted(samples.begin() + 1, samples.end(), less))
+		std::stable_sort(samples.begin() + 1, samples.end(), less);
+
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	samples[0] = p->volume.sample(0);
+	// points kept from the old map keep the segment settings they start
+	size_t num_old = p->volume.num_samples();
+	LinearInterpolate::Cursor c = p->volume.cursor(1);
+	for (size_t i = 1; i < samples.size(); i++)
+	{
+		while (c.index() < num_old && c->x < samples[i].x) ++c;
+		if (c.index() == num_old) break;
+		if (c->x != samples[i].x) continue;
+		samples[i].kind = c->kind;
+		samples[i].rate = c->rate;
+		samples[i].duty = c->duty;
+	}
+	p->volume.Load(samples.data(), samples.size());
+	_publish(p);
+	_invalidate(0.0, DBL_MAX);
 }
 
 void SamplerScratch::volume(float x, float& y)
 {
-	bool res = m_volume->f(x, y);
+	Snapshot p(this);
+	_volume(*p, x, y);
+}
+
+void SamplerScratch::_volume(const Params& p, float x, float& y, MapHints* hints) const
+{
+	bool res = hints != nullptr ? p.volume.f(x, y, hints->volume) : p.volume.f(x, y);
 	if (!res)
 	{
 		if (x < 0.0f)
 		{
-			y = m_volume->sample(0).y;
+			y = p.volume.sample(0).y;
 		}
 		else
 		{
-			y = m_volume->sample(m_volume->num_samples() - 1).y;
+			y = p.volume.sample(p.volume.num_samples() - 1).y;
 		}			 
 	}
 }
 
+// The premix of a BGM, converted right away when it is loaded and left empty for
+// the premix thread otherwise. A failing conversion leaves the premix where it stopped.
+static std::shared_ptr<TrackBuffer> s_premix_bgm(TrackBuffer* bgm, unsigned sample_rate, bool loading)
+{
+	static const unsigned s_premix_cache = 131072;
+	std::shared_ptr<TrackBuffer> premix = std::make_shared<TrackBuffer>(sample_rate, 2);
+	// read in order, a few pages ahead of playback
+	premix->SetPageCacheCapacity(s_premix_cache);
+	if (!loading)
+	{
+		TrackResampler resampler(bgm, premix.get());
+		resampler.finish();
+	}
+	return premix;
+}
+
+// Converts what the BGM has loaded since the last time, in steps that can be stopped,
+// until it is loaded and converted to its end. The renders of the output the premix
+// grows into had no BGM there, only that is invalidated.
+void SamplerScratch::_premix_thread_func(TrackBuffer* bgm, std::shared_ptr<TrackBuffer> premix)
+{
+	static const int s_poll_ms = 100;
+	unsigned step = bgm->Rate() * 10;
+	double rate = (double)premix->Rate();
+	TrackResampler resampler(bgm, premix.get());
+	bool ok = true;
+	while (ok && !m_premix_stop)
+	{
+		// read before the length, so that what is there once it stops is all of it
+		bool loading = bgm->IsLoading();
+		unsigned end = bgm->NumberOfSamples();
+		while (ok && !m_premix_stop && resampler.input_pos() < end)
+		{
+			unsigned begin = premix->NumberOfSamples();
+			ok = resampler.convert(std::min(end, resampler.input_pos() + step));
+			_invalidate((double)begin / rate, (double)premix->NumberOfSamples() / rate);
+		}
+		if (!ok || m_premix_stop) break;
+		if (!loading)
+		{
+			unsigned begin = premix->NumberOfSamples();
+			resampler.finish();
+			_invalidate((double)begin / rate, DBL_MAX);
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(m_premix_mutex);
+		m_premix_cond.wait_for(lock, std::chrono::milliseconds(s_poll_ms), [this]() { return m_premix_stop.load(); });
+	}
+}
+
+void SamplerScratch::_start_premix(TrackBuffer* bgm, std::shared_ptr<TrackBuffer> premix)
+{
+	m_premix_thread = std::thread(&SamplerScratch::_premix_thread_func, this, bgm, premix);
+}
+
+void SamplerScratch::_stop_premix()
+{
+	if (!m_premix_thread.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(m_premix_mutex);
+		m_premix_stop = true;
+	}
+	m_premix_cond.notify_one();
+	m_premix_thread.join();
+	m_premix_stop = false;
+}
+
 void SamplerScratch::set_bgm(TrackBuffer* buffer)
 {
-	m_buffer_bgm = buffer;
-	if (m_buffer_bgm != nullptr)
-		m_sample_rate_in_bgm = buffer->Rate();
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	_stop_premix();
+	bool loading = buffer != nullptr && buffer->IsLoading();
+	Params* p = _clone();
+	p->bgm = buffer;
+	p->bgm_premix = buffer != nullptr ? s_premix_bgm(buffer, p->sample_rate_out, loading) : nullptr;
+	std::shared_ptr<TrackBuffer> premix = p->bgm_premix;
+	_publish(p, 0.0, 0.0);
+	_invalidate(0.0, DBL_MAX);
+	// once published, so that nothing rendered without the premix outlives its invalidations
+	if (loading) _start_premix(buffer, premix);
 }
 
-bool SamplerScratch::get_sample(int i, float& l, float& r)
+void SamplerScratch::wait_bgm_premix()
 {
-	l = 0.0f;
-	r = 0.0f;
-	float t_out = (float)i / (float)m_sample_rate_out;
-	if (t_out >= get_duration()) return false;	
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	if (m_premix_thread.joinable()) m_premix_thread.join();
+}
 
-	do
+void SamplerScratch::prefetch_bgm(int i, int count)
+{
+	std::shared_ptr<TrackBuffer> premix;
 	{
-		float t_in, changing_rate;
-		time_map(t_out, t_in, changing_rate);
-		double pos = t_in * (double)m_sample_rate_in;
-		double step = fabs(changing_rate * (double)m_sample_rate_in / (double)m_sample_rate_out);
-		if (pos < 0.0 || pos >= (double)m_buffer->NumberOfSamples()) break;
+		Snapshot p(this);
+		premix = p->bgm_premix;
+	}
+	if (premix && i >= 0 && count > 0)
+		premix->Prefetch((unsigned)i, (unsigned)count);
+}
 
-		float v_l, v_r;
+void SamplerScratch::load_missed()
+{
+	std::shared_ptr<TrackBuffer> premix;
+	{
+		Snapshot p(this);
+		premix = p->bgm_premix;
+	}
+	m_buffer->LoadMissed();
+	if (premix) premix->LoadMissed();
+}
 
-		if (step <= 1.0)
+TrackBuffer* SamplerScratch::bgm() const
+{
+	Snapshot p(this);
+	return p->bgm;
+}
+
+void SamplerScratch::set_bgm_volume(float vol)
+{
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->bgm_volume = vol;
+	_publish(p, 0.0, 0.0);
+	if (p->bgm != nullptr)
+		_invalidate(0.0, DBL_MAX);
+}
+
+float SamplerScratch::bgm_volume() const
+{
+	Snapshot p(this);
+	return p->bgm_volume;
+}
+
+unsigned SamplerScratch::sample_rate() const
+{
+	Snapshot p(this);
+	return p->sample_rate_out;
+}
+
+void SamplerScratch::set_sample_rate(unsigned sample_rate)
+{
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	if (sample_rate == m_params.load()->sample_rate_out) return;
+
+	_stop_premix();
+	Params* p = _clone();
+	p->sample_rate_out = sample_rate;
+	bool loading = p->bgm != nullptr && p->bgm->IsLoading();
+	if (p->bgm != nullptr)
+		p->bgm_premix = s_premix_bgm(p->bgm, sample_rate, loading);
+	TrackBuffer* bgm = p->bgm;
+	std::shared_ptr<TrackBuffer> premix = p->bgm_premix;
+	_publish(p);
+	if (loading) _start_premix(bgm, premix);
+}
+
+void SamplerScratch::set_control_rate_baking(float max_error)
+{
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->bake_max_error = max_error;
+	_publish(p);
+	_invalidate(0.0, DBL_MAX);
+}
+
+float SamplerScratch::control_rate_baking() const
+{
+	Snapshot p(this);
+	return p->bake_max_error;
+}
+
+void SamplerScratch::_eval_knot(const Params& p, int frame, BakedKnot& knot, MapHints* hints) const
+{
+	float t_out = (float)frame / (float)p.sample_rate_out;
+	float t_in, changing_rate;
+	_time_map(p, t_out, t_in, changing_rate, hints);
+	knot.frame = frame;
+	knot.pos = t_in * (double)m_sample_rate_in;
+	knot.step = changing_rate * (double)m_sample_rate_in / (double)p.sample_rate_out;
+	_volume(p, t_out, knot.amp, hints);
+}
+
+// Frames the baked table has to hold for the output duration
+static int s_baked_num_frames(double duration, unsigned rate_out)
+{
+	int num_frames = (int)ceil(duration * (double)rate_out);
+	while (num_frames > 0 && (float)(num_frames - 1) / (float)rate_out >= duration) num_frames--;
+	while ((float)num_frames / (float)rate_out < duration) num_frames++;
+	return num_frames;
+}
+
+void SamplerScratch::_bake(const Params& p)
+{
+	m_baked.clear();
+	m_baked_cursor = 0;
+	m_baked_version = p.version;
+	m_baked_rate = p.sample_rate_out;
+	m_baked_error = p.bake_max_error;
+	m_baked_num_frames = s_baked_num_frames(_duration(p), p.sample_rate_out);
+
+	BakedKnot knot;
+	_eval_knot(p, 0, knot, nullptr);
+	m_baked.push_back(knot);
+	_fit_knots(p, m_baked_num_frames, m_baked);
+}
+
+void SamplerScratch::_update_baked(const Params& p)
+{
+	// a new rate or error bound changes every knot, as does missing some of the edits
+	if (m_baked.size() < 2 || m_baked_rate != p.sample_rate_out || m_baked_error != p.bake_max_error
+		|| p.edits.empty() || p.edits.front().version > m_baked_version + 1)
+	{
+		_bake(p);
+		return;
+	}
+
+	double t_begin = DBL_MAX;
+	double t_end = -DBL_MAX;
+	for (size_t k = 0; k < p.edits.size(); k++)
+	{
+		const Params::Edit& edit = p.edits[k];
+		if (edit.version <= m_baked_version || edit.t_end <= edit.t_begin) continue;
+		t_begin = std::min(t_begin, edit.t_begin);
+		t_end = std::max(t_end, edit.t_end);
+	}
+	m_baked_version = p.version;
+
+	// frames [f_begin, f_end) changed, with 1 frame of margin for the float rounding of
+	// the output time. A new duration changes the table up to its end.
+	int num_frames = s_baked_num_frames(_duration(p), p.sample_rate_out);
+	double rate = (double)p.sample_rate_out;
+	int f_begin = INT_MAX;
+	int f_end = INT_MAX;
+	if (t_begin < t_end)
+	{
+		f_begin = (int)std::max(0.0, floor(t_begin * rate) - 1.0);
+		if (t_end * rate + 1.0 < (double)num_frames)
+			f_end = (int)ceil(t_end * rate) + 1;
+	}
+	if (num_frames != m_baked_num_frames)
+	{
+		f_begin = std::min(f_begin, std::max(0, std::min(num_frames, m_baked_num_frames) - 1));
+		f_end = INT_MAX;
+	}
+	if (f_begin >= num_frames) return;
+
+	// the knots before the range and from the first one at its end on stay
+	auto less = [](const BakedKnot& lhs, const BakedKnot& rhs) -> bool { return lhs.frame < rhs.frame; };
+	BakedKnot temp = { f_begin, 0.0, 0.0, 0.0f };
+	size_t first = std::lower_bound(m_baked.begin(), m_baked.end(), temp, less) - m_baked.begin();
+	if (first > 0) first--;
+	size_t last = m_baked.size();
+	if (f_end < num_frames)
+	{
+		temp.frame = f_end;
+		last = std::lower_bound(m_baked.begin(), m_baked.end(), temp, less) - m_baked.begin();
+	}
+
+	std::vector<BakedKnot>& knots = m_rebake_knots;
+	knots.assign(1, m_baked[first]);
+	if (knots[0].frame >= f_begin) _eval_knot(p, knots[0].frame, knots[0], nullptr);
+	_fit_knots(p, last < m_baked.size() ? m_baked[last].frame : num_frames, knots);
+
+	// the refit replaces knots first to last, both included
+	m_baked.erase(m_baked.begin() + first, m_baked.begin() + std::min(last + 1, m_baked.size()));
+	m_baked.insert(m_baked.begin() + first, knots.begin(), knots.end());
+	m_baked_cursor = 0;
+	m_baked_num_frames = num_frames;
+}
+
+void SamplerScratch::_fit_knots(const Params& p, int end, std::vector<BakedKnot>& knots)
+{
+	static const int s_max_step = 64;
+	unsigned rate_out = p.sample_rate_out;
+	int frame = knots.back().frame;
+
+	// the volume is linear between its control points and gate edges, knots are forced onto
+	// those in the range: from the first control point past frame, up to end
+	size_t num_points = p.volume.num_samples();
+	size_t lo = 0;
+	size_t hi = num_points;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if ((int)ceil(p.volume.sample(mid).x * (double)rate_out) <= frame) lo = mid + 1;
+		else hi = mid;
+	}
+	std::vector<int>& cuts = m_fit_cuts;
+	cuts.clear();
+	if (lo < num_points)
+	{
+		LinearInterpolate::Cursor c = p.volume.cursor(lo);
+		for (size_t j = lo; j < num_points; j++, ++c)
+		{
+			int cut = (int)ceil(c->x * (double)rate_out);
+			if (cut >= end) break;
+			cuts.push_back(cut);
+		}
+	}
+	// a gate reaching into the range starts at the control point before it. Past one edge
+	// per frame the rest of the range is fitted without forced knots.
+	MapHints hints;
+	p.volume.gate_edges((double)rate_out, (double)frame / (double)rate_out, (double)end / (double)rate_out, (size_t)std::max(end - frame, 0), cuts, lo > 0 ? lo - 1 : 0);
+	std::sort(cuts.begin(), cuts.end());
+	size_t i_cut = 0;
+
+	// the map is smooth, so each block starts from twice the previous step
+	int last_step = s_max_step;
+	while (frame < end)
+	{
+		while (i_cut < cuts.size() && cuts[i_cut] <= frame) i_cut++;
+
+		int step = std::min(std::min(s_max_step, last_step * 2), end - frame);
+		if (i_cut < cuts.size() && cuts[i_cut] - frame < step) step = cuts[i_cut] - frame;
+
+		const BakedKnot k0 = knots.back();
+		BakedKnot k1;
+		while (true)
 		{
-			uint32_t u_pos = (uint32_t)(pos);
+			_eval_knot(p, frame + step, k1, &hints);
+			if (step < 2) break;
+
+			// both the position and the rate are followed: a rate off by e over the
+			// step moves the source by about e * step frames
+			bool fit = true;
+			for (int q = 1; q < 4 && fit; q++)
+			{
+				int f = frame + step * q / 4;
+				BakedKnot mid;
+				_eval_knot(p, f, mid, &hints);
+				double u = (double)(f - frame) / (double)step;
+				double pos = k0.pos + (k1.pos - k0.pos) * u;
+				double rate = k0.step + (k1.step - k0.step) * u;
+				fit = fabs(pos - mid.pos) <= (double)p.bake_max_error && fabs(rate - mid.step) * (double)step <= (double)p.bake_max_error;
+			}
+			if (fit) break;
+			step /= 2;
+		}
+		knots.push_back(k1);
+		frame += step;
+		last_step = step;
+	}
+}
+
+void SamplerScratch::_baked_params(int i, double& pos, double& step, float& amp)
+{
+	size_t k = m_baked_cursor;
+	if (i < m_baked[k].frame || i >= m_baked[k + 1].frame)
+	{
+		// sequential rendering moves on to the next knot, anything else searches
+		if (k + 2 < m_baked.size() && i >= m_baked[k + 1].frame && i < m_baked[k + 2].frame)
+		{
+			k++;
+		}
+		else
+		{
+			BakedKnot temp = { i, 0.0, 0.0, 0.0f };
+			auto iter = std::upper_bound(m_baked.begin(), m_baked.end(), temp, [](const BakedKnot& lhs, const BakedKnot& rhs) -> bool { return lhs.frame < rhs.frame; });
+			k = iter - m_baked.begin() - 1;
+		}
+		m_baked_cursor = k;
+	}
+
+	const BakedKnot& k0 = m_baked[k];
+	const BakedKnot& k1 = m_baked[k + 1];
+	double u = (double)(i - k0.frame) / (double)(k1.frame - k0.frame);
+	pos = k0.pos + (k1.pos - k0.pos) * u;
+	step = fabs(k0.step + (k1.step - k0.step) * u);
+	amp = k0.amp + (k1.amp - k0.amp) * (float)u;
+}
+
+// A run of output frames sharing the same filter mode, rendered by one kernel.
+struct RenderRun
+{
+	int count;
+	const double* pos;
+	const double* step;
+	const float* amp;
+	const float* src; // source frames starting at src_begin, zero outside the track
+	int src_begin;
+	const float* bgm; // premixed BGM
+	float bgm_volume;
+	float* out;
+};
+
+typedef void(*RenderKernel)(const RenderRun& run);
+
+// CHN is the source's channel count, which a TrackBuffer keeps at 1 or 2.
+template <unsigned CHN, bool FILTER, bool AUTOMATION, bool HAS_BGM>
+static void s_render_kernel(const RenderRun& run)
+{
+	const unsigned stride = CHN;
+	const unsigned right = CHN == 1 ? 0 : 1;
+	const float* src = run.src;
+	float amp = run.amp[0];
+	for (int k = 0; k < run.count; k++)
+	{
+		double pos = run.pos[k] - (double)run.src_begin;
+		float v_l, v_r;
+		if (!FILTER)
+		{
+			int u_pos = (int)pos;
 			double frac = pos - (double)u_pos;
-			float a[2], b[2];
-			m_buffer->Sample(u_pos, a);
-			m_buffer->Sample(u_pos + 1, b);
+			const float* a = src + u_pos * stride;
+			const float* b = a + stride;
 			v_l = a[0] * (1.0 - frac) + b[0] * frac;
-			v_r = a[1] * (1.0 - frac) + b[1] * frac;
+			v_r = CHN != 1 ? a[right] * (1.0 - frac) + b[right] * frac : v_l;
 		}
 		else
 		{
+			double step = run.step[k];
 			int i_pos = (int)ceil(pos - step);
 			double sum_w = 0.0;
 			double sum_l = 0.0;
@@ -259,95 +1020,227 @@ bool SamplerScratch::get_sample(int i, float& l, float& r)
 			{
 				double w = step - fabs((double)i_pos - pos);
 				sum_w += w;
-				if (i_pos >= 0)
-				{
-					float v[2];
-					m_buffer->Sample(i_pos, v);
-					sum_l += w * v[0];
-					sum_r += w * v[1];
-				}
+				sum_l += w * src[i_pos * stride];
+				sum_r += w * src[i_pos * stride + right];
 				i_pos++;
 			}
 			v_l = sum_l / sum_w;
 			v_r = sum_r / sum_w;
 		}
 
-		float amp;
-		volume(t_out, amp);
-		v_l *= amp;
-		v_r *= amp;
+		if (AUTOMATION) amp = run.amp[k];
+		float l = v_l * amp;
+		float r = v_r * amp;
+		if (HAS_BGM)
+		{
+			l += run.bgm[k * 2] * run.bgm_volume;
+			r += run.bgm[k * 2 + 1] * run.bgm_volume;
+		}
+		run.out[k * 2] = l;
+		run.out[k * 2 + 1] = r;
+	}
+}
 
-		l += v_l;
-		r += v_r;
+template <unsigned CHN, bool FILTER>
+static RenderKernel s_select_kernel(bool automation, bool has_bgm)
+{
+	if (automation)
+		return has_bgm ? s_render_kernel<CHN, FILTER, true, true> : s_render_kernel<CHN, FILTER, true, false>;
+	else
+		return has_bgm ? s_render_kernel<CHN, FILTER, false, true> : s_render_kernel<CHN, FILTER, false, false>;
+}
+
+static RenderKernel s_select_kernel(unsigned chn, bool filter, bool automation, bool has_bgm)
+{
+	if (chn == 1)
+		return filter ? s_select_kernel<1, true>(automation, has_bgm) : s_select_kernel<1, false>(automation, has_bgm);
+	else
+		return filter ? s_select_kernel<2, true>(automation, has_bgm) : s_select_kernel<2, false>(automation, has_bgm);
+}
 
-	} while (false);
+int SamplerScratch::_render_block(const Params& p, int i, int count, float* buf)
+{
+	m_blk_pos.resize(count);
+	m_blk_step.resize(count);
+	m_blk_amp.resize(count);
 
-	if (m_buffer_bgm != nullptr)
+	// parameters
+	int n = 0;
+	if (p.bake_max_error > 0.0f)
+	{
+		if (m_baked_version != p.version) _update_baked(p);
+		n = std::min(count, std::max(0, m_baked_num_frames - i));
+		for (int k = 0; k < n; k++)
+		{
+			_baked_params(i + k, m_blk_pos[k], m_blk_step[k], m_blk_amp[k]);
+		}
+	}
+	else
 	{
-		do
+		double duration = _duration(p);
+		MapHints hints;
+		for (; n < count; n++)
 		{
-			double step = (double)m_sample_rate_in_bgm / (double)m_sample_rate_out;
-			double pos = (double)((uint64_t)i * (uint64_t)m_sample_rate_in_bgm / (uint64_t)m_sample_rate_out);
-			if (pos >= (double)m_buffer_bgm->NumberOfSamples()) break;
+			float t_out = (float)(i + n) / (float)p.sample_rate_out;
+			if (t_out >= duration) break;
+			float t_in, changing_rate;
+			_time_map(p, t_out, t_in, changing_rate, &hints);
+			m_blk_pos[n] = t_in * (double)m_sample_rate_in;
+			m_blk_step[n] = fabs(changing_rate * (double)m_sample_rate_in / (double)p.sample_rate_out);
+			_volume(p, t_out, m_blk_amp[n], &hints);
+		}
+	}
+	if (n == 0) return 0;
 
-			float v_l, v_r;
+	_render_source(p, i, n, buf);
+	return n;
+}
+
+void SamplerScratch::_render_source(const Params& p, int i, int n, float* buf)
+{
+	// split into runs of the same filter mode and dispatch a kernel per run
+	double length = (double)m_buffer->NumberOfSamples();
+	unsigned chn = m_buffer->NumberOfChannels();
+	int bgm_end = 0;
+	if (p.bgm_premix)
+	{
+		bgm_end = std::max(0, std::min(n, (int)p.bgm_premix->NumberOfSamples() - i));
+		m_blk_bgm.resize((size_t)bgm_end * 2);
+		if (bgm_end > 0)
+			p.bgm_premix->GetSamples((unsigned)i, (unsigned)bgm_end, m_blk_bgm.data());
+	}
+	int j = 0;
+	while (j < n)
+	{
+		bool valid = m_blk_pos[j] >= 0.0 && m_blk_pos[j] < length;
+		bool filter = m_blk_step[j] > 1.0;
+		bool has_bgm = j < bgm_end;
+		int k = j + 1;
+		for (; k < n; k++)
+		{
+			bool valid_k = m_blk_pos[k] >= 0.0 && m_blk_pos[k] < length;
+			if (valid_k != valid || (valid && (m_blk_step[k] > 1.0) != filter) || k == bgm_end) break;
+		}
 
-			if (step <= 1.0)
+		RenderRun run;
+		run.count = k - j;
+		run.pos = m_blk_pos.data() + j;
+		run.step = m_blk_step.data() + j;
+		run.amp = m_blk_amp.data() + j;
+		run.bgm = has_bgm ? m_blk_bgm.data() + (size_t)j * 2 : nullptr;
+		run.bgm_volume = p.bgm_volume;
+		run.out = buf + j * 2;
+
+		if (valid)
+		{
+			double lo = run.pos[0];
+			double hi = run.pos[0];
+			double max_step = 1.0;
+			bool automation = false;
+			for (int q = 0; q < run.count; q++)
 			{
-				uint32_t u_pos = (uint32_t)(pos);
-				double frac = pos - (double)u_pos;
-				float a[2], b[2];
-				m_buffer_bgm->Sample(u_pos, a);
-				m_buffer_bgm->Sample(u_pos + 1, b);
-				v_l = a[0] * (1.0 - frac) + b[0] * frac;
-				v_r = a[1] * (1.0 - frac) + b[1] * frac;
+				if (run.pos[q] < lo) lo = run.pos[q];
+				if (run.pos[q] > hi) hi = run.pos[q];
+				if (run.step[q] > max_step) max_step = run.step[q];
+				if (run.amp[q] != run.amp[0]) automation = true;
 			}
-			else
+			int src_begin = (int)floor(lo - max_step) - 1;
+			int src_end = (int)ceil(hi + max_step) + 2;
+			m_blk_src.assign((size_t)(src_end - src_begin) * chn, 0.0f);
+			if (src_end > 0)
 			{
-				int i_pos = (int)ceil(pos - step);
-				double sum_w = 0.0;
-				double sum_l = 0.0;
-				double sum_r = 0.0;
-				while ((double)i_pos < pos + step)
-				{
-					double w = step - fabs((double)i_pos - pos);
-					sum_w += w;
-					if (i_pos >= 0)
-					{
-						float v[2];
-						m_buffer_bgm->Sample(i_pos, v);
-						sum_l += w * v[0];
-						sum_r += w * v[1];
-					}
-					i_pos++;
-				}
-				v_l = sum_l / sum_w;
-				v_r = sum_r / sum_w;
+				int fetch_begin = std::max(src_begin, 0);
+				m_buffer->GetSamples((unsigned)fetch_begin, (unsigned)(src_end - fetch_begin), m_blk_src.data() + (fetch_begin - src_begin) * chn);
 			}
+			run.src = m_blk_src.data();
+			run.src_begin = src_begin;
 
-			v_l *= m_bgm_volume;
-			v_r *= m_bgm_volume;
+			s_select_kernel(chn, filter, automation, has_bgm)(run);
+		}
+		else if (has_bgm)
+		{
+			for (int q = 0; q < run.count * 2; q++)
+				run.out[q] = run.bgm[q] * run.bgm_volume;
+		}
+		else
+		{
+			memset(run.out, 0, sizeof(float) * run.count * 2);
+		}
+		j = k;
+	}
+}
 
-			l += v_l;
-			r += v_r;
+int SamplerScratch::_render(int i, int count, float* buf)
+{
+	static const int s_block_size = 1024;
+	int done = 0;
+	while (done < count)
+	{
+		int n = std::min(s_block_size, count - done);
+		int rendered;
+		{
+			// a new snapshot is picked up at every block
+			Snapshot p(this);
+			rendered = _render_block(*p, i + done, n, buf + done * 2);
+		}
+		done += rendered;
+		if (rendered < n) break;
+	}
+	return done;
+}
 
-		} while (false);
+int SamplerScratch::render_positions(int i, const double* pos, const double* step, int count, float* buf)
+{
+	static const int s_block_size = 1024;
+	RT_CHECK_LOCK("SamplerScratch::m_render_mutex");
+	std::lock_guard<std::mutex> lock(m_render_mutex);
+	Snapshot p(this);
+	for (int done = 0; done < count; done += s_block_size)
+	{
+		int n = std::min(s_block_size, count - done);
+		m_blk_pos.assign(pos + done, pos + done + n);
+		m_blk_step.resize(n);
+		for (int k = 0; k < n; k++)
+			m_blk_step[k] = fabs(step[done + k]);
+		m_blk_amp.assign(n, 1.0f);
+		_render_source(*p, i + done, n, buf + done * 2);
 	}
+	return count;
+}
 
-	return true;
+bool SamplerScratch::get_sample(int i, float& l, float& r)
+{
+	RT_CHECK_LOCK("SamplerScratch::m_render_mutex");
+	std::lock_guard<std::mutex> lock(m_render_mutex);
+	float v[2];
+	bool res = _render(i, 1, v) == 1;
+	l = res ? v[0] : 0.0f;
+	r = res ? v[1] : 0.0f;
+	return res;
+}
 
+int SamplerScratch::get_samples(int i, int count, float* buf)
+{
+	RT_CHECK_LOCK("SamplerScratch::m_render_mutex");
+	std::lock_guard<std::mutex> lock(m_render_mutex);
+	return _render(i, count, buf);
 }
 
 void SamplerScratch::serialize(FILE* fp)
 {
-	m_timemap->serialize(fp);
-	m_volume->serialize(fp);
-	fwrite(&m_bgm_volume, sizeof(float), 1, fp);
+	Snapshot p(this);
+	p->timemap.serialize(fp);
+	p->volume.serialize(fp);
+	fwrite(&p->bgm_volume, sizeof(float), 1, fp);
 }
 
 void SamplerScratch::deserialize(FILE* fp)
 {
-	m_timemap->deserialize(fp);
-	m_volume->deserialize(fp);
-	fread(&m_bgm_volume, sizeof(float), 1, fp);
+	std::lock_guard<std::mutex> lock(m_edit_mutex);
+	Params* p = _clone();
+	p->timemap.deserialize(fp);
+	p->volume.deserialize(fp);
+	fread(&p->bgm_volume, sizeof(float), 1, fp);
+	_publish(p);
+	_invalidate(0.0, DBL_MAX);
 }
\ No newline at end of file
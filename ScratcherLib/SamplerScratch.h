@@ -3,6 +3,11 @@
 #include <stdio.h>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <cfloat>
 #include "Sampler.h"
 
 class CHSpline;
@@ -12,6 +17,16 @@ class TrackBuffer;
 class SamplerScratch : public Sampler
 {
 public:
+	// Receives the output time ranges [t_begin, t_end) (in seconds) whose rendering
+	// is invalidated by an edit. Called on the editing thread once the edit is published,
+	// and on the premix thread as the BGM premix grows, see set_bgm.
+	class Listener
+	{
+	public:
+		virtual ~Listener() {}
+		virtual void sampler_invalidated(double t_begin, double t_end) = 0;
+	};
+
 	SamplerScratch(TrackBuffer* buffer);
 	~SamplerScratch();
 
@@ -28,12 +43,33 @@ public:
 	void move_control_point(size_t i, float y);
 	float move_control_point(size_t i, float x, float y);
 	void set_control_point_slope(size_t i, float slope);
+
+	// Segment i starts at the start point for i = 0, and at control point i - 1 otherwise.
+	// kind is a CHSpline::SegmentKind, oscillations use rate in Hz and depth in seconds.
+	void segment(size_t i, int& kind, float& rate, float& depth) const;
+	void set_segment(size_t i, int kind, float rate = 0.0f, float depth = 0.0f);
 	void remove_control_point(size_t i);
 
+	// Replaces all control points after the start point in one step.
+	// The points are expected sorted by x, unsorted input is sorted first.
+	void set_control_points(size_t count, const float* x, const float* y, const float* slope);
+	// The same, with the start point's position and slope, all in one step.
+	void set_time_map(float start_pos, float start_slope, size_t count, const float* x, const float* y, const float* slope);
+
 	virtual double get_duration();
 	void time_map(float x, float& y, float& slope);
 	void uniform_time_samples(float interval, std::vector<float>& v);
 
+	// Source frames [begin, end) read while rendering the output between t_begin and t_end
+	bool source_span(double t_begin, double t_end, unsigned& begin, unsigned& end);
+
+	// Loads the premixed BGM of output frames [i, i + count) into its page cache
+	void prefetch_bgm(int i, int count);
+
+	// Loads the pages of the source and of the premixed BGM missed by renderers that
+	// do not wait, see TrackBuffer::NoWait
+	void load_missed();
+
 	float start_volume() const;
 	size_t num_volume_control_points() const;
 	void volume_control_point(size_t i, float& x, float& y) const;
@@ -44,28 +80,48 @@ public:
 	float move_volume_control_point(size_t i, float x, float y);
 	void remove_volume_control_point(size_t i);
 
+	// Numbered like the time map segments, kind is a LinearInterpolate::SegmentKind
+	void volume_segment(size_t i, int& kind, float& rate, float& duty) const;
+	void set_volume_segment(size_t i, int kind, float rate = 0.0f, float duty = 0.5f);
+	void set_volume_control_points(size_t count, const float* x, const float* y);
+
 	void volume(float x, float& y);	
 
+	// The BGM is premixed to stereo at the output rate. One that is still loading is
+	// premixed on a thread of the sampler as it grows, and the output it reaches is
+	// invalidated as it goes.
 	void set_bgm(TrackBuffer* buffer);
 
-	TrackBuffer* bgm() const { return m_buffer_bgm; }
+	TrackBuffer* bgm() const;
 
-	void set_bgm_volume(float vol) 
-	{ 
-		m_bgm_volume = vol;
-	}
+	// Waits for the premix of a BGM that was loading to reach its end, for rendering
+	// all of it. The BGM has to stop loading for that.
+	void wait_bgm_premix();
 
-	float bgm_volume() const
-	{
-		return m_bgm_volume;
-	}
+	void set_bgm_volume(float vol);
+	float bgm_volume() const;
 
-	virtual void set_sample_rate(unsigned sample_rate)
-	{
-		m_sample_rate_out = sample_rate;
-	}
+	unsigned sample_rate() const;
+	virtual void set_sample_rate(unsigned sample_rate);
 
 	virtual bool get_sample(int i, float& l, float& r);
+	virtual int get_samples(int i, int count, float* buf);
+
+	// Renders count frames at the given source positions and steps (in source frames)
+	// instead of following the time map, without the volume envelope. The BGM is mixed
+	// in at output frames [i, i + count). Used by live control like LiveJog.
+	int render_positions(int i, const double* pos, const double* step, int count, float* buf);
+
+	void set_listener(Listener* listener) { m_listener = listener; }
+
+	// Bakes the time map and the volume into a control-rate table that is linearly
+	// interpolated per frame. Knots are placed every 1..64 output frames so that the
+	// source position stays within max_error source frames. 0 disables the baking.
+	void set_control_rate_baking(float max_error);
+	float control_rate_baking() const;
+
+	// replaced parameter snapshots still waiting for their readers to finish
+	size_t num_retired();
 
 	void serialize(FILE* fp);
 	void deserialize(FILE* fp);
@@ -73,12 +129,89 @@ public:
 private:
 	TrackBuffer* m_buffer;
 	unsigned m_sample_rate_in;
-	unsigned m_sample_rate_out;
 
-	std::unique_ptr<CHSpline> m_timemap;
-	std::unique_ptr<LinearInterpolate> m_volume;
-
-	TrackBuffer* m_buffer_bgm = nullptr;
-	unsigned m_sample_rate_in_bgm;
-	float m_bgm_volume = 1.0f;
-};
\ No newline at end of file
+	// Everything the renderers read lives in an immutable Params snapshot.
+	// An edit copies the current one, changes the copy and swaps the pointer,
+	// renderers pick up the new one at their next block. Replaced snapshots are
+	// deleted by a later edit after a grace period: readers register in the
+	// counter of the epoch they start in, and once the counter of the previous
+	// epoch has drained, what was replaced before the last flip is deleted and
+	// the epoch flips again. Readers never wait and never free.
+	struct Params;
+	class Snapshot;
+	std::atomic<Params*> m_params;
+	mutable std::atomic<int> m_num_readers[2];
+	std::atomic<unsigned> m_epoch;
+	// replaced in the current epoch, and replaced before the last flip
+	std::vector<Params*> m_retired;
+	std::vector<Params*> m_retired_grace;
+
+	// serializes the edits, never taken by the renderers
+	std::mutex m_edit_mutex;
+	Listener* m_listener = nullptr;
+
+	// premixes a BGM that is loading, started and stopped under m_edit_mutex
+	std::thread m_premix_thread;
+	std::mutex m_premix_mutex;
+	std::condition_variable m_premix_cond;
+	std::atomic<bool> m_premix_stop;
+	void _start_premix(TrackBuffer* bgm, std::shared_ptr<TrackBuffer> premix);
+	void _stop_premix();
+	void _premix_thread_func(TrackBuffer* bgm, std::shared_ptr<TrackBuffer> premix);
+
+	Params* _clone();
+	// replaces the control points, and the start point's position and slope if set_start
+	void _load_time_map(bool set_start, float start_pos, float start_slope, size_t count, const float* x, const float* y, const float* slope);
+	// [t_begin, t_end) is the output changed for the baked table, empty for none
+	void _publish(Params* params, double t_begin = 0.0, double t_end = DBL_MAX);
+	void _reclaim();
+
+	// serializes the renderers over the scratch buffers and the baked table
+	std::mutex m_render_mutex;
+
+	struct BakedKnot
+	{
+		int frame;
+		double pos;
+		double step;
+		float amp;
+	};
+
+	unsigned m_baked_version = ~0u;
+	unsigned m_baked_rate = 0;
+	float m_baked_error = 0.0f;
+	int m_baked_num_frames = 0;
+	size_t m_baked_cursor = 0;
+	std::vector<BakedKnot> m_baked;
+	// scratch of the rebakes: the refitted knots and the frames knots are forced onto
+	std::vector<BakedKnot> m_rebake_knots;
+	std::vector<int> m_fit_cuts;
+
+	// segments of the last lookups, for evaluating frame after frame
+	struct MapHints;
+
+	void _eval_knot(const Params& p, int frame, BakedKnot& knot, MapHints* hints) const;
+	void _bake(const Params& p);
+	void _update_baked(const Params& p);
+	void _fit_knots(const Params& p, int end, std::vector<BakedKnot>& knots);
+	void _baked_params(int i, double& pos, double& step, float& amp);
+
+	// per-block scratch buffers of the render kernels
+	std::vector<double> m_blk_pos;
+	std::vector<double> m_blk_step;
+	std::vector<float> m_blk_amp;
+	std::vector<float> m_blk_src;
+	std::vector<float> m_blk_bgm;
+
+	int _render_block(const Params& p, int i, int count, float* buf);
+	void _render_source(const Params& p, int i, int n, float* buf);
+	int _render(int i, int count, float* buf);
+
+	double _duration(const Params& p) const;
+	void _time_map(const Params& p, float x, float& y, float& slope, MapHints* hints = nullptr) const;
+	void _volume(const Params& p, float x, float& y, MapHints* hints = nullptr) const;
+
+	void _invalidate(double t_begin, double t_end);
+	static void _timemap_range(const Params& p, size_t j, double& t_begin, double& t_end);
+	static void _volume_range(const Params& p, size_t j, double& t_begin, double& t_end);
+};
@@ -0,0 +1,66 @@
+#include <chrono>
+#include <algorithm>
+#include "SourcePrefetcher.h"
+#include "SamplerScratch.h"
+#include "TrackBuffer.h"
+
+SourcePrefetcher::SourcePrefetcher(SamplerScratch* sampler, double look_ahead)
+	: m_sampler(sampler), m_look_ahead(look_ahead), m_position(-1)
+{
+	m_thread = std::thread(&SourcePrefetcher::_thread_func, this);
+}
+
+SourcePrefetcher::~SourcePrefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+void SourcePrefetcher::_prefetch(int i)
+{
+	static const double s_window = 0.02;
+
+	TrackBuffer* buffer = m_sampler->buffer();
+	double t = (double)i / (double)m_sampler->sample_rate();
+
+	// in time order, as long as the covered range fits in half of the page cache
+	unsigned budget = buffer->PageCacheCapacity() / 2;
+	unsigned lo = (unsigned)(-1);
+	unsigned hi = 0;
+	for (double w = 0.0; w < m_look_ahead; w += s_window)
+	{
+		unsigned begin, end;
+		if (!m_sampler->source_span(t + w, t + w + s_window, begin, end)) continue;
+		lo = std::min(lo, begin);
+		hi = std::max(hi, end);
+		if (hi - lo > budget) break;
+		buffer->Prefetch(begin, end - begin);
+	}
+
+	m_sampler->prefetch_bgm(i, (int)(m_look_ahead * (double)m_sampler->sample_rate()));
+}
+
+void SourcePrefetcher::_thread_func()
+{
+	int last = -1;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_quit)
+	{
+		m_cond.wait_for(lock, std::chrono::milliseconds(5));
+		if (m_quit) break;
+		lock.unlock();
+		// pages the renderers found missing, whether on the time map or not
+		m_sampler->load_missed();
+		int i = m_position;
+		if (i >= 0 && i != last)
+		{
+			last = i;
+			_prefetch(i);
+		}
+		lock.lock();
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+class SamplerScratch;
+
+// Warms the page caches of the source TrackBuffer and of the BGM on a helper thread,
+// and loads the pages that renderers under TrackBuffer::NoWait found missing.
+// The upcoming time map is known in advance, so the source ranges needed over
+// the next look_ahead seconds are predictable even for reverse and back-and-forth moves.
+class SourcePrefetcher
+{
+public:
+	SourcePrefetcher(SamplerScratch* sampler, double look_ahead = 0.5);
+	~SourcePrefetcher();
+
+	// output frame being rendered, safe to call from the audio thread
+	void set_position(int i) { m_position = i; }
+
+private:
+	SamplerScratch* m_sampler;
+	double m_look_ahead;
+	std::atomic<int> m_position;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_quit = false;
+	std::thread m_thread;
+
+	void _prefetch(int i);
+	void _thread_func();
+};
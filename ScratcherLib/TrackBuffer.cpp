@@ -1,4 +1,6 @@
 #include "TrackBuffer.h"
+#include "RTCheck.h"
+#include "TrackSummary.h"
 #include <memory.h>
 #include <cmath>
 #include <cassert>
@@ -42,6 +44,55 @@ unsigned TrackBuffer::GetLocalBufferSize()
 	return s_localBufferSize;
 }
 
+static const unsigned s_pageSize = 16384;
+static const unsigned s_numPages = 64;
+unsigned TrackBuffer::PageCacheCapacity()
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	return s_pageSize * (unsigned)m_pages.size();
+}
+
+void TrackBuffer::SetPageCacheCapacity(unsigned frames)
+{
+	size_t numPages = max((frames + s_pageSize - 1) / s_pageSize, 2u);
+	std::unique_lock<std::mutex> lock(m_cacheMutex);
+	while (true)
+	{
+		bool loading = false;
+		for (size_t i = 0; i < m_pages.size(); i++)
+			loading = loading || m_pages[i].loading;
+		if (!loading) break;
+		m_pageLoaded.wait(lock);
+	}
+	for (size_t i = numPages; i < m_pages.size(); i++)
+		delete[] m_pages[i].data;
+	m_pages.resize(numPages);
+	m_lastPage = -1;
+}
+
+static thread_local int s_noWait = 0;
+static thread_local unsigned s_misses = 0;
+
+TrackBuffer::NoWait::NoWait(bool active) : m_active(active)
+{
+	if (m_active) s_noWait++;
+}
+
+TrackBuffer::NoWait::~NoWait()
+{
+	if (m_active) s_noWait--;
+}
+
+bool TrackBuffer::NoWait::Active()
+{
+	return s_noWait > 0;
+}
+
+unsigned TrackBuffer::NoWait::Misses()
+{
+	return s_misses;
+}
+
 TrackBuffer::TrackBuffer(unsigned rate, unsigned chn) : m_rate(rate)
 {
 	if (chn < 1)
@@ -56,24 +107,48 @@ TrackBuffer::TrackBuffer(unsigned rate, unsigned chn) : m_rate(rate)
 
 	m_fp = tmpfile();
 
-	m_localBuffer = new float[s_localBufferSize*m_chn];
-	m_localBufferPos = (unsigned)(-1);
+	m_pages.resize(s_numPages);
+	m_lastPage = -1;
+	m_useCount = 0;
 
 	m_volume = 1.0f;
 	m_pan = 0.0f;
 	m_cursor = 0.0f;
 	m_length = 0;
 	m_alignPos = (unsigned)(-1);
+	m_fileAtEnd = false;
+	m_loading = false;
+	m_summary = nullptr;
+	m_missedPage = (unsigned)(-1);
+}
+
+TrackBuffer::TrackBuffer(Source* source, unsigned rate, unsigned chn, unsigned length) : TrackBuffer(rate, chn)
+{
+	m_source = source;
+	m_stored.resize((length + s_pageSize - 1) / s_pageSize, false);
+	m_length = length;
+	m_alignPos = 0;
+	m_cursor = (float)length;
 }
 
 TrackBuffer::~TrackBuffer()
 {
-	delete m_localBuffer;
+	// first, a source may call ReloadSource from a thread of its own until deleted
+	delete m_source;
+	for (size_t i = 0; i < m_pages.size(); i++)
+		delete[] m_pages[i].data;
 	fclose(m_fp);
+	delete m_summary.load();
+}
+
+void TrackBuffer::SetSummary(TrackSummary* summary)
+{
+	delete m_summary.exchange(summary);
 }
 
 void TrackBuffer::_seek(unsigned upos)
 {
+	m_fileAtEnd = false;
 	if (upos <= m_length)
 	{
 		fseek(m_fp, (long)(sizeof(float)*upos*m_chn), SEEK_SET);
@@ -111,6 +186,7 @@ void TrackBuffer::MoveCursor(float delta)
 
 void TrackBuffer::SeekToCursor()
 {
+	std::lock_guard<std::mutex> lock(m_fileMutex);
 	unsigned upos = (unsigned)(m_cursor);
 	_seek(upos);
 }
@@ -121,8 +197,8 @@ void TrackBuffer::_writeSamples(unsigned count, const float* samples, unsigned a
 	unsigned upos = (unsigned)(m_cursor)+m_alignPos - alignPos;
 	_seek(upos);
 	fwrite(samples, sizeof(float), count*m_chn, m_fp);
-	m_length = max(m_length, upos + count);
-	m_localBufferPos = -1;
+	m_length = max(m_length.load(), upos + count);
+	_invalidatePages(upos, count);
 }
 
 
@@ -150,6 +226,8 @@ void TrackBuffer::WriteBlend(const NoteBuffer& noteBuf)
 	}
 	unsigned upos = (unsigned)(m_cursor)+m_alignPos - note_alignPos;
 
+	std::unique_lock<std::mutex> fileLock(m_fileMutex);
+
 	float *tmpSamples = new float[count*m_chn];
 	for (unsigned i = 0; i < count; i++)
 	{
@@ -193,6 +271,7 @@ void TrackBuffer::WriteBlend(const NoteBuffer& noteBuf)
 	}
 
 	_writeSamples(count, tmpSamples, note_alignPos);
+	fileLock.unlock();
 
 	delete[] tmpSamples;
 
@@ -200,6 +279,63 @@ void TrackBuffer::WriteBlend(const NoteBuffer& noteBuf)
 }
 
 
+void TrackBuffer::Append(const float* samples, unsigned count)
+{
+	if (m_alignPos == (unsigned)(-1)) m_alignPos = 0;
+
+	unsigned upos;
+	{
+		std::lock_guard<std::mutex> lock(m_fileMutex);
+		upos = m_length;
+		// consecutive appends keep the stdio write buffer, a seek would flush it
+		if (!m_fileAtEnd)
+		{
+			fseek(m_fp, (long)(sizeof(float)*upos*m_chn), SEEK_SET);
+			m_fileAtEnd = true;
+		}
+		fwrite(samples, sizeof(float), count*m_chn, m_fp);
+		m_length = upos + count;
+	}
+	_invalidatePages(upos, count);
+
+	SetCursor((float)(m_length - m_alignPos));
+
+	if (m_loading)
+	{
+		// taken so that a reader between its check and its wait does not miss this
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		m_loadCond.notify_all();
+	}
+}
+
+void TrackBuffer::SetLoading(bool loading)
+{
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	m_loading = loading;
+	m_loadCond.notify_all();
+}
+
+unsigned TrackBuffer::WaitForSamples(unsigned count)
+{
+	std::unique_lock<std::mutex> lock(m_loadMutex);
+	while (m_loading && m_length < count)
+		m_loadCond.wait(lock);
+	return m_length;
+}
+
+void TrackBuffer::Write(unsigned pos, const float* samples, unsigned count)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_fileMutex);
+		// seeking past the end and writing fills the gap with zeros
+		fseek(m_fp, (long)(sizeof(float)*pos*m_chn), SEEK_SET);
+		fwrite(samples, sizeof(float), count*m_chn, m_fp);
+		m_fileAtEnd = pos + count >= m_length;
+		m_length = max(m_length.load(), pos + count);
+	}
+	_invalidatePages(pos, count);
+}
+
 bool TrackBuffer::CombineTracks(unsigned num, TrackBuffer** tracks)
 {
 	NoteBuffer targetBuffer;
@@ -313,57 +449,219 @@ bool TrackBuffer::CombineTracks(unsigned num, TrackBuffer** tracks)
 }
 
 
-void TrackBuffer::Sample(unsigned index, float* sample)
+void TrackBuffer::_invalidatePages(unsigned startIndex, unsigned count)
 {
-	if (index >= m_length)
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	for (size_t i = 0; i < m_pages.size(); i++)
 	{
-		for (unsigned c = 0; c < m_chn; c++)
-			sample[c] = 0.0f;
+		Page& page = m_pages[i];
+		if (page.pos == (unsigned)(-1) || page.pos >= startIndex + count || page.pos + s_pageSize <= startIndex) continue;
+		if (page.loading)
+			page.stale = true;
+		else
+			page.pos = (unsigned)(-1);
+	}
+	m_lastPage = -1;
+}
+
+void TrackBuffer::_loadPage(unsigned pagePos, float* data)
+{
+	memset(data, 0, sizeof(float)*s_pageSize*m_chn);
+	RT_CHECK_LOCK("TrackBuffer::m_fileMutex");
+	std::unique_lock<std::mutex> lock(m_fileMutex);
+	if (pagePos >= m_length) return;
+
+	unsigned count = min(s_pageSize, m_length - pagePos);
+	if (m_source != nullptr && m_source->Persistent())
+	{
+		lock.unlock();
+		RT_CHECK_IO("TrackBuffer::Source");
+		m_source->Read(pagePos, count, data);
+		return;
+	}
+	if (m_source == nullptr || m_stored[pagePos / s_pageSize])
+	{
+		RT_CHECK_IO("TrackBuffer::_loadPage");
+		m_fileAtEnd = false;
+		fseek(m_fp, pagePos * sizeof(float)*m_chn, SEEK_SET);
+		fread(data, sizeof(float), count*m_chn, m_fp);
+		return;
 	}
-	if (m_localBufferPos == (unsigned)(-1) || m_localBufferPos > index || m_localBufferPos + s_localBufferSize <= index)
+
+	// first touch of an on-demand page, decoded outside the file lock
+	unsigned revision = m_sourceRevision;
+	lock.unlock();
+	RT_CHECK_IO("TrackBuffer::Source");
+	m_source->Read(pagePos, count, data);
+	lock.lock();
+
+	// reloaded meanwhile, the page may be from before and is marked stale to be read again
+	if (m_sourceRevision != revision) return;
+
+	m_fileAtEnd = false;
+	fseek(m_fp, pagePos * sizeof(float)*m_chn, SEEK_SET);
+	fwrite(data, sizeof(float), count*m_chn, m_fp);
+	m_stored[pagePos / s_pageSize] = true;
+}
+
+void TrackBuffer::ReloadSource()
+{
 	{
-		m_localBufferPos = (index / s_localBufferSize)*s_localBufferSize;
-		memset(m_localBuffer, 0, sizeof(float)*s_localBufferSize*m_chn);
+		std::lock_guard<std::mutex> lock(m_fileMutex);
+		m_sourceRevision++;
+		m_stored.assign(m_stored.size(), false);
+	}
+	_invalidatePages(0, (unsigned)(-1));
+}
 
-		if (m_localBufferPos < m_length)
+int TrackBuffer::_acquirePage(unsigned pagePos, std::unique_lock<std::mutex>& lock)
+{
+	while (true)
+	{
+		int found = -1;
+		if (m_lastPage >= 0 && m_pages[m_lastPage].pos == pagePos)
 		{
-			fseek(m_fp, m_localBufferPos * sizeof(float)*m_chn, SEEK_SET);
-			fread(m_localBuffer, sizeof(float), min(s_localBufferSize, m_length - m_localBufferPos)*m_chn, m_fp);
+			found = m_lastPage;
 		}
+		else
+		{
+			for (size_t i = 0; i < m_pages.size(); i++)
+			{
+				if (m_pages[i].pos == pagePos)
+				{
+					found = (int)i;
+					break;
+				}
+			}
+		}
+
+		if (found >= 0)
+		{
+			if (m_pages[found].loading)
+			{
+				if (s_noWait > 0)
+				{
+					s_misses++;
+					return -1;
+				}
+				RT_CHECK_LOCK("TrackBuffer::m_pageLoaded");
+				m_pageLoaded.wait(lock);
+				continue;
+			}
+			m_pages[found].lastUse = ++m_useCount;
+			m_lastPage = found;
+			return found;
+		}
+
+		if (s_noWait > 0)
+		{
+			s_misses++;
+			m_missedPage = pagePos;
+			return -1;
+		}
+
+		// miss: evict the least recently used page
+		int victim = -1;
+		for (size_t i = 0; i < m_pages.size(); i++)
+		{
+			if (m_pages[i].loading) continue;
+			if (victim < 0 || m_pages[i].lastUse < m_pages[victim].lastUse) victim = (int)i;
+		}
+		if (victim < 0)
+		{
+			RT_CHECK_LOCK("TrackBuffer::m_pageLoaded");
+			m_pageLoaded.wait(lock);
+			continue;
+		}
+
+		Page& page = m_pages[victim];
+		page.pos = pagePos;
+		page.loading = true;
+		page.stale = false;
+		if (page.data == nullptr)
+			page.data = new float[s_pageSize*m_chn];
+		if (m_lastPage == victim) m_lastPage = -1;
+
+		lock.unlock();
+		_loadPage(pagePos, page.data);
+		lock.lock();
+
+		page.loading = false;
+		m_pageLoaded.notify_all();
+		if (page.stale)
+		{
+			// overwritten while loading
+			page.pos = (unsigned)(-1);
+			continue;
+		}
+		page.lastUse = ++m_useCount;
+		m_lastPage = victim;
+		return victim;
 	}
+}
 
-	unsigned readPos = index - m_localBufferPos;
+void TrackBuffer::Sample(unsigned index, float* sample)
+{
+	RT_CHECK_LOCK("TrackBuffer::m_cacheMutex");
+	std::unique_lock<std::mutex> lock(m_cacheMutex);
+	int page = index < m_length ? _acquirePage((index / s_pageSize)*s_pageSize, lock) : -1;
+	if (page < 0)
+	{
+		for (unsigned c = 0; c < m_chn; c++)
+			sample[c] = 0.0f;
+		return;
+	}
+
+	const float* data = m_pages[page].data;
+	unsigned readPos = index - m_pages[page].pos;
 	for (unsigned c = 0; c < m_chn; c++)
-		sample[c] = m_localBuffer[readPos * m_chn + c];
+		sample[c] = data[readPos * m_chn + c];
 }
 
 void TrackBuffer::GetSamples(unsigned startIndex, unsigned length, float* buffer)
 {
+	RT_CHECK_LOCK("TrackBuffer::m_cacheMutex");
+	std::unique_lock<std::mutex> lock(m_cacheMutex);
 	while (length > 0)
 	{
 		if (startIndex >= m_length) break;
-		if (m_localBufferPos == (unsigned)(-1) || m_localBufferPos > startIndex || m_localBufferPos + s_localBufferSize <= startIndex)
-		{
-			m_localBufferPos = (startIndex / s_localBufferSize)*s_localBufferSize;
-			memset(m_localBuffer, 0, sizeof(float)*s_localBufferSize*m_chn);
-
-			if (m_localBufferPos < m_length)
-			{
-				fseek(m_fp, m_localBufferPos * sizeof(float)*m_chn, SEEK_SET);
-				fread(m_localBuffer, sizeof(float), min(s_localBufferSize, m_length - m_localBufferPos)*m_chn, m_fp);
-			}
-		}
-
-		unsigned readLength = min(length, m_localBufferPos + s_localBufferSize - startIndex);
-		memcpy(buffer, m_localBuffer + (startIndex - m_localBufferPos)*m_chn, sizeof(float)* readLength*m_chn);
+		unsigned pagePos = (startIndex / s_pageSize)*s_pageSize;
+		int page = _acquirePage(pagePos, lock);
+
+		unsigned readLength = min(length, pagePos + s_pageSize - startIndex);
+		if (page >= 0)
+			memcpy(buffer, m_pages[page].data + (startIndex - pagePos)*m_chn, sizeof(float)* readLength*m_chn);
+		else
+			memset(buffer, 0, sizeof(float)* readLength*m_chn);
 		startIndex += readLength;
 		length -= readLength;
 		buffer += readLength* m_chn;
 	}
 }
 
+void TrackBuffer::Prefetch(unsigned startIndex, unsigned length)
+{
+	if (startIndex >= m_length) return;
+	unsigned endIndex = min(m_length.load(), startIndex + length);
+
+	std::unique_lock<std::mutex> lock(m_cacheMutex);
+	for (unsigned pagePos = (startIndex / s_pageSize)*s_pageSize; pagePos < endIndex; pagePos += s_pageSize)
+	{
+		_acquirePage(pagePos, lock);
+	}
+}
+
+void TrackBuffer::LoadMissed()
+{
+	unsigned pagePos = m_missedPage.exchange((unsigned)(-1));
+	if (pagePos != (unsigned)(-1)) Prefetch(pagePos, s_pageSize);
+}
+
 float TrackBuffer::MaxValue()
 {
+	const TrackSummary* summary = m_summary;
+	if (summary != nullptr) return summary->max_value();
+
 	unsigned i;
 	float buf[2];
 	Sample(0, buf);
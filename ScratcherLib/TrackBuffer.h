@@ -1,7 +1,12 @@
 #pragma once
 
 #include <cstdio>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
+class TrackSummary;
 
 inline void CalcPan(float pan, float& l, float& r)
 {
@@ -48,9 +53,46 @@ public:
 class TrackBuffer
 {
 public:
+	// Produces the samples of a track that is decoded on demand instead of written.
+	// Read may be called from any reader thread and serializes itself.
+	class Source
+	{
+	public:
+		virtual ~Source() {}
+		// fills count frames of interleaved samples starting at frame pos
+		virtual void Read(unsigned pos, unsigned count, float* data) = 0;
+		// the samples stay readable in the source, pages need not be kept in the file
+		virtual bool Persistent() const { return false; }
+	};
+
+	// Makes the reads of the calling thread not wait while alive, for the real-time render
+	// threads whose pages are loaded ahead by a prefetcher. A page that is not in the cache,
+	// or still being loaded by another thread, then reads as silence and counts as a miss.
+	class NoWait
+	{
+	public:
+		NoWait(bool active = true);
+		~NoWait();
+		static bool Active();
+		// pages missed by the calling thread so far, in any track
+		static unsigned Misses();
+
+	private:
+		bool m_active;
+	};
+
 	TrackBuffer(unsigned rate = 44100, unsigned chn = 2);
+
+	// A read-only track of length frames taken from source, which is then owned by the
+	// track. Pages are read from the source the first time they are touched and kept
+	// in the file from then on.
+	TrackBuffer(Source* source, unsigned rate, unsigned chn, unsigned length);
 	~TrackBuffer();
 
+	// For a source that gives other samples than before: the pages read from it are
+	// dropped from the file and the page cache, and read again. Safe from any thread.
+	void ReloadSource();
+
 	unsigned Rate() const { return m_rate; }
 	void SetRate(unsigned rate) { m_rate = rate; }
 
@@ -75,10 +117,26 @@ public:
 
 	void WriteBlend(const NoteBuffer& noteBuf);
 
+	// Writes count frames of m_chn interleaved channels after the end of the track and
+	// moves the cursor there. No blending, volume or alignment, for filling a new track.
+	void Append(const float* samples, unsigned count);
+
+	// Writes count frames of m_chn interleaved channels at pos, replacing what is there.
+	// Writing past the end leaves a gap that reads as silence. Safe from several
+	// threads writing disjoint ranges; the cursor is not moved.
+	void Write(unsigned pos, const float* samples, unsigned count);
+
 	unsigned NumberOfSamples()
 	{
 		return m_length;
 	}
+
+	// A track being filled by a loader on another thread. Its length grows with every
+	// Append while loading, WaitForSamples blocks until count frames are there or the
+	// loading stops, and returns the number of frames there.
+	void SetLoading(bool loading);
+	bool IsLoading() const { return m_loading; }
+	unsigned WaitForSamples(unsigned count);
 	unsigned AlignPos()
 	{
 		return m_alignPos;
@@ -87,28 +145,78 @@ public:
 	void Sample(unsigned index, float* sample);
 	float MaxValue();
 
+	// Peaks and levels of the whole track when known, owned by the track once set.
+	// Set when the track is complete; MaxValue uses it instead of reading every sample.
+	const TrackSummary* Summary() const { return m_summary; }
+	void SetSummary(TrackSummary* summary);
+
 	void GetSamples(unsigned startIndex, unsigned length, float* buffer);
 
+	// Loads the pages covering the range into the page cache ahead of use
+	void Prefetch(unsigned startIndex, unsigned length);
+	unsigned PageCacheCapacity();
+
+	// Loads the last page missed by a NoWait reader, if any, from a thread that may wait
+	void LoadMissed();
+
+	// Sets the frames kept in the page cache, rounded up to whole pages. Pages are
+	// allocated as they are first used, up to 1M frames by default. Waits for
+	// the pages being loaded.
+	void SetPageCacheCapacity(unsigned frames);
+
 	bool CombineTracks(unsigned num, TrackBuffer** tracks);
 	unsigned GetLocalBufferSize();
 
 private:
 	FILE *m_fp;
 
+	// on-demand tracks only, which pages are in the file yet (under m_fileMutex)
+	Source* m_source = nullptr;
+	std::vector<bool> m_stored;
+	unsigned m_sourceRevision = 0; // counts ReloadSource
+
+	std::atomic<TrackSummary*> m_summary;
+
 	unsigned m_rate;
 	unsigned m_chn;
 
 	float m_volume;
 	float m_pan;
 
-	float *m_localBuffer;
-	unsigned m_localBufferPos;
-
-	unsigned m_length;
+	std::atomic<unsigned> m_length;
 	unsigned m_alignPos;
 
+	std::atomic<bool> m_loading;
+	std::mutex m_loadMutex;
+	std::condition_variable m_loadCond;
+
 	float m_cursor;
 
+	// LRU page cache over the file. Readers may run on the GUI, playback,
+	// render-cache and prefetch threads; pages are loaded outside m_cacheMutex
+	struct Page
+	{
+		unsigned pos = (unsigned)(-1);
+		float* data = nullptr;
+		unsigned long long lastUse = 0;
+		bool loading = false;
+		bool stale = false;
+	};
+	std::vector<Page> m_pages;
+	int m_lastPage;
+	unsigned long long m_useCount;
+	std::mutex m_cacheMutex;
+	std::condition_variable m_pageLoaded;
+	std::atomic<unsigned> m_missedPage;
+	std::mutex m_fileMutex;
+
+	// the file position is at the end, where the last Append left it
+	bool m_fileAtEnd;
+
+	int _acquirePage(unsigned pagePos, std::unique_lock<std::mutex>& lock);
+	void _loadPage(unsigned pagePos, float* data);
+	void _invalidatePages(unsigned startIndex, unsigned count);
+
 	void _writeSamples(unsigned count, const float* samples, unsigned alignPos);
 	void _seek(unsigned upos);
 };
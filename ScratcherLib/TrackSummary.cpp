@@ -0,0 +1,125 @@
+#include <cmath>
+#include <algorithm>
+#include "TrackSummary.h"
+
+TrackSummary::TrackSummary(unsigned chn) : m_chn(chn < 1 ? 1 : (chn > 2 ? 2 : chn))
+{
+	m_levels.resize(1);
+}
+
+void TrackSummary::add(const float* frames, unsigned count)
+{
+	std::vector<float>& blocks = m_levels[0];
+	for (unsigned i = 0; i < count; i++)
+	{
+		const float* f = frames + i * m_chn;
+		float lo = f[0];
+		float hi = f[0];
+		for (unsigned c = 0; c < m_chn; c++)
+		{
+			float v = f[c];
+			m_peak[c] = std::max(m_peak[c], fabsf(v));
+			m_sum_sq[c] += (double)v * (double)v;
+			lo = std::min(lo, v);
+			hi = std::max(hi, v);
+		}
+		if (m_block_fill == 0)
+		{
+			m_block_min = lo;
+			m_block_max = hi;
+		}
+		else
+		{
+			m_block_min = std::min(m_block_min, lo);
+			m_block_max = std::max(m_block_max, hi);
+		}
+		if (++m_block_fill == s_block)
+		{
+			blocks.push_back(m_block_min);
+			blocks.push_back(m_block_max);
+			m_block_fill = 0;
+		}
+	}
+	m_length += count;
+}
+
+void TrackSummary::finish()
+{
+	if (m_block_fill > 0)
+	{
+		m_levels[0].push_back(m_block_min);
+		m_levels[0].push_back(m_block_max);
+		m_block_fill = 0;
+	}
+	for (unsigned c = 0; c < m_chn; c++)
+		m_rms[c] = m_length > 0 ? (float)sqrt(m_sum_sq[c] / (double)m_length) : 0.0f;
+
+	// up to a level of a single block
+	m_levels.resize(1);
+	while (m_levels.back().size() > 2)
+	{
+		const std::vector<float>& below = m_levels.back();
+		size_t n = below.size() / 2;
+		std::vector<float> above(((n + s_fanout - 1) / s_fanout) * 2);
+		for (size_t j = 0; j < n; j += s_fanout)
+		{
+			size_t end = std::min(n, j + s_fanout);
+			float lo = below[j * 2];
+			float hi = below[j * 2 + 1];
+			for (size_t k = j + 1; k < end; k++)
+			{
+				lo = std::min(lo, below[k * 2]);
+				hi = std::max(hi, below[k * 2 + 1]);
+			}
+			above[j / s_fanout * 2] = lo;
+			above[j / s_fanout * 2 + 1] = hi;
+		}
+		m_levels.push_back(above);
+	}
+}
+
+float TrackSummary::max_value() const
+{
+	float v = 0.0f;
+	for (unsigned c = 0; c < m_chn; c++)
+		v = std::max(v, m_peak[c]);
+	return v;
+}
+
+bool TrackSummary::range(unsigned start, unsigned count, float& min_v, float& max_v) const
+{
+	if (count < s_block || start >= m_length) return false;
+	unsigned end = std::min(m_length, start + count);
+
+	unsigned level = 0;
+	unsigned block = s_block;
+	while (level + 1 < m_levels.size() && block * s_fanout <= count)
+	{
+		level++;
+		block *= s_fanout;
+	}
+
+	const std::vector<float>& blocks = m_levels[level];
+	size_t first = start / block;
+	size_t last = (end - 1) / block;
+	min_v = blocks[first * 2];
+	max_v = blocks[first * 2 + 1];
+	for (size_t j = first + 1; j <= last; j++)
+	{
+		min_v = std::min(min_v, blocks[j * 2]);
+		max_v = std::max(max_v, blocks[j * 2 + 1]);
+	}
+	return true;
+}
+
+void TrackSummary::set(unsigned length, const float* peak, const float* rms, std::vector<std::vector<float>>& levels)
+{
+	m_length = length;
+	for (unsigned c = 0; c < m_chn; c++)
+	{
+		m_peak[c] = peak[c];
+		m_rms[c] = rms[c];
+	}
+	m_levels.swap(levels);
+	if (m_levels.empty()) m_levels.resize(1);
+}
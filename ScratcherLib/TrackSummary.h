@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+// Min/max pyramid and level statistics of a track, for drawing waveforms and
+// finding the peak without reading the samples. Level 0 keeps the min and max
+// over all channels of every s_block frames, each level above merges s_fanout
+// blocks of the one below.
+class TrackSummary
+{
+public:
+	static const unsigned s_block = 256;
+	static const unsigned s_fanout = 4;
+
+	TrackSummary(unsigned chn);
+
+	// Built from the frames in order, then finished once.
+	void add(const float* frames, unsigned count);
+	void finish();
+
+	unsigned num_channels() const { return m_chn; }
+	unsigned length() const { return m_length; }
+
+	// per channel, over the whole track
+	float peak(unsigned c) const { return m_peak[c]; }
+	float rms(unsigned c) const { return m_rms[c]; }
+	float max_value() const;
+
+	// Min and max over the blocks covering count frames from start, using the
+	// coarsest level whose blocks are no longer than count. Fails for ranges
+	// shorter than a block, which are better read from the track.
+	bool range(unsigned start, unsigned count, float& min_v, float& max_v) const;
+
+	// Levels, each a vector of min/max pairs, for storing and restoring
+	unsigned num_levels() const { return (unsigned)m_levels.size(); }
+	const std::vector<float>& level(unsigned i) const { return m_levels[i]; }
+	void set(unsigned length, const float* peak, const float* rms, std::vector<std::vector<float>>& levels);
+
+private:
+	unsigned m_chn;
+	unsigned m_length = 0;
+	float m_peak[2] = { 0.0f, 0.0f };
+	float m_rms[2] = { 0.0f, 0.0f };
+	std::vector<std::vector<float>> m_levels;
+
+	// while building
+	double m_sum_sq[2] = { 0.0, 0.0 };
+	unsigned m_block_fill = 0;
+	float m_block_min = 0.0f;
+	float m_block_max = 0.0f;
+};
@@ -1,33 +1,37 @@
 #include <cstdint>
-#include <chrono>
-#include "Sampler.h"
 #include "AudioPlayback.h"
 
-inline uint64_t time_micro_sec()
+const QList<QAudioDeviceInfo>& Player::AudioPlayback::s_devices()
 {
-	std::chrono::time_point<std::chrono::system_clock> tpSys = std::chrono::system_clock::now();
-	std::chrono::time_point<std::chrono::system_clock, std::chrono::microseconds> tpMicro
-		= std::chrono::time_point_cast<std::chrono::microseconds>(tpSys);
-	return tpMicro.time_since_epoch().count();
+	static QList<QAudioDeviceInfo> s_list = QAudioDeviceInfo::availableDevices(QAudio::Mode::AudioOutput);
+	return s_list;
 }
 
-Player::AudioPlayback::AudioPlayback(int audioDevId, Player* player) : m_player(player)
+uint32_t Player::AudioPlayback::s_device_rate(int audioDevId)
 {
-	open(QIODevice::ReadOnly| QIODevice::Unbuffered);
-
-	auto lst = QAudioDeviceInfo::availableDevices(QAudio::Mode::AudioOutput);
-	const auto& dev = lst[audioDevId];
-
-	uint32_t sample_rate = 8000;
-	auto lst_prop = dev.supportedSampleRates();
-	for (int i = 0; i < lst_prop.size(); i++)
+	static std::vector<uint32_t> s_rates;
+	if (s_rates.size() == 0)
 	{
-		if (lst_prop[i] > sample_rate)
-			sample_rate = lst_prop[i];
-	}	
+		const auto& lst = s_devices();
+		for (int j = 0; j < lst.size(); j++)
+		{
+			uint32_t sample_rate = 8000;
+			auto lst_prop = lst[j].supportedSampleRates();
+			for (int i = 0; i < lst_prop.size(); i++)
+			{
+				if (lst_prop[i] > sample_rate)
+					sample_rate = lst_prop[i];
+			}
+			s_rates.push_back(sample_rate);
+		}
+	}
+	return s_rates[audioDevId];
+}
 
-	m_i = (int)((double)m_player->m_start_pos / 1000000.0 *  (double)sample_rate);
-	player->m_sampler->set_sample_rate(sample_rate);
+Player::AudioPlayback::AudioPlayback(int audioDevId, int buffer_frames) : m_buffer_frames(buffer_frames)
+{
+	const auto& dev = s_devices()[audioDevId];
+	uint32_t sample_rate = s_device_rate(audioDevId);
 
 	m_format.setSampleRate(sample_rate);
 	m_format.setChannelCount(2);
@@ -37,62 +41,68 @@ Player::AudioPlayback::AudioPlayback(int audioDevId, Player* player) : m_player(
 	m_format.setSampleType(QAudioFormat::Float);
 
 	m_audioOutput = new QAudioOutput(dev, m_format, this);
-	m_audioOutput->start(this);
+	m_audioOutput->setBufferSize(m_buffer_frames * (int)sizeof(float) * 2);
 
 	connect(m_audioOutput, SIGNAL(stateChanged(QAudio::State)), this, SLOT(playbackStateChanged(QAudio::State)));
-
 }
 
 Player::AudioPlayback::~AudioPlayback()
 {
-	m_audioOutput->stop();
-	close();
+	stop();
 }
 
-qint64 Player::AudioPlayback::readData(char *data, qint64 len)
+unsigned Player::AudioPlayback::sample_rate() const
 {
-	float* buf = (float*)data;
-	size_t buf_size = len / sizeof(float) / 2;
+	return (unsigned)m_format.sampleRate();
+}
 
-	Sampler* sampler = m_player->m_sampler;
+bool Player::AudioPlayback::start(Source* source)
+{
+	m_source = source;
+	m_ended = false;
+	m_idle = false;
+	m_num_underruns = 0;
+	open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+	m_audioOutput->start(this);
+	return m_audioOutput->error() == QAudio::NoError;
+}
 
-	if (!m_player->m_is_playing || m_eof)
+void Player::AudioPlayback::stop()
+{
+	if (m_source != nullptr)
 	{
-		memset(buf, 0, sizeof(float)*buf_size * 2);
-		return 0;
+		m_audioOutput->stop();
+		close();
+		m_source = nullptr;
 	}
+}
 
-	size_t i = 0;
-	for (; i < buf_size; i++, m_i++)
-	{
-		float l, r;
-		bool res = sampler->get_sample(m_i, l, r);
-		if (!res)
-		{
-			m_eof = true;
-			break;
-		}
-		buf[i * 2] = l;
-		buf[i * 2 + 1] = r;
-	}
+// processedUSecs counts what has been handed to the device,
+// what is still queued in its buffer has not been heard yet
+uint64_t Player::AudioPlayback::frames_played() const
+{
+	uint64_t processed = (uint64_t)m_audioOutput->processedUSecs() * (uint64_t)m_format.sampleRate() / 1000000;
+	int queued_bytes = m_audioOutput->bufferSize() - m_audioOutput->bytesFree();
+	uint64_t queued = queued_bytes > 0 ? (uint64_t)queued_bytes / (sizeof(float) * 2) : 0;
+	return processed > queued ? processed - queued : 0;
+}
+
+qint64 Player::AudioPlayback::readData(char *data, qint64 len)
+{
+	float* buf = (float*)data;
+	int count = (int)(len / sizeof(float) / 2);
 
-	if (i < buf_size)
+	if (m_source == nullptr || m_ended)
 	{
-		float* p_out = buf + i * 2;
-		size_t bytes = sizeof(float) * (buf_size - i) * 2;
-		memset(p_out, 0, bytes);
+		memset(buf, 0, sizeof(float) * count * 2);
+		return 0;
 	}
-
-	static int s_sync_interval = 10;	
-	if (m_sync_count == 0)
+	if (!m_source->pull(buf, count))
 	{
-		uint32_t sample_rate = (uint32_t)m_format.sampleRate();
-		uint64_t start_time = time_micro_sec();
-		uint64_t start_pos = (uint64_t)((double)m_i / (double)sample_rate* 1000000.0);
-		m_player->_set_sync_point(start_time, start_pos);
+		// the device goes idle once it has played what it has
+		m_ended = true;
+		return 0;
 	}
-	m_sync_count = (m_sync_count + 1) % s_sync_interval;
-
 	return len;
 }
 
@@ -106,13 +116,14 @@ qint64 Player::AudioPlayback::writeData(const char *data, qint64 len)
 
 qint64 Player::AudioPlayback::bytesAvailable() const
 {
-	if (!m_player->m_is_playing || m_eof)
+	if (m_source == nullptr || m_ended)
 	{
 		return 0;
 	}
 	else
 	{
-		return 40000 * sizeof(short) + QIODevice::bytesAvailable();
+		// reads are always served in full, padded with silence when rendering runs short
+		return m_buffer_frames * sizeof(float) * 2 + QIODevice::bytesAvailable();
 	}
 
 }
@@ -120,8 +131,12 @@ qint64 Player::AudioPlayback::bytesAvailable() const
 void Player::AudioPlayback::playbackStateChanged(QAudio::State state)
 {
 	if (state == QAudio::State::IdleState)
-	{		
-		m_player->m_is_eof_reached = true;
+	{
+		if (!m_ended && m_audioOutput->error() == QAudio::UnderrunError)
+		{
+			m_num_underruns++;
+			return;
+		}
+		m_idle = true;
 	}
 }
-
@@ -2,28 +2,43 @@
 
 #include <QIODevice>
 #include <QtMultimedia/QAudioOutput>
+#include "AudioSink.h"
 #include "Player.h"
 
-class Player::AudioPlayback : public QIODevice
+// The sound device as an AudioSink, pulled by QAudioOutput through QIODevice::readData.
+class Player::AudioPlayback : public QIODevice, public AudioSink
 {
 	Q_OBJECT
 public:
-	AudioPlayback(int audioDevId, Player* player);
+	// buffer_frames sets the size of the device buffer
+	AudioPlayback(int audioDevId, int buffer_frames);
 	~AudioPlayback();
+
+	// output devices and the highest rate each supports, enumerated once
+	static const QList<QAudioDeviceInfo>& s_devices();
+	static uint32_t s_device_rate(int audioDevId);
+
+	virtual unsigned sample_rate() const;
+	virtual bool start(Source* source);
+	virtual void stop();
+	virtual uint64_t frames_played() const;
+	virtual bool idle() const { return m_idle; }
+	virtual unsigned num_underruns() const { return m_num_underruns; }
+
 	virtual qint64 readData(char *data, qint64 len);
 	virtual qint64 writeData(const char *data, qint64 len);
 	virtual qint64 bytesAvailable() const;
 
 private:
-	Player* m_player;
 	QAudioFormat m_format;
 	QAudioOutput* m_audioOutput;
+	int m_buffer_frames;
+	Source* m_source = nullptr;
 
-	bool m_eof = false;
-	int m_sync_count = 0;
-	int m_i = 0;
+	bool m_ended = false;
+	bool m_idle = false;
+	unsigned m_num_underruns = 0;
 
 private slots:
 	void playbackStateChanged(QAudio::State state);
 };
-
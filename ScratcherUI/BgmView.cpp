@@ -6,6 +6,7 @@
 #include <QMouseEvent>
 #include <SamplerScratch.h>
 #include <TrackBuffer.h>
+#include <TrackSummary.h>
 #include "BgmView.h"
 #include "GLUtils.h"
 
@@ -39,12 +40,23 @@ void BgmView::update_shape()
 		std::vector<float> v_min_v(width, 0.0f);
 		std::vector<float> v_max_v(width, 0.0f);
 
+		const TrackSummary* summary = buffer->Summary();
 		int i_as = 0;
 		for (int i = 0; i < width; i++)
 		{
 			float t_next = (float)(i + 1) / m_scale;
 			float min_v_i = 0.0f;
 			float max_v_i = 0.0f;
+
+			// pixels of more than a block of samples are read from the summary
+			int i_next = (int)ceilf(t_next * (float)sample_rate);
+			float min_s, max_s;
+			if (summary != nullptr && i_next > i_as && summary->range((unsigned)i_as, (unsigned)(i_next - i_as), min_s, max_s))
+			{
+				if (min_s < min_v_i) min_v_i = min_s;
+				if (max_s > max_v_i) max_v_i = max_s;
+				i_as = i_next;
+			}
 			for (; (float)i_as / (float)sample_rate < t_next; i_as++)
 			{
 				if (i_as < buffer->NumberOfSamples())
@@ -1,27 +1,20 @@
 #include <cstdint>
-#include <chrono>
+#include <algorithm>
 #include <QIODevice>
 #include <QtMultimedia/QAudioOutput>
 #include <QAudioDeviceInfo>
 #include "Player.h"
 #include "AudioPlayback.h"
+#include "PlaybackStream.h"
 #include "Sampler.h"
 
-inline uint64_t time_micro_sec()
-{
-	std::chrono::time_point<std::chrono::system_clock> tpSys = std::chrono::system_clock::now();
-	std::chrono::time_point<std::chrono::system_clock, std::chrono::microseconds> tpMicro
-		= std::chrono::time_point_cast<std::chrono::microseconds>(tpSys);
-	return tpMicro.time_since_epoch().count();
-}
-
 const std::vector<std::string>& Player::s_get_list_audio_devices(int* id_default)
 {
 	static std::vector<std::string> s_list_devices;
 	static int s_id_default;
 	if (s_list_devices.size() == 0)
 	{
-		auto lst = QAudioDeviceInfo::availableDevices(QAudio::Mode::AudioOutput);
+		const auto& lst = AudioPlayback::s_devices();
 		auto def = QAudioDeviceInfo::defaultOutputDevice();
 
 		for (int i = 0; i < lst.size(); i++)
@@ -45,8 +38,6 @@ Player::Player(Sampler* sampler, int audio_device_id)
 	: m_sampler(sampler)
 	, m_audio_device_id(audio_device_id)
 {
-	m_start_pos = 0;
-	m_start_time = (uint64_t)(-1);
 }
 
 Player::~Player()
@@ -57,75 +48,98 @@ Player::~Player()
 
 bool Player::is_playing() const
 {
-	return m_audio_playback != nullptr;
+	return m_sink != nullptr;
 }
 
 bool Player::is_eof_reached() const
 {
-	return m_audio_playback != nullptr && m_is_eof_reached;
+	return m_sink != nullptr && m_sink->idle();
 }
 
 
 uint64_t Player::get_position() const
 {
-	if (m_audio_playback == nullptr)
+	if (m_sink == nullptr)
 	{
-		return m_start_pos;
+		return m_position;
 	}
-	else if (m_is_eof_reached)
+	else if (m_sink->idle())
 	{
 		return (uint64_t)(m_sampler->get_duration()*1000000.0);
 	}
 	else
 	{
-		uint64_t start_time, start_pos;
-		_get_sync_point(start_time, start_pos);
-		if (start_time == (uint64_t)(-1)) return start_pos;
-		return start_pos + (time_micro_sec() - start_time);
+		return m_stream->position();
 	}
 }
 
 void Player::stop()
 {
-	if (m_audio_playback != nullptr)
+	if (m_sink != nullptr)
 	{
 		uint64_t pos = get_position();
-		m_is_playing = false;
-		m_audio_playback = nullptr;
-		m_start_pos = pos;
+		_close();
+		m_position = pos;
 	}
 }
 
+void Player::_open(uint64_t pos)
+{
+	// the device holds the target latency
+	uint32_t sample_rate = AudioPlayback::s_device_rate(m_audio_device_id);
+	int latency_ms = m_latency_target * m_latency_boost;
+	int buffer_frames = std::max((int)((uint64_t)latency_ms * sample_rate / 1000), 64);
+
+	AudioPlayback* playback = new AudioPlayback(m_audio_device_id, buffer_frames);
+	m_sink = (std::unique_ptr<AudioSink>)playback;
+	m_stream = (std::unique_ptr<PlaybackStream>)(new PlaybackStream(m_sampler, playback, pos, buffer_frames,
+		m_render_ahead_depth, (RenderAhead::Priority)m_render_ahead_priority, m_no_wait));
+	m_sink->start(m_stream.get());
+}
+
+void Player::_close()
+{
+	m_sink->stop();
+	m_num_underruns += m_sink->num_underruns() + m_stream->num_underruns();
+
+	// the device ran dry before the end, it gets a larger buffer from the next open
+	if (m_sink->num_underruns() > 0 && m_latency_boost < 8)
+		m_latency_boost *= 2;
+
+	m_sink = nullptr;
+	m_stream = nullptr;
+}
+
 void Player::_start(uint64_t pos)
 {
 	stop();
-	m_start_time = (uint64_t)(-1);
-	m_start_pos = pos;
-
-	m_is_playing = true;
-	m_is_eof_reached = false;
-	m_audio_playback = (std::unique_ptr<AudioPlayback>)(new AudioPlayback(m_audio_device_id, this));
+	_open(pos);
 }
 
 
 void Player::start()
 {
-	if (m_audio_playback == nullptr)
+	if (m_sink == nullptr)
 	{
-		_start(m_start_pos);
+		_start(m_position);
 	}
 }
 
 void Player::set_position(uint64_t pos)
 {
 
-	if (m_audio_playback != nullptr)
+	if (m_sink != nullptr && !m_sink->idle())
 	{
+		m_stream->seek(pos);
+	}
+	else if (m_sink != nullptr)
+	{
+		// the device has gone idle at the end, it is restarted
 		_start(pos);
 	}
 	else
 	{
-		m_start_pos = pos;
+		m_position = pos;
 	}
 
 }
@@ -135,29 +149,44 @@ void Player::set_audio_device(int audio_device_id)
 	if (audio_device_id != m_audio_device_id)
 	{
 		m_audio_device_id = audio_device_id;
-		if (m_audio_playback != nullptr)
-		{
-			m_is_playing = false;
-			m_audio_playback = nullptr;
-			m_is_playing = true;
-			m_is_eof_reached = false;
-			m_audio_playback = (std::unique_ptr<AudioPlayback>)(new AudioPlayback(m_audio_device_id, this));
-		}
+		_reopen();
 	}
 }
 
-void Player::_set_sync_point(uint64_t start_time, uint64_t start_pos)
+void Player::_reopen()
 {
-	m_mutex_sync.lock();
-	m_start_time = start_time;
-	m_start_pos = start_pos;
-	m_mutex_sync.unlock();
+	if (m_sink != nullptr)
+	{
+		uint64_t pos = get_position();
+		_close();
+		_open(pos);
+	}
+}
+
+void Player::set_render_ahead(int depth, int priority)
+{
+	m_render_ahead_depth = depth;
+	m_render_ahead_priority = priority;
 }
 
-void Player::_get_sync_point(uint64_t& start_time, uint64_t& start_pos) const
+unsigned Player::num_underruns() const
 {
-	m_mutex_sync.lock();
-	start_time = m_start_time;
-	start_pos = m_start_pos;
-	m_mutex_sync.unlock();
-}
\ No newline at end of file
+	if (m_stream == nullptr) return m_num_underruns;
+	return m_num_underruns + m_sink->num_underruns() + m_stream->num_underruns();
+}
+
+void Player::set_latency_target(int ms)
+{
+	if (ms != m_latency_target)
+	{
+		m_latency_target = ms;
+		m_latency_boost = 1;
+		_reopen();
+	}
+}
+
+double Player::get_latency() const
+{
+	if (m_stream == nullptr) return 0.0;
+	return (double)m_stream->latency() / 1000.0;
+}
@@ -1,8 +1,10 @@
 #pragma once
 
-#include <QMutex>
+#include <cstdint>
 
 class Sampler;
+class AudioSink;
+class PlaybackStream;
 #include <memory>
 #include <string>
 #include <vector>
@@ -24,23 +26,50 @@ public:
 	void set_position(uint64_t pos);
 	void set_audio_device(int audio_device_id);
 
+	// Frames rendered ahead of the audio callback and priority of the render thread
+	// (a RenderAhead::Priority), applied from the next start.
+	void set_render_ahead(int depth, int priority);
+
+	// Underruns of the render thread and of the device since the player was created,
+	// counted on across stops and reopens.
+	unsigned num_underruns() const;
+
+	// The pages of the sampler are loaded ahead by a SourcePrefetcher, so the render
+	// thread does not wait for them, see RenderAhead::set_no_wait. Applied from the next start.
+	void set_no_wait(bool no_wait) { m_no_wait = no_wait; }
+
+	// Target output latency in milliseconds. The device buffer and the render
+	// chunks are sized from it, the device is reopened if playing.
+	// Underruns of the device make the next open use a larger buffer.
+	void set_latency_target(int ms);
+	int latency_target() const { return m_latency_target; }
+
+	// Measured latency in milliseconds from rendering a frame to hearing it, 0 when stopped.
+	double get_latency() const;
+
 
 private:
 	class AudioPlayback;
 
 	Sampler* m_sampler;
-	std::unique_ptr<AudioPlayback> m_audio_playback;
-	bool m_is_playing = false;
-	bool m_is_eof_reached = true;
-
-	uint64_t m_start_time;
-	uint64_t m_start_pos;
-	mutable QMutex m_mutex_sync;
-	void _set_sync_point(uint64_t start_time, uint64_t start_pos);
-	void _get_sync_point(uint64_t& start_time, uint64_t& start_pos) const;
+	std::unique_ptr<AudioSink> m_sink;
+	std::unique_ptr<PlaybackStream> m_stream;
+	uint64_t m_position = 0;
 
 	int m_audio_device_id;
+	int m_render_ahead_depth = 16384;
+	int m_render_ahead_priority = 1;
+	bool m_no_wait = false;
+
+	// underruns of the devices closed so far
+	unsigned m_num_underruns = 0;
+
+	int m_latency_target = 20;
+	int m_latency_boost = 1;
 
+	void _open(uint64_t pos);
+	void _close();
 	void _start(uint64_t pos);
+	void _reopen();
 
 };
@@ -1,6 +1,8 @@
 #define USE_JSON 1
 
 #include <QFileDialog>
+#include <QStandardPaths>
+#include <QDir>
 #include <QScrollBar>
 #include <QFileInfo>
 #include <QMessageBox>
@@ -15,8 +17,12 @@
 
 #include <TrackBuffer.h>
 #include <SamplerScratch.h>
+#include <SamplerCached.h>
+#include <SourcePrefetcher.h>
+#include <LiveJog.h>
 #include <AudioReadWrite.h>
-#include <SampleToTrackBuffer.h>
+#include <AudioCache.h>
+#include <AudioExport.h>
 
 #include <stdio.h>
 #include <string>
@@ -25,6 +31,10 @@
 #include "Scratcher.h"
 #include "Player.h"
 
+static const int s_latency_targets[] = { 5, 10, 20, 50 };
+static const int s_num_latency_targets = sizeof(s_latency_targets) / sizeof(int);
+static const int s_default_latency_target = 2;
+
 void serialize_string(FILE* fp, const QString& str)
 {
 	std::string sstr = str.toLocal8Bit().constData();
@@ -52,8 +62,14 @@ Scratcher::Scratcher()
 	connect(m_ui.btn_audio_reset, SIGNAL(clicked()), this, SLOT(Btn_reset_Click()));
 	
 	InitAudioDevice();
+	for (int i = 0; i < s_num_latency_targets; i++)
+	{
+		m_ui.combo_latency->addItem(QString("%1 ms").arg(s_latency_targets[i]));
+	}
+	m_ui.combo_latency->setCurrentIndex(s_default_latency_target);
 
 	connect(m_ui.combo_audio_device, SIGNAL(currentIndexChanged(int)), this, SLOT(AudioDeviceChange(int)));
+	connect(m_ui.combo_latency, SIGNAL(currentIndexChanged(int)), this, SLOT(LatencyChange(int)));
 	connect(m_ui.scroll_timemap->horizontalScrollBar(), SIGNAL(rangeChanged(int, int)), this, SLOT(TimeMapHScrollRange(int,int)));
 	connect(m_ui.scroll_timemap->verticalScrollBar(), SIGNAL(rangeChanged(int, int)), this, SLOT(TimeMapVScrollRange(int, int)));
 	connect(m_ui.scroll_timemap->horizontalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(TimeMapHScroll(int)));
@@ -83,6 +99,9 @@ Scratcher::Scratcher()
 	connect(m_ui.canvas_timemap, SIGNAL(cursor_moved(double)), this, SLOT(Cursor_Moved(double)));
 	connect(m_ui.canvas_volume, SIGNAL(cursor_moved(double)), this, SLOT(Cursor_Moved(double)));
 	connect(m_ui.canvas_bgm, SIGNAL(cursor_moved(double)), this, SLOT(Cursor_Moved(double)));
+	connect(m_ui.canvas_timemap, SIGNAL(jog_engaged(double)), this, SLOT(Jog_Engaged(double)));
+	connect(m_ui.canvas_timemap, SIGNAL(jog_moved(double)), this, SLOT(Jog_Moved(double)));
+	connect(m_ui.canvas_timemap, SIGNAL(jog_released()), this, SLOT(Jog_Released()));
 
 	connect(m_ui.slider_bgm_volume, SIGNAL(sliderMoved(int)), this, SLOT(Slider_bgm_volume_Moved(int)));
 
@@ -94,6 +113,14 @@ Scratcher::Scratcher()
 
 	set_bgm_visible(false);
 
+	// decoded sources and BGMs are kept, so reopening a project does not decode them again
+	QString cache_dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+	if (cache_dir != "")
+	{
+		std::string dir = QDir(cache_dir).filePath("decoded").toLocal8Bit().constData();
+		AudioCache::s_set_directory(dir.c_str());
+	}
+
 	m_timer = new QTimer(this);
 	connect(m_timer, SIGNAL(timeout()), this, SLOT(refresh()));
 	m_timer->start(20);
@@ -237,14 +264,23 @@ void Scratcher::do_open_project(QString fullpath)
 		{
 			QJsonArray control_pnts = timemap["control_points"].toArray();
 			int num_ctrl_pnts = control_pnts.size();
+			std::vector<float> x(num_ctrl_pnts), y(num_ctrl_pnts), slope(num_ctrl_pnts);
 			for (int i = 0; i < num_ctrl_pnts; i++)
 			{
 				QJsonObject ctrl_pnt = control_pnts[i].toObject();
-				float x = (float)ctrl_pnt["x"].toDouble();
-				float y = (float)ctrl_pnt["y"].toDouble();
-				float slope = (float)ctrl_pnt["slope"].toDouble();
-				m_sampler->add_control_point(x, y);
-				m_sampler->set_control_point_slope(i, slope);
+				x[i] = (float)ctrl_pnt["x"].toDouble();
+				y[i] = (float)ctrl_pnt["y"].toDouble();
+				slope[i] = (float)ctrl_pnt["slope"].toDouble();
+			}
+			m_sampler->set_control_points(num_ctrl_pnts, x.data(), y.data(), slope.data());
+		}
+		{
+			QJsonArray segments = timemap["segments"].toArray();
+			for (int i = 0; i < segments.size(); i++)
+			{
+				QJsonObject segment = segments[i].toObject();
+				m_sampler->set_segment((size_t)segment["index"].toInt(), segment["kind"].toInt(),
+					(float)segment["rate"].toDouble(), (float)segment["depth"].toDouble());
 			}
 		}
 	}
@@ -254,12 +290,22 @@ void Scratcher::do_open_project(QString fullpath)
 		{
 			QJsonArray control_pnts = volume["control_points"].toArray();
 			int num_ctrl_pnts = control_pnts.size();
+			std::vector<float> x(num_ctrl_pnts), y(num_ctrl_pnts);
 			for (int i = 0; i < num_ctrl_pnts; i++)
 			{
 				QJsonObject ctrl_pnt = control_pnts[i].toObject();
-				float x = (float)ctrl_pnt["x"].toDouble();
-				float y = (float)ctrl_pnt["y"].toDouble();
-				m_sampler->add_volume_control_point(x, y);
+				x[i] = (float)ctrl_pnt["x"].toDouble();
+				y[i] = (float)ctrl_pnt["y"].toDouble();
+			}
+			m_sampler->set_volume_control_points(num_ctrl_pnts, x.data(), y.data());
+		}
+		{
+			QJsonArray segments = volume["segments"].toArray();
+			for (int i = 0; i < segments.size(); i++)
+			{
+				QJsonObject segment = segments[i].toObject();
+				m_sampler->set_volume_segment((size_t)segment["index"].toInt(), segment["kind"].toInt(),
+					(float)segment["rate"].toDouble(), (float)segment["duty"].toDouble());
 			}
 		}
 	}
@@ -333,6 +379,26 @@ void Scratcher::do_save_project(QString fullpath)
 			}
 			timemap["control_points"] = control_pnts;
 		}
+		{
+			// parametric segments, by index of the point they start from
+			QJsonArray segments;
+			size_t num_segments = m_sampler->num_control_points() + 1;
+			for (size_t i = 0; i < num_segments; i++)
+			{
+				int kind;
+				float rate, depth;
+				m_sampler->segment(i, kind, rate, depth);
+				if (kind == 0) continue;
+				QJsonObject segment;
+				segment["index"] = (int)i;
+				segment["kind"] = kind;
+				segment["rate"] = rate;
+				segment["depth"] = depth;
+				segments.append(segment);
+			}
+			if (segments.size() > 0)
+				timemap["segments"] = segments;
+		}
 		root["timemap"] = timemap;
 	}
 	{
@@ -352,6 +418,25 @@ void Scratcher::do_save_project(QString fullpath)
 			}
 			volume["control_points"] = control_pnts;
 		}
+		{
+			QJsonArray segments;
+			size_t num_segments = m_sampler->num_volume_control_points() + 1;
+			for (size_t i = 0; i < num_segments; i++)
+			{
+				int kind;
+				float rate, duty;
+				m_sampler->volume_segment(i, kind, rate, duty);
+				if (kind == 0) continue;
+				QJsonObject segment;
+				segment["index"] = (int)i;
+				segment["kind"] = kind;
+				segment["rate"] = rate;
+				segment["duty"] = duty;
+				segments.append(segment);
+			}
+			if (segments.size() > 0)
+				volume["segments"] = segments;
+		}
 		root["volume"] = volume;
 	}
 	QFile saveFile(fullpath);
@@ -397,13 +482,18 @@ bool Scratcher::save_project()
 
 void Scratcher::Unload()
 {
-	m_bgm_buffer = nullptr;
 	m_ui.canvas_bgm->set_sampler(nullptr);
 	m_ui.canvas_src_view->set_sampler(nullptr);
 	m_ui.canvas_volume->set_sampler(nullptr);
 	m_ui.canvas_timemap->set_sampler(nullptr);	
 	m_player = nullptr;
+	m_jog = nullptr;
+	m_sampler_cached = nullptr;
+	m_prefetcher = nullptr;
+	// stops the premix thread, which reads the BGM until then
 	m_sampler = nullptr;
+	m_bgm_loader = nullptr;
+	m_bgm_buffer = nullptr;
 	m_src_buffer = nullptr;
 	m_filename_source = "";
 	m_filename_bgm = "";
@@ -414,10 +504,20 @@ void Scratcher::LoadSource(const QString& filename)
 {
 	Unload();	
 	std::string fn = filename.toLocal8Bit().constData();
-	m_src_buffer = (std::unique_ptr<TrackBuffer>)(ReadAudioFromFile(fn.c_str()));
+	m_src_buffer = (std::unique_ptr<TrackBuffer>)(OpenAudioFile(fn.c_str()));
 	m_sampler = (std::unique_ptr<SamplerScratch>)(new SamplerScratch(m_src_buffer.get()));	
+	m_sampler->set_control_rate_baking(0.05f);
+	m_prefetcher = (std::unique_ptr<SourcePrefetcher>)(new SourcePrefetcher(m_sampler.get()));
+	m_sampler_cached = (std::unique_ptr<SamplerCached>)(new SamplerCached(m_sampler.get()));
+	m_sampler_cached->set_prefetcher(m_prefetcher.get());
 
-	m_player = (std::unique_ptr<Player>)(new Player(m_sampler.get(), m_ui.combo_audio_device->currentIndex()));
+	// playback goes through the jog, which plays the time map until the record is grabbed
+	m_jog = (std::unique_ptr<LiveJog>)(new LiveJog(m_sampler_cached.get(), m_sampler.get()));
+	m_jog->set_prediction((double)s_latency_targets[m_ui.combo_latency->currentIndex()] / 1000.0);
+
+	m_player = (std::unique_ptr<Player>)(new Player(m_jog.get(), m_ui.combo_audio_device->currentIndex()));
+	m_player->set_latency_target(s_latency_targets[m_ui.combo_latency->currentIndex()]);
+	m_player->set_no_wait(true);
 
 	m_ui.btn_audio_play->setIcon(QIcon(":/icons/play.png"));
 	m_is_playing = false;	
@@ -437,7 +537,15 @@ void Scratcher::LoadBgm(const QString& filename)
 {
 	if (m_sampler == nullptr) return;
 	std::string fn = filename.toLocal8Bit().constData();
-	m_bgm_buffer = (std::unique_ptr<TrackBuffer>)(ReadAudioFromFile(fn.c_str()));
+	m_bgm_loader = nullptr;
+	m_sampler->set_bgm(nullptr);
+	m_bgm_buffer = nullptr;
+
+	// decoded in the background, the sampler mixes in the part loaded so far as it grows
+	m_bgm_loader = (std::unique_ptr<AudioLoader>)(AudioLoader::s_start(fn.c_str()));
+	if (m_bgm_loader == nullptr) return;
+	m_bgm_buffer = (std::unique_ptr<TrackBuffer>)(m_bgm_loader->track());
+	m_bgm_redraw_time = 0.0;
 	m_sampler->set_bgm(m_bgm_buffer.get());
 	set_bgm_visible(true);
 	m_ui.canvas_bgm->set_sampler(m_sampler.get());
@@ -448,9 +556,22 @@ void Scratcher::LoadBgm(const QString& filename)
 void Scratcher::SaveResult(const QString& filename)
 {	
 	std::string fn = filename.toLocal8Bit().constData();
-	TrackBuffer buf_out;
-	SampleToTrackBuffer(*m_sampler, buf_out);
-	WriteAudioToFile(&buf_out, fn.c_str());
+	if (m_bgm_loader != nullptr)
+	{
+		// the result gets the whole BGM
+		m_bgm_buffer->WaitForSamples((unsigned)(-1));
+		m_sampler->wait_bgm_premix();
+	}
+	// rendered straight into the writer of the format, without keeping the result.
+	// WAV keeps the float samples, FLAC as many bits as it takes, MP3 is encoded on all cores.
+	ExportOptions options;
+	options.format = ExportFormatFromName(fn.c_str());
+	options.bits = options.format == Export_FLAC ? 24 : 32;
+	options.threads = 0;
+	AudioWriter* writer = CreateAudioWriter(fn.c_str(), 44100, options);
+	if (writer == nullptr) return;
+	ExportAudio(*m_sampler_cached, 44100, writer);
+	delete writer;
 }
 
 void Scratcher::_set_cursor_pos(double pos)
@@ -497,6 +618,7 @@ void Scratcher::Stop()
 	if (m_player != nullptr)
 	{
 		m_is_playing = false;
+		m_jog->push(LiveJog::Event_Release, 0.0);
 		m_player->stop();
 		m_player->set_position(0);
 
@@ -592,6 +714,7 @@ void Scratcher::refresh()
 			{
 				_emit_cursor_pos(pos);
 			}
+			m_ui.lbl_latency_measured->setText(QString("(%1 ms)").arg(m_player->get_latency(), 0, 'f', 1));
 		}
 		else
 		{			
@@ -599,7 +722,32 @@ void Scratcher::refresh()
 		}
 
 	}
-	
+	else
+	{
+		m_ui.lbl_latency_measured->setText("");
+	}
+
+	if (m_bgm_loader != nullptr)
+	{
+		// the view of the BGM is drawn again every couple of seconds while it grows
+		static const double s_redraw_interval = 2.0;
+		m_bgm_redraw_time += (double)m_timer->interval() / 1000.0;
+		bool finished = m_bgm_loader->finished();
+		if (finished || m_bgm_redraw_time >= s_redraw_interval)
+		{
+			m_ui.canvas_bgm->update_sampler();
+			m_bgm_redraw_time = 0.0;
+		}
+		if (finished)
+		{
+			statusBar()->clearMessage();
+			m_bgm_loader = nullptr;
+		}
+		else
+		{
+			statusBar()->showMessage(QString("Loading BGM %1%").arg((int)(m_bgm_loader->progress() * 100.0)));
+		}
+	}
 }
 
 void Scratcher::AudioDeviceChange(int idx)
@@ -610,6 +758,15 @@ void Scratcher::AudioDeviceChange(int idx)
 	}
 }
 
+void Scratcher::LatencyChange(int idx)
+{
+	if (m_player != nullptr)
+	{
+		m_jog->set_prediction((double)s_latency_targets[idx] / 1000.0);
+		m_player->set_latency_target(s_latency_targets[idx]);
+	}
+}
+
 
 void Scratcher::Btn_load_src_Click()
 {
@@ -636,7 +793,7 @@ void Scratcher::Btn_save_res_Click()
 {
 	if (m_sampler == nullptr) return;
 	Stop();
-	QString filename = QFileDialog::getSaveFileName(this, "Save Result Audio", QString(), "Audio Files (*.mp3) ");
+	QString filename = QFileDialog::getSaveFileName(this, "Save Result Audio", QString(), "MP3 Files (*.mp3);;FLAC Files (*.flac);;WAV Files (*.wav)");
 	if (filename != "")
 		SaveResult(filename);
 }
@@ -796,6 +953,21 @@ void Scratcher::Baseline_changed()
 	}
 }
 
+void Scratcher::Jog_Engaged(double pos)
+{
+	if (m_is_playing) m_jog->push(LiveJog::Event_Engage, pos);
+}
+
+void Scratcher::Jog_Moved(double pos)
+{
+	if (m_is_playing) m_jog->push(LiveJog::Event_Position, pos);
+}
+
+void Scratcher::Jog_Released()
+{
+	if (m_jog != nullptr) m_jog->push(LiveJog::Event_Release, 0.0);
+}
+
 void Scratcher::Cursor_Moved(double pos)
 {
 	if (!m_is_playing)
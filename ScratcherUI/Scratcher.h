@@ -7,7 +7,11 @@
 
 class TrackBuffer;
 class SamplerScratch;
+class SamplerCached;
+class SourcePrefetcher;
+class LiveJog;
 class Player;
+class AudioLoader;
 class Scratcher : public QMainWindow
 {
 	Q_OBJECT
@@ -40,6 +44,7 @@ private:
 private slots:
 	void refresh();
 	void AudioDeviceChange(int idx);
+	void LatencyChange(int idx);
 	void Btn_load_src_Click();
 	void Btn_load_bgm_Click();
 	void Btn_save_res_Click();
@@ -66,6 +71,10 @@ private slots:
 
 	void Cursor_Moved(double pos);
 
+	void Jog_Engaged(double pos);
+	void Jog_Moved(double pos);
+	void Jog_Released();
+
 	void Slider_bgm_volume_Moved(int v);
 
 private:	
@@ -92,7 +101,12 @@ private:
 	QString m_filename_bgm = "";
 	std::unique_ptr<TrackBuffer> m_src_buffer;
 	std::unique_ptr<TrackBuffer> m_bgm_buffer;
+	std::unique_ptr<AudioLoader> m_bgm_loader;
+	double m_bgm_redraw_time = 0.0;
 	std::unique_ptr<SamplerScratch> m_sampler;
+	std::unique_ptr<SourcePrefetcher> m_prefetcher;
+	std::unique_ptr<SamplerCached> m_sampler_cached;
+	std::unique_ptr<LiveJog> m_jog;
 	std::unique_ptr<Player> m_player;
 	bool m_is_playing = false;
 	double m_cursor_pos = 0.0;
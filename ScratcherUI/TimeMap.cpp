@@ -371,11 +371,29 @@ void TimeMap::mouseDoubleClickEvent(QMouseEvent *event)
 
 void TimeMap::mousePressEvent(QMouseEvent *event)
 {
-	if (m_sampler == nullptr || m_is_locked) return;
+	if (m_sampler == nullptr) return;
 
 	float x = (float)event->x();
 	float y = (float)event->y();
 
+	if (m_is_locked)
+	{
+		// while playing, dragging grabs the record at the source position under the mouse
+		m_jogging = true;
+		emit jog_engaged(((float)this->height() - y) / m_scale_in - m_offset_in);
+		return;
+	}
+
+	if (event->modifiers() & Qt::ShiftModifier)
+	{
+		// tolerance of about one pixel
+		m_recorder.set_tolerance(1.0f / m_scale_in);
+		m_recorder.begin();
+		m_recorder.add_sample(x / m_scale_out, ((float)this->height() - y) / m_scale_in - m_offset_in);
+		m_recording = true;
+		return;
+	}
+
 	{
 		float pos_x, pos_y, slope;
 		if (m_selected_id == -1)
@@ -440,7 +458,25 @@ void TimeMap::mousePressEvent(QMouseEvent *event)
 
 void TimeMap::mouseReleaseEvent(QMouseEvent *event)
 {
+	if (m_jogging)
+	{
+		m_jogging = false;
+		emit jog_released();
+		return;
+	}
 	if (m_sampler == nullptr || m_is_locked) return;
+	if (m_recording)
+	{
+		m_recording = false;
+		m_recorder.end();
+		if (m_recorder.apply(m_sampler))
+		{
+			m_selected_id = -1;
+			update_curve();
+			update();
+			emit sampler_updated();
+		}
+	}
 	if (m_dragging_ctrl)
 	{	
 		m_dragging_ctrl = false;
@@ -457,11 +493,24 @@ void TimeMap::mouseReleaseEvent(QMouseEvent *event)
 
 void TimeMap::mouseMoveEvent(QMouseEvent *event)
 {
+	if (m_jogging)
+	{
+		emit jog_moved(((float)this->height() - (float)event->y()) / m_scale_in - m_offset_in);
+		return;
+	}
 	if (m_sampler == nullptr || m_is_locked) return;
 	float x = (float)event->x();
 	float y = (float)event->y();
 
-	if (m_dragging_slope)
+	if (m_recording)
+	{
+		float pos_x = x / m_scale_out;
+		float pos_y = ((float)this->height() - y) / m_scale_in - m_offset_in;
+		m_recorder.add_sample(pos_x, pos_y);
+		m_cursor_pos = pos_x;
+		emit cursor_moved(m_cursor_pos);
+	}
+	else if (m_dragging_slope)
 	{
 		float pos_x, pos_y;
 		if (m_selected_id == -1)
@@ -3,6 +3,7 @@
 #include <vector>
 #include <QOpenGLWidget>
 #include <QOpenGLExtraFunctions>
+#include <GestureRecorder.h>
 
 class SamplerScratch;
 struct GLBuffer;
@@ -76,6 +77,11 @@ signals:
 	void cursor_moved(double pos);
 	void sampler_updated();
 
+	// dragging while locked for playback, positions in source seconds
+	void jog_engaged(double pos);
+	void jog_moved(double pos);
+	void jog_released();
+
 protected:
 	virtual void initializeGL() override;
 	virtual void paintGL() override;
@@ -112,5 +118,11 @@ private:
 	bool m_moving_cursor = false;
 	bool m_dragging_ctrl = false;
 	bool m_dragging_slope = false;
+
+	// shift + drag draws the time map freehand
+	GestureRecorder m_recorder;
+	bool m_recording = false;
+
+	bool m_jogging = false;
 	
 };
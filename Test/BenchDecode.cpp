@@ -0,0 +1,240 @@
+#include "TrackBuffer.h"
+#include "AudioReadWrite.h"
+#include "AudioCache.h"
+#include "TrackSummary.h"
+
+#include <cstdio>
+#include <cmath>
+#include <memory.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+inline double time_sec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Whether both tracks are there, of the same length and with the same samples
+static bool s_same_track(TrackBuffer* a, TrackBuffer* b)
+{
+	if (a == nullptr || b == nullptr || a->NumberOfSamples() != b->NumberOfSamples()) return false;
+	unsigned length = a->NumberOfSamples();
+	std::vector<float> data_a(65536 * 2), data_b(65536 * 2);
+	for (unsigned pos = 0; pos < length; pos += 65536)
+	{
+		unsigned count = std::min(65536u, length - pos);
+		a->GetSamples(pos, count, data_a.data());
+		b->GetSamples(pos, count, data_b.data());
+		if (memcmp(data_a.data(), data_b.data(), sizeof(float) * count * 2) != 0) return false;
+	}
+	return true;
+}
+
+// What loading costs besides the decoder: storing MP3-sized frames of a long file,
+// through WriteBlend as ReadAudioFromFile used to, and through Append.
+void bench_decode_append()
+{
+	static const unsigned rate = 44100;
+	static const unsigned frame_size = 1152;
+	static const double duration = 600.0;
+	unsigned num_frames = (unsigned)(duration * rate) / frame_size;
+
+	// a frame worth of decoder output, varied per frame
+	std::vector<float> frame(frame_size * 2);
+	auto fill = [&](unsigned j)
+	{
+		for (unsigned i = 0; i < frame_size; i++)
+		{
+			float t = (float)(j * frame_size + i);
+			frame[i * 2] = 0.5f * sinf(t * 0.031f);
+			frame[i * 2 + 1] = 0.5f * sinf(t * 0.017f);
+		}
+	};
+
+	printf("\nstoring %.0f s of decoded frames (%u frames of %u)\n", duration, num_frames, frame_size);
+
+	double t0 = time_sec();
+	TrackBuffer blend(rate, 2);
+	{
+		NoteBuffer buf;
+		buf.m_sampleRate = (float)rate;
+		buf.m_channelNum = 2;
+		for (unsigned j = 0; j < num_frames; j++)
+		{
+			fill(j);
+			if (buf.m_data == nullptr || buf.m_sampleNum != frame_size)
+			{
+				buf.m_sampleNum = frame_size;
+				buf.m_cursorDelta = (float)frame_size;
+				buf.Allocate();
+			}
+			memcpy(buf.m_data, frame.data(), sizeof(float) * frame_size * 2);
+			blend.WriteBlend(buf);
+		}
+	}
+	double t1 = time_sec();
+
+	TrackBuffer append(rate, 2);
+	for (unsigned j = 0; j < num_frames; j++)
+	{
+		fill(j);
+		append.Append(frame.data(), frame_size);
+	}
+	double t2 = time_sec();
+
+	// the time spent making the frames is in both
+	double t_fill = time_sec();
+	for (unsigned j = 0; j < num_frames; j++)
+		fill(j);
+	t_fill = time_sec() - t_fill;
+
+	bool same = blend.GetCursor() == append.GetCursor() && s_same_track(&blend, &append);
+
+	printf("WriteBlend %.3f s, Append %.3f s, %s\n", t1 - t0 - t_fill, t2 - t1 - t_fill, same ? "same track" : "DIFFERENT tracks");
+}
+
+// Loads a file serially and in parallel segments, which must give the same track.
+void bench_parallel_decode(const char* fileName)
+{
+	double t0 = time_sec();
+	TrackBuffer* serial = ReadAudioFromFile(fileName);
+	if (serial == nullptr) return;
+	double t1 = time_sec();
+	TrackBuffer* parallel = ReadAudioFromFileParallel(fileName);
+	double t2 = time_sec();
+
+	bool same = s_same_track(serial, parallel);
+
+	printf("\ndecoding %s (%.1f s of audio)\n", fileName, (double)serial->NumberOfSamples() / (double)serial->Rate());
+	printf("serial %.3f s, parallel %.3f s, %s\n", t1 - t0, t2 - t1, same ? "same track" : "DIFFERENT tracks");
+
+	delete parallel;
+	delete serial;
+}
+
+// Opens a file for on-demand decoding, reads a few seconds in the middle, then all
+// of it, which must give the same track as a full load. Then opens it again and reads
+// ranges all over it, each page first read by a seek, against the full load too.
+void bench_lazy_decode(const char* fileName)
+{
+	double t0 = time_sec();
+	TrackBuffer* lazy = OpenAudioFile(fileName);
+	if (lazy == nullptr) return;
+	double t1 = time_sec();
+
+	unsigned length = lazy->NumberOfSamples();
+	unsigned count = std::min(length, lazy->Rate() * 5);
+	std::vector<float> middle(count * 2);
+	lazy->GetSamples((length - count) / 2, count, middle.data());
+	double t2 = time_sec();
+
+	TrackBuffer* full = ReadAudioFromFile(fileName);
+	bool same = s_same_track(full, lazy);
+
+	printf("on demand: open %.3f s, 5 s from the middle %.3f s, %s a full load\n", t1 - t0, t2 - t1, same ? "same as" : "DIFFERENT from");
+	delete lazy;
+	if (full == nullptr) return;
+
+	static const int num_reads = 200;
+	TrackBuffer* shuffled = OpenAudioFile(fileName);
+	uint32_t seed = 12345;
+	int num_different = 0;
+	std::vector<float> a(65536 * 2), c(65536 * 2);
+	for (int k = 0; k < num_reads; k++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		unsigned pos = (unsigned)((double)(seed >> 8) / 16777216.0 * (double)length);
+		seed = seed * 1664525u + 1013904223u;
+		unsigned count = std::min(1 + (seed >> 8) % 65536, length - pos);
+		full->GetSamples(pos, count, a.data());
+		shuffled->GetSamples(pos, count, c.data());
+		if (memcmp(a.data(), c.data(), sizeof(float) * count * 2) != 0) num_different++;
+	}
+	if (num_different == 0)
+		printf("on demand, %d reads in random order: same as a full load\n", num_reads);
+	else
+		printf("on demand, %d reads in random order: %d DIFFERENT from a full load\n", num_reads, num_different);
+
+	delete shuffled;
+	delete full;
+}
+
+// Loads a file in the background, plays the first seconds as soon as they are there,
+// then waits for the end, which must give the same track as a serial load.
+void bench_async_decode(const char* fileName)
+{
+	double t0 = time_sec();
+	AudioLoader* loader = AudioLoader::s_start(fileName);
+	if (loader == nullptr) return;
+	TrackBuffer* track = loader->track();
+	double t1 = time_sec();
+
+	unsigned first = track->WaitForSamples(track->Rate() * 5);
+	double t2 = time_sec();
+	track->WaitForSamples((unsigned)(-1));
+	double t3 = time_sec();
+	bool complete = loader->complete();
+	delete loader;
+
+	TrackBuffer* full = ReadAudioFromFile(fileName);
+	bool same = complete && s_same_track(full, track);
+
+	printf("background: start %.3f s, first %.1f s of audio %.3f s, all %.3f s, %s a full load\n",
+		t1 - t0, (double)first / (double)track->Rate(), t2 - t0, t3 - t0, same ? "same as" : "DIFFERENT from");
+
+	delete full;
+	delete track;
+}
+
+// Loads a file through the decoded-audio cache twice: decoding and storing it, then
+// mapping it, which must give the same track. The cache starts empty and is removed
+// at the end, so that every run decodes.
+void bench_audio_cache(const char* fileName)
+{
+	std::error_code ec;
+	fs::remove_all("decoded_cache", ec);
+	AudioCache::s_set_directory("decoded_cache");
+
+	double t0 = time_sec();
+	TrackBuffer* decoded = ReadAudioFromFileParallel(fileName);
+	if (decoded == nullptr)
+	{
+		AudioCache::s_set_directory("");
+		fs::remove_all("decoded_cache", ec);
+		return;
+	}
+	double t1 = time_sec();
+	TrackBuffer* cached = ReadAudioFromFileParallel(fileName);
+	double t2 = time_sec();
+
+	bool same = s_same_track(decoded, cached) && cached->Summary() != nullptr;
+
+	printf("cached: decode and store %.3f s, reopen %.3f s, %s the decoded track", t1 - t0, t2 - t1, same ? "same as" : "DIFFERENT from");
+	if (same)
+	{
+		const TrackSummary* summary = cached->Summary();
+		printf(", peak %.3f, rms %.3f %.3f", summary->max_value(), summary->rms(0), summary->rms(1));
+	}
+	printf("\n");
+	delete cached;
+
+	// a miss of OpenAudioFile opens on demand and leaves storing to a full decode
+	fs::remove_all("decoded_cache", ec);
+	double t3 = time_sec();
+	TrackBuffer* lazy = OpenAudioFile(fileName);
+	double t4 = time_sec();
+	std::vector<float> first(65536 * 2);
+	if (lazy != nullptr) lazy->GetSamples(0, 65536, first.data());
+	TrackBuffer* stored = AudioCache::s_open(fileName);
+	printf("cache miss on demand: open %.3f s, %s\n", t4 - t3, stored == nullptr ? "nothing stored" : "STORED");
+
+	delete stored;
+	delete lazy;
+	delete decoded;
+	AudioCache::s_set_directory("");
+	fs::remove_all("decoded_cache", ec);
+}
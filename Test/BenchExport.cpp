@@ -0,0 +1,371 @@
+#include "TrackBuffer.h"
+#include "SamplerScratch.h"
+#include "SampleToTrackBuffer.h"
+#include "AudioReadWrite.h"
+#include "AudioExport.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+
+TrackBuffer* make_test_track(unsigned rate, unsigned chn, float duration);
+
+inline double time_sec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The scratch the exports run on: 200 s of the test track, moved back and forth every 3 s.
+class ExportScratch
+{
+public:
+	ExportScratch()
+	{
+		m_src = make_test_track(44100, 2, 200.0f);
+		m_sampler = new SamplerScratch(m_src);
+		for (int j = 1; j <= 60; j++)
+			m_sampler->add_control_point(3.0f * (float)j, 3.0f * (float)j + ((j & 1) != 0 ? 0.5f : -0.5f));
+	}
+	~ExportScratch()
+	{
+		delete m_sampler;
+		delete m_src;
+	}
+
+	TrackBuffer* m_src;
+	SamplerScratch* m_sampler;
+};
+
+// Reads back the samples of a stereo WAV or raw file written by PcmFileWriter, as the
+// bytes stored. Fails when the file can't be read or its WAV header doesn't match.
+static bool s_read_pcm(const char* fileName, bool wav, std::vector<uint8_t>& data)
+{
+	FILE* fp = fopen(fileName, "rb");
+	if (fp == nullptr) return false;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data.resize(size > 0 ? (size_t)size : 0);
+	bool ok = fread(data.data(), 1, data.size(), fp) == data.size();
+	fclose(fp);
+	if (!ok) return false;
+	if (wav)
+	{
+		uint32_t data_size = 0;
+		if (data.size() < 44 || memcmp(data.data(), "RIFF", 4) != 0) return false;
+		memcpy(&data_size, data.data() + 40, 4);
+		data.erase(data.begin(), data.begin() + 44);
+		if (data_size != data.size()) return false;
+	}
+	return true;
+}
+
+// Keeps the frames of an export in memory.
+class CaptureWriter : public AudioWriter
+{
+public:
+	virtual bool write(const float* frames, unsigned count)
+	{
+		m_frames.insert(m_frames.end(), frames, frames + (size_t)count * 2);
+		return true;
+	}
+	virtual bool close() { return true; }
+
+	std::vector<float> m_frames;
+};
+
+// Compares the samples read back from a 16 or 24-bit file with the floats they were
+// written from, in steps of the last bit. The input is clipped as the writer clips it.
+static void s_quantization_error(const std::vector<float>& input, const std::vector<uint8_t>& data, int bits, double& err_rms, double& err_max)
+{
+	size_t bytes = (size_t)(bits / 8);
+	size_t count = data.size() / bytes;
+	double scale = (double)((1 << (bits - 1)) - 1);
+	double sum = 0.0;
+	err_max = count == input.size() ? 0.0 : HUGE_VAL;
+	for (size_t i = 0; i < count && i < input.size(); i++)
+	{
+		const uint8_t* b = data.data() + i * bytes;
+		int32_t v;
+		if (bits == 16)
+			v = (int16_t)(b[0] | (b[1] << 8));
+		else
+			v = (int32_t)((uint32_t)b[0] << 8 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 24) >> 8;
+		double x = (double)input[i] * scale;
+		x = x < -scale - 1.0 ? -scale - 1.0 : (x > scale ? scale : x);
+		double e = fabs((double)v - x);
+		sum += e * e;
+		if (e > err_max) err_max = e;
+	}
+	err_rms = count > 0 ? sqrt(sum / (double)count) : 0.0;
+}
+
+// Decodes a file into interleaved stereo frames, none when it can't be read
+static void s_decode(const char* fileName, std::vector<float>& frames)
+{
+	TrackBuffer* track = ReadAudioFromFile(fileName);
+	frames.clear();
+	if (track == nullptr) return;
+	frames.resize((size_t)track->NumberOfSamples() * 2);
+	track->GetSamples(0, track->NumberOfSamples(), frames.data());
+	delete track;
+}
+
+// Signal to noise ratio in dB of count samples of b against the same samples of a
+static double s_snr(const float* a, const float* b, size_t count)
+{
+	double signal = 0.0;
+	double noise = 0.0;
+	for (size_t i = 0; i < count; i++)
+	{
+		double d = (double)b[i] - (double)a[i];
+		signal += (double)a[i] * (double)a[i];
+		noise += d * d;
+	}
+	return noise > 0.0 ? 10.0 * log10(signal / noise) : HUGE_VAL;
+}
+
+// Exporting a long scratch to MP3: rendered into a whole output track then encoded,
+// as done before, and streamed from the sampler into the encoder.
+void bench_export()
+{
+	static const unsigned rate_out = 44100;
+
+	ExportScratch scratch;
+	SamplerScratch& sampler = *scratch.m_sampler;
+
+	printf("\nexporting %.0f s to MP3\n", sampler.get_duration());
+
+	TrackBuffer buf_out(rate_out);
+	double t0 = time_sec();
+	SampleToTrackBuffer(sampler, buf_out);
+	WriteAudioToFile(&buf_out, "export_track.mp3");
+	double t1 = time_sec();
+
+	ExportStats stats;
+	AudioEncoder* encoder = AudioEncoder::s_open("export_stream.mp3", rate_out);
+	bool ok = encoder != nullptr && ExportAudio(sampler, rate_out, encoder, &stats);
+	delete encoder;
+	double t2 = time_sec();
+
+	TrackBuffer* decoded = ok ? ReadAudioFromFile("export_stream.mp3") : nullptr;
+	printf("through a track %.3f s, streamed %.3f s (render %.3f s, encode %.3f s, %u waits on the encoder)\n",
+		t1 - t0, t2 - t1, stats.render_time, stats.write_time, stats.render_waits);
+	printf("streamed %llu frames, %u decoded back\n", (unsigned long long)stats.frames, decoded != nullptr ? decoded->NumberOfSamples() : 0);
+
+	// The same stream into a float file, read back and compared with the track frame
+	// for frame; the track is padded with silence up to a whole block.
+	std::vector<uint8_t> streamed;
+	PcmFileWriter* raw = PcmFileWriter::s_open("export_stream.raw", rate_out, 32, false);
+	bool same = raw != nullptr && ExportAudio(sampler, rate_out, raw) && s_read_pcm("export_stream.raw", false, streamed);
+	delete raw;
+	size_t num_frames = streamed.size() / (sizeof(float) * 2);
+	same = same && num_frames == stats.frames && buf_out.NumberOfSamples() >= num_frames;
+	if (same)
+	{
+		std::vector<float> rendered((size_t)buf_out.NumberOfSamples() * 2);
+		buf_out.GetSamples(0, buf_out.NumberOfSamples(), rendered.data());
+		same = memcmp(rendered.data(), streamed.data(), streamed.size()) == 0;
+		for (size_t i = num_frames * 2; same && i < rendered.size(); i++)
+			same = rendered[i] == 0.0f;
+	}
+	printf("streamed frames read back %s the track from SampleToTrackBuffer\n", same ? "same as" : "DIFFERENT from");
+	remove("export_stream.raw");
+
+	delete decoded;
+}
+
+// The same export to each format, from the slowest encoder to plain file writes.
+void bench_export_formats()
+{
+	static const unsigned rate_out = 44100;
+	struct Target
+	{
+		const char* fileName;
+		int bits;
+		bool dither;
+	};
+	static const Target targets[] = { { "export.mp3", 0, true }, { "export.flac", 16, true }, { "export.flac", 24, true },
+		{ "export.wav", 32, true }, { "export.wav", 24, true }, { "export.wav", 24, false }, { "export.wav", 16, true },
+		{ "export.wav", 16, false }, { "export.raw", 32, true } };
+
+	ExportScratch scratch;
+	SamplerScratch& sampler = *scratch.m_sampler;
+
+	// the input of every file, to compare the WAV and raw files with when read back
+	CaptureWriter input;
+	ExportAudio(sampler, rate_out, &input);
+
+	printf("\nexport formats (%.0f s)\n", sampler.get_duration());
+	printf("file         bits  dither  wall     render   write    read back\n");
+	for (int k = 0; k < (int)(sizeof(targets) / sizeof(Target)); k++)
+	{
+		ExportOptions options;
+		options.format = ExportFormatFromName(targets[k].fileName);
+		options.bits = targets[k].bits;
+		options.dither = targets[k].dither;
+		AudioWriter* writer = CreateAudioWriter(targets[k].fileName, rate_out, options);
+		if (writer == nullptr) continue;
+		ExportStats stats;
+		bool ok = ExportAudio(sampler, rate_out, writer, &stats);
+		delete writer;
+
+		// Floats are written as they are. Rounding to the nearest step is off by half a
+		// step at most, 0.289 rms; the TPDF dither adds up to one more step, 0.5 rms.
+		char check[64] = "";
+		bool pcm = options.format == Export_WAV || options.format == Export_Raw;
+		std::vector<uint8_t> data;
+		if (pcm && !s_read_pcm(targets[k].fileName, options.format == Export_WAV, data))
+		{
+			snprintf(check, sizeof(check), "UNREADABLE");
+		}
+		else if (pcm && targets[k].bits == 32)
+		{
+			bool same = data.size() == input.m_frames.size() * sizeof(float) && memcmp(data.data(), input.m_frames.data(), data.size()) == 0;
+			snprintf(check, sizeof(check), "%s", same ? "same floats" : "DIFFERENT floats");
+		}
+		else if (pcm)
+		{
+			double err_rms, err_max;
+			s_quantization_error(input.m_frames, data, targets[k].bits, err_rms, err_max);
+			double limit = targets[k].dither ? 1.5 : 0.5;
+			snprintf(check, sizeof(check), "%.3f LSB rms, %.3f max%s", err_rms, err_max, err_max <= limit + 0.01 ? "" : "  OFF");
+		}
+		printf("%-12s %4d  %-6s  %.3f s  %.3f s  %.3f s  %s%s\n", targets[k].fileName, targets[k].bits, targets[k].dither ? "yes" : "no",
+			stats.wall_time, stats.render_time, stats.write_time, check, ok ? "" : "  FAILED");
+	}
+}
+
+// A 48 kHz WAV master with MP3s at three bit rates for 44.1 kHz: rendered once per
+// file, then rendered once into all four at the same time.
+void bench_export_fanout()
+{
+	static const unsigned rate_master = 48000;
+	static const unsigned rate_mp3 = 44100;
+	static const int bit_rates[] = { 320000, 192000, 128000 };
+	static const char* mp3_names[] = { "fanout_320.mp3", "fanout_192.mp3", "fanout_128.mp3" };
+	static const char* single_names[] = { "single_320.mp3", "single_192.mp3", "single_128.mp3" };
+
+	// The MP3s of the fan-out are resampled from the master rather than rendered at
+	// their rate, and encoded again: they have to stay well above this against the
+	// ones exported alone, where a block lost or repeated would bring them near 0 dB.
+	static const double min_snr = 20.0;
+
+	ExportScratch scratch;
+	SamplerScratch& sampler = *scratch.m_sampler;
+
+	printf("\nexport fan-out (%.0f s, WAV master and 3 MP3s)\n", sampler.get_duration());
+
+	ExportOptions wav_options;
+	wav_options.format = Export_WAV;
+	wav_options.bits = 24;
+
+	double render_time = 0.0;
+	double t0 = time_sec();
+	{
+		ExportStats stats;
+		AudioWriter* writer = CreateAudioWriter("single_master.wav", rate_master, wav_options);
+		if (writer != nullptr) ExportAudio(sampler, rate_master, writer, &stats);
+		delete writer;
+		render_time += stats.render_time;
+		for (int k = 0; k < 3; k++)
+		{
+			AudioEncoder* encoder = AudioEncoder::s_open(single_names[k], rate_mp3, bit_rates[k]);
+			if (encoder != nullptr) ExportAudio(sampler, rate_mp3, encoder, &stats);
+			delete encoder;
+			render_time += stats.render_time;
+		}
+	}
+	double t1 = time_sec();
+
+	ExportStats stats;
+	AudioWriter* master = CreateAudioWriter("fanout_master.wav", rate_master, wav_options);
+	AudioEncoder* encoders[3];
+	ExportJob job(sampler, rate_master);
+	if (master != nullptr) job.add(master);
+	for (int k = 0; k < 3; k++)
+	{
+		encoders[k] = AudioEncoder::s_open(mp3_names[k], rate_mp3, bit_rates[k]);
+		if (encoders[k] != nullptr) job.add(encoders[k], rate_mp3);
+	}
+	bool ok = job.run(&stats);
+	double t2 = time_sec();
+	for (int k = 0; k < 3; k++)
+		delete encoders[k];
+	delete master;
+
+	printf("one file at a time %.3f s (render %.3f s), all at once %.3f s (render %.3f s, slowest writer %.3f s)%s\n",
+		t1 - t0, render_time, t2 - t1, stats.render_time, stats.write_time, ok ? "" : "  FAILED");
+
+	// the files of the fan-out read back against the ones exported alone
+	std::vector<uint8_t> master_data, single_data;
+	bool same = s_read_pcm("fanout_master.wav", true, master_data) && s_read_pcm("single_master.wav", true, single_data) && master_data == single_data;
+	printf("fanout_master.wav: %s the master exported alone\n", same ? "same as" : "DIFFERENT from");
+	for (int k = 0; k < 3; k++)
+	{
+		std::vector<float> fanout, alone;
+		s_decode(mp3_names[k], fanout);
+		s_decode(single_names[k], alone);
+		size_t count = fanout.size() < alone.size() ? fanout.size() : alone.size();
+		double snr = s_snr(alone.data(), fanout.data(), count);
+		bool ok_k = count > 0 && fanout.size() == alone.size() && snr >= min_snr;
+		printf("%s: %zu frames, %zu alone, %.1f dB SNR against it%s\n", mp3_names[k], fanout.size() / 2, alone.size() / 2, snr,
+			ok_k ? "" : "  MISMATCH");
+	}
+}
+
+// A long mix encoded to MP3 by one encoder and in segments on 2, 4 and all cores, each
+// decoded back and compared with the serial encode around every seam between segments.
+void bench_parallel_mp3()
+{
+	static const int thread_counts[] = { 1, 2, 4, 0 };
+
+	// Segments hold 384 MP3 frames of 1152; the seams are compared over four MP3
+	// frames on each side, which covers the encoder delay.
+	static const size_t segment_frames = 384 * 1152;
+	static const size_t seam_frames = 4 * 1152;
+
+	// Both encodes lose a little to the codec and the serial one keeps its bit
+	// reservoir, so they don't match exactly. A gap or a frame repeated at a seam
+	// would bring it near 0 dB.
+	static const double min_snr = 20.0;
+
+	TrackBuffer* src = make_test_track(44100, 2, 600.0f);
+	printf("\nencoding %u s to MP3 on several threads\n", src->NumberOfSamples() / src->Rate());
+
+	std::vector<float> serial;
+	for (int k = 0; k < (int)(sizeof(thread_counts) / sizeof(int)); k++)
+	{
+		double t0 = time_sec();
+		WriteAudioToFile(src, "parallel.mp3", 192000, thread_counts[k]);
+		double t1 = time_sec();
+
+		std::vector<float> decoded;
+		s_decode("parallel.mp3", decoded);
+		printf("%d threads: %.3f s, %zu of %u frames decoded back", thread_counts[k], t1 - t0, decoded.size() / 2, src->NumberOfSamples());
+		if (thread_counts[k] == 1)
+		{
+			serial.swap(decoded);
+			printf("\n");
+			continue;
+		}
+
+		bool same_length = !serial.empty() && decoded.size() == serial.size();
+		double snr_min = HUGE_VAL;
+		unsigned num_seams = 0;
+		size_t num_frames = serial.size() / 2;
+		for (size_t seam = segment_frames; same_length && seam + seam_frames <= num_frames; seam += segment_frames, num_seams++)
+		{
+			size_t start = (seam - seam_frames) * 2;
+			double snr = s_snr(serial.data() + start, decoded.data() + start, seam_frames * 4);
+			if (snr < snr_min) snr_min = snr;
+		}
+		double snr_all = same_length ? s_snr(serial.data(), decoded.data(), serial.size()) : 0.0;
+		bool ok = same_length && snr_min >= min_snr;
+		printf(", %.1f dB SNR against one encoder, %.1f dB at the worst of %u seams%s\n", snr_all, snr_min, num_seams, ok ? "" : "  MISMATCH");
+	}
+
+	delete src;
+}
@@ -0,0 +1,73 @@
+#include "TrackBuffer.h"
+#include "SamplerScratch.h"
+#include "GestureRecorder.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+TrackBuffer* make_test_track(unsigned rate, unsigned chn, float duration);
+
+inline double gesture_time_sec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A 10 s scratch sampled at 1 kHz like a mouse drag: the record played on with
+// back-and-forth strokes of varying speed, and half a millisecond of jitter.
+static void s_make_gesture(std::vector<float>& t, std::vector<float>& pos)
+{
+	static const double s_pi = 3.141592653589793;
+	uint32_t seed = 12345;
+	for (int j = 0; j <= 10000; j++)
+	{
+		double x = (double)j * 0.001;
+		double y = 0.5 * x + 0.15 * sin(2.0 * s_pi * 1.5 * x) * (1.0 + 0.5 * sin(2.0 * s_pi * 0.2 * x));
+		seed = seed * 1664525u + 1013904223u;
+		double jitter = ((double)(seed >> 8) / 16777216.0 - 0.5) * 0.001;
+		t.push_back((float)x);
+		pos.push_back((float)(y + 1.0 + jitter));
+	}
+}
+
+// Records the gesture, applies it to a sampler and checks the time map against
+// every raw sample: the fitted curve has to stay within the tolerance of all of them.
+void bench_gesture()
+{
+	static const float s_tolerance = 0.002f;
+
+	std::vector<float> t, pos;
+	s_make_gesture(t, pos);
+
+	GestureRecorder recorder(s_tolerance);
+	double t0 = gesture_time_sec();
+	recorder.begin();
+	for (size_t j = 0; j < t.size(); j++)
+		recorder.add_sample(t[j], pos[j]);
+	recorder.end();
+	double t1 = gesture_time_sec();
+
+	TrackBuffer* src = make_test_track(44100, 2, 20.0f);
+	SamplerScratch sampler(src);
+	double t2 = gesture_time_sec();
+	recorder.apply(&sampler);
+	double t3 = gesture_time_sec();
+
+	float max_error = 0.0f;
+	for (size_t j = 0; j < t.size(); j++)
+	{
+		float y, slope;
+		sampler.time_map(t[j], y, slope);
+		max_error = std::max(max_error, fabsf(y - pos[j]));
+	}
+
+	printf("\ngesture (%zu samples, tolerance %.1f ms)\n", recorder.num_samples(), s_tolerance * 1000.0f);
+	printf("points  record      apply       max error\n");
+	printf("%6zu  %7.2f ms  %7.2f ms  %7.3f ms%s\n", recorder.num_points(), (t1 - t0) * 1000.0, (t3 - t2) * 1000.0,
+		max_error * 1000.0f, max_error > s_tolerance + 1e-5f ? "  MISMATCH" : "");
+
+	delete src;
+}
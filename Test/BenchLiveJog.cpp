@@ -0,0 +1,190 @@
+#include "TrackBuffer.h"
+#include "SamplerScratch.h"
+#include "PlaybackStream.h"
+#include "LiveJog.h"
+
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+TrackBuffer* make_test_track(unsigned rate, unsigned chn, float duration);
+
+// Listens for the platter starting to move: the first frame differing from the one
+// before it, once armed. It is heard a period after being pulled, see NullAudioSink.
+class MotionProbe : public NullAudioSink
+{
+public:
+	MotionProbe(unsigned sample_rate, int period) : NullAudioSink(sample_rate, period), m_armed(0), m_latency(-1) {}
+
+	void arm(uint64_t event_time)
+	{
+		m_latency = -1;
+		m_armed = event_time;
+	}
+
+	// microseconds from the event to hearing it, -1 while not heard yet
+	int64_t latency() const { return m_latency; }
+
+protected:
+	virtual void _consume(const float* buf, int count)
+	{
+		uint64_t event_time = m_armed;
+		for (int k = 0; k < count; k++)
+		{
+			float l = buf[k * 2];
+			if (event_time != 0 && fabsf(l - m_last) > 0.001f)
+			{
+				uint64_t heard = LiveJog::s_now() + (uint64_t)(period() + k) * 1000000 / sample_rate();
+				m_latency = (int64_t)(heard - event_time);
+				m_armed = 0;
+				event_time = 0;
+			}
+			m_last = l;
+		}
+	}
+
+private:
+	std::atomic<uint64_t> m_armed;
+	std::atomic<int64_t> m_latency;
+	float m_last = 0.0f;
+};
+
+static double s_scratch_motion(double t)
+{
+	// the record pushed back and forth twice a second around 1 s
+	return 1.0 + 0.1 * sin(2.0 * 3.141592653589793 * 2.0 * t);
+}
+
+static void s_write_events(const char* filename)
+{
+	FILE* fp = fopen(filename, "w");
+	if (fp == nullptr) return;
+	fprintf(fp, "# time kind value\n");
+	fprintf(fp, "0.000 engage %f\n", s_scratch_motion(0.0));
+	for (int j = 1; j <= 500; j++)
+	{
+		double t = (double)j * 0.002;
+		fprintf(fp, "%.3f position %f\n", t, s_scratch_motion(t));
+	}
+	fprintf(fp, "1.000 velocity 1.0\n");
+	fprintf(fp, "1.200 release\n");
+	fclose(fp);
+}
+
+// Replays an event file in real time and follows the live position against the motion
+// recorded in it, where the frames being rendered are heard.
+static void s_replay(LiveJog& jog, PlaybackStream& stream, const std::vector<LiveJog::Event>& events, double& err_rms, double& err_max)
+{
+	std::atomic<bool> done(false);
+	uint64_t t0 = LiveJog::s_now() + 10000;
+	std::thread player([&]()
+	{
+		for (size_t j = 0; j < events.size(); j++)
+		{
+			LiveJog::Event e = events[j];
+			e.time += t0;
+			int64_t wait = (int64_t)e.time - (int64_t)LiveJog::s_now();
+			if (wait > 0) std::this_thread::sleep_for(std::chrono::microseconds(wait));
+			jog.push(e);
+		}
+		done = true;
+	});
+
+	double sum = 0.0;
+	int num = 0;
+	err_max = 0.0;
+	while (!done)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		double t = ((double)LiveJog::s_now() - (double)t0 + (double)stream.latency()) / 1000000.0;
+		// the held part, after the engage has settled
+		if (t < 0.1 || t > 0.95 || !jog.engaged()) continue;
+		double err = fabs(jog.position() - s_scratch_motion(t)) * 1000.0;
+		sum += err * err;
+		num++;
+		if (err > err_max) err_max = err;
+	}
+	player.join();
+	err_rms = num > 0 ? sqrt(sum / (double)num) : 0.0;
+}
+
+// Time from a platter event to hearing it, through the whole render-ahead path
+// into a simulated device, then a replayed scratch from an event file.
+void bench_live_jog()
+{
+	static const unsigned rate_out = 48000;
+	static const int latencies[] = { 5, 10, 20 };
+	static const int num_trials = 20;
+
+	TrackBuffer* src = make_test_track(44100, 2, 20.0f);
+	SamplerScratch sampler(src);
+	sampler.add_control_point(4.0f, 4.0f);
+	LiveJog jog(&sampler, &sampler);
+
+	printf("\nlive jog, platter event to sound (%d trials each)\n", num_trials);
+	printf("target  period    mean      max  underruns\n");
+	for (int k = 0; k < (int)(sizeof(latencies) / sizeof(int)); k++)
+	{
+		int buffer_frames = latencies[k] * (int)rate_out / 1000;
+		MotionProbe sink(rate_out, buffer_frames / 2);
+		PlaybackStream stream(&jog, &sink, 0, buffer_frames, 16384, RenderAhead::Priority_Normal);
+		sink.start(&stream);
+
+		double sum = 0.0;
+		int64_t max_latency = 0;
+		int num = 0;
+		for (int j = 0; j < num_trials; j++)
+		{
+			// hold the record still, then let it go at normal speed
+			jog.push(LiveJog::Event_Engage, 2.0 + 0.01 * (double)j);
+			std::this_thread::sleep_for(std::chrono::milliseconds(60));
+			uint64_t t = LiveJog::s_now();
+			sink.arm(t);
+			LiveJog::Event e = { t, LiveJog::Event_Velocity, 1.0 };
+			jog.push(e);
+			for (int w = 0; w < 500 && sink.latency() < 0; w++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			jog.push(LiveJog::Event_Release, 0.0);
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+			int64_t latency = sink.latency();
+			if (latency < 0) continue;
+			sum += (double)latency;
+			if (latency > max_latency) max_latency = latency;
+			num++;
+		}
+		sink.stop();
+		printf("%3d ms  %6d  %4.1f ms  %4.1f ms  %9u\n", latencies[k], buffer_frames / 2,
+			num > 0 ? sum / (double)num / 1000.0 : 0.0, (double)max_latency / 1000.0, sink.num_underruns() + stream.num_underruns());
+	}
+
+	s_write_events("jog_events.txt");
+	std::vector<LiveJog::Event> events;
+	if (!LiveJog::s_read_events("jog_events.txt", events))
+	{
+		printf("could not read jog_events.txt\n");
+		delete src;
+		return;
+	}
+
+	printf("replayed scratch from jog_events.txt (%d events, 5 ms target)\n", (int)events.size());
+	static const double predictions[] = { 0.0, 0.005 };
+	for (int k = 0; k < 2; k++)
+	{
+		int buffer_frames = 5 * (int)rate_out / 1000;
+		NullAudioSink sink(rate_out, buffer_frames / 2);
+		PlaybackStream stream(&jog, &sink, 0, buffer_frames, 16384, RenderAhead::Priority_Normal);
+		jog.set_prediction(predictions[k]);
+		sink.start(&stream);
+		double err_rms, err_max;
+		s_replay(jog, stream, events, err_rms, err_max);
+		sink.stop();
+		printf("prediction %.0f ms: tracking error %.2f ms rms, %.2f ms max\n", predictions[k] * 1000.0, err_rms, err_max);
+	}
+	jog.set_prediction(0.0);
+
+	delete src;
+}
@@ -0,0 +1,86 @@
+#include "TrackBuffer.h"
+#include "SamplerScratch.h"
+#include "PlaybackStream.h"
+
+#include <cstdio>
+#include <cmath>
+#include <memory.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+TrackBuffer* make_test_track(unsigned rate, unsigned chn, float duration);
+
+inline double time_sec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Playback without sound hardware: into a simulated device for each latency
+// target, then as fast as possible into a WAV file that must match a direct render.
+void bench_playback()
+{
+	static const unsigned rate_out = 48000;
+	static const int latencies[] = { 5, 10, 20, 50 };
+	static const double play_time = 1.0;
+
+	TrackBuffer* src = make_test_track(44100, 2, 20.0f);
+	SamplerScratch sampler(src);
+	sampler.set_start_slope(0.8f);
+	sampler.add_control_point(4.0f, 2.0f);
+	sampler.add_control_point(6.0f, 1.0f);
+	sampler.add_control_point(10.0f, 9.0f);
+	sampler.set_sample_rate(rate_out);
+
+	printf("\nplayback into a null device (%.1f s each)\n", play_time);
+	printf("target  period  callbacks  mean cb   max cb  max wake  late  ring underruns  latency\n");
+	for (int k = 0; k < (int)(sizeof(latencies) / sizeof(int)); k++)
+	{
+		// as the player does it: the device buffer holds the target, in two periods
+		int buffer_frames = latencies[k] * (int)rate_out / 1000;
+		int period = buffer_frames / 2;
+
+		NullAudioSink sink(rate_out, period);
+		PlaybackStream stream(&sampler, &sink, 0, buffer_frames, 16384, RenderAhead::Priority_Normal);
+		sink.start(&stream);
+		std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(play_time * 1000000.0)));
+		sink.stop();
+
+		NullAudioSink::Stats stats = sink.stats();
+		printf("%3d ms  %6d  %9llu  %5.0f us  %5llu us  %5llu us  %4u  %14u  %5.1f ms\n", latencies[k], period,
+			(unsigned long long)stats.callbacks, (double)stats.total_callback / (double)stats.callbacks,
+			(unsigned long long)stats.max_callback, (unsigned long long)stats.max_wake_delay,
+			sink.num_underruns(), stream.num_underruns(), (double)stream.latency() / 1000.0);
+	}
+
+	int num_frames = (int)ceil(sampler.get_duration() * (double)rate_out);
+	std::vector<float> ref(num_frames * 2);
+	num_frames = sampler.get_samples(0, num_frames, ref.data());
+
+	double t0 = time_sec();
+	{
+		WavAudioSink sink("playback.wav", rate_out);
+		PlaybackStream stream(&sampler, &sink, 0, 4096, 16384, RenderAhead::Priority_Normal);
+		stream.set_lossless(true);
+		sink.start(&stream);
+		while (!sink.idle())
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double t1 = time_sec();
+
+	// 44 bytes of header, then the frames, padded to whole periods
+	std::vector<float> out(num_frames * 2);
+	FILE* fp = fopen("playback.wav", "rb");
+	size_t num_read = 0;
+	if (fp != nullptr)
+	{
+		fseek(fp, 44, SEEK_SET);
+		num_read = fread(out.data(), sizeof(float) * 2, num_frames, fp);
+		fclose(fp);
+	}
+	bool same = num_read == (size_t)num_frames && memcmp(out.data(), ref.data(), sizeof(float) * num_frames * 2) == 0;
+	printf("offline into playback.wav: %.2f s of audio in %.3f s, %s the direct render\n",
+		(double)num_frames / (double)rate_out, t1 - t0, same ? "same as" : "DIFFERENT from");
+
+	delete src;
+}
@@ -0,0 +1,292 @@
+#include "TrackBuffer.h"
+#include "SamplerScratch.h"
+#include "AudioReadWrite.h"
+#include "CHSpline.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+inline double time_sec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// two sines, also used by the other checks
+TrackBuffer* make_test_track(unsigned rate, unsigned chn, float duration)
+{
+	TrackBuffer* track = new TrackBuffer(rate, chn);
+	NoteBuffer buf;
+	buf.m_sampleRate = (float)rate;
+	buf.m_channelNum = track->NumberOfChannels();
+	buf.m_sampleNum = (unsigned)(duration * (float)rate);
+	buf.m_cursorDelta = (float)buf.m_sampleNum;
+	buf.Allocate();
+	for (unsigned i = 0; i < buf.m_sampleNum; i++)
+	{
+		buf.m_data[i * buf.m_channelNum] = 0.5f * sinf((float)i * 0.031f);
+		if (buf.m_channelNum == 2) buf.m_data[i * 2 + 1] = 0.5f * sinf((float)i * 0.017f);
+	}
+	track->WriteBlend(buf);
+	return track;
+}
+
+// Per-frame evaluation as done before the block kernels, for comparison.
+// The BGM is taken from bgm_premix, the whole BGM converted to the output rate at once.
+static bool s_reference_sample(SamplerScratch& sampler, unsigned rate_out, const std::vector<float>& bgm_premix, int i, float& l, float& r)
+{
+	TrackBuffer* buffer = sampler.buffer();
+	double rate_in = (double)buffer->Rate();
+	l = 0.0f;
+	r = 0.0f;
+	float t_out = (float)i / (float)rate_out;
+	if (t_out >= sampler.get_duration()) return false;
+
+	float t_in, changing_rate;
+	sampler.time_map(t_out, t_in, changing_rate);
+	double pos = t_in * rate_in;
+	double step = fabs(changing_rate * rate_in / (double)rate_out);
+	if (pos < 0.0 || pos >= (double)buffer->NumberOfSamples()) return true;
+
+	float a[2], b[2];
+	if (step <= 1.0)
+	{
+		uint32_t u_pos = (uint32_t)(pos);
+		double frac = pos - (double)u_pos;
+		buffer->Sample(u_pos, a);
+		buffer->Sample(u_pos + 1, b);
+		if (buffer->NumberOfChannels() == 1)
+		{
+			a[1] = a[0];
+			b[1] = b[0];
+		}
+		l = a[0] * (1.0 - frac) + b[0] * frac;
+		r = a[1] * (1.0 - frac) + b[1] * frac;
+	}
+	else
+	{
+		int i_pos = (int)ceil(pos - step);
+		double sum_w = 0.0;
+		double sum_l = 0.0;
+		double sum_r = 0.0;
+		while ((double)i_pos < pos + step)
+		{
+			double w = step - fabs((double)i_pos - pos);
+			sum_w += w;
+			if (i_pos >= 0)
+			{
+				buffer->Sample(i_pos, a);
+				if (buffer->NumberOfChannels() == 1) a[1] = a[0];
+				sum_l += w * a[0];
+				sum_r += w * a[1];
+			}
+			i_pos++;
+		}
+		l = sum_l / sum_w;
+		r = sum_r / sum_w;
+	}
+
+	float amp;
+	sampler.volume(t_out, amp);
+	l *= amp;
+	r *= amp;
+
+	if (sampler.bgm() != nullptr && (size_t)i * 2 < bgm_premix.size())
+	{
+		l += bgm_premix[i * 2] * sampler.bgm_volume();
+		r += bgm_premix[i * 2 + 1] * sampler.bgm_volume();
+	}
+	return true;
+}
+
+void bench_render_kernels()
+{
+	static const unsigned rate_out = 48000;
+	static const float duration = 20.0f;
+
+	TrackBuffer* bgm = make_test_track(44100, 2, duration + 5.0f);
+	std::vector<float> bgm_premix;
+	if (!ResampleToBuffer(bgm, rate_out, bgm_premix))
+		printf("BGM conversion failed\n");
+
+	printf("\nrender kernels (%.0f s at %u Hz)\n", duration, rate_out);
+	printf("chn  filter  bgm  volume    reference     kernel   speed-up\n");
+
+	for (unsigned chn = 1; chn <= 2; chn++)
+	{
+		// long enough for the fast variants to stay inside the source
+		TrackBuffer* src = make_test_track(44100, chn, duration * 4.0f);
+		for (int filter = 0; filter < 2; filter++)
+		{
+			for (int has_bgm = 0; has_bgm < 2; has_bgm++)
+			{
+				for (int automation = 0; automation < 2; automation++)
+				{
+					// constant speed: below 1 selects interpolation, above 1 the filter
+					float speed = filter ? 3.0f : 0.8f;
+					SamplerScratch sampler(src);
+					sampler.set_start_slope(speed);
+					sampler.add_control_point(duration, duration * speed);
+					sampler.set_control_point_slope(0, speed);
+					if (automation)
+					{
+						for (int j = 1; j < 40; j++)
+							sampler.add_volume_control_point((float)j * duration / 40.0f, (j % 2) ? 0.3f : 1.0f);
+					}
+					if (has_bgm)
+					{
+						sampler.set_bgm(bgm);
+						sampler.set_bgm_volume(0.5f);
+					}
+					sampler.set_sample_rate(rate_out);
+
+					int num_frames = (int)(duration * (float)rate_out);
+					std::vector<float> ref(num_frames * 2);
+					std::vector<float> out(num_frames * 2);
+
+					double t0 = time_sec();
+					int i = 0;
+					for (; i < num_frames; i++)
+					{
+						if (!s_reference_sample(sampler, rate_out, bgm_premix, i, ref[i * 2], ref[i * 2 + 1])) break;
+					}
+					double t1 = time_sec();
+					int n = sampler.get_samples(0, num_frames, out.data());
+					double t2 = time_sec();
+
+					float max_diff = 0.0f;
+					for (int k = 0; k < n * 2 && k < i * 2; k++)
+					{
+						float diff = fabsf(ref[k] - out[k]);
+						if (diff > max_diff) max_diff = diff;
+					}
+
+					printf("%3u  %6s  %3s  %6s  %9.2f ms  %6.2f ms  %7.2fx%s\n", chn, filter ? "tri" : "linear", has_bgm ? "yes" : "no", automation ? "auto" : "const",
+						(t1 - t0)*1000.0, (t2 - t1)*1000.0, (t1 - t0) / (t2 - t1), (n != i || max_diff > 1e-5f) ? "  MISMATCH" : "");
+				}
+			}
+		}
+		delete src;
+	}
+
+	delete bgm;
+}
+
+// Edits to one control point of a long baked map, each followed by a block rendered
+// near it as playback would, against the same edits rendered without baking.
+void bench_bake_edits()
+{
+	static const unsigned rate_out = 48000;
+	static const int num_edits = 50;
+
+	TrackBuffer* src = make_test_track(44100, 2, 120.0f);
+	SamplerScratch baked(src);
+	SamplerScratch exact(src);
+	for (int j = 0; j < 400; j++)
+	{
+		float x = 0.2f + 0.25f * (float)j;
+		float y = (j & 1) ? x - 0.05f : x + 0.05f;
+		baked.add_control_point(x, y);
+		exact.add_control_point(x, y);
+	}
+	baked.set_sample_rate(rate_out);
+	exact.set_sample_rate(rate_out);
+	baked.set_control_rate_baking(0.25f);
+
+	std::vector<float> block(1024 * 2);
+	baked.get_samples(0, 1024, block.data());
+	double t0 = time_sec();
+	for (int e = 0; e < num_edits; e++)
+	{
+		baked.move_control_point(200, 50.0f + 0.001f * (float)e);
+		exact.move_control_point(200, 50.0f + 0.001f * (float)e);
+		baked.get_samples((int)(50.0f * (float)rate_out), 1024, block.data());
+	}
+	double t1 = time_sec();
+
+	int num_frames = (int)(baked.get_duration() * (double)rate_out);
+	std::vector<float> a(num_frames * 2);
+	std::vector<float> b(num_frames * 2);
+	int n_a = baked.get_samples(0, num_frames, a.data());
+	int n_b = exact.get_samples(0, num_frames, b.data());
+	float max_diff = 0.0f;
+	for (int k = 0; k < n_a * 2 && k < n_b * 2; k++)
+		max_diff = std::max(max_diff, fabsf(a[k] - b[k]));
+
+	printf("\nbaked map, %d edits each followed by a render: %.2f ms, max difference to unbaked %.4f%s\n",
+		num_edits, (t1 - t0) * 1000.0, max_diff, (n_a != n_b || max_diff > 0.05f) ? "  MISMATCH" : "");
+
+	delete src;
+}
+
+// Single-point edits of a long map while two threads keep rendering, as the
+// SamplerCached and RenderAhead threads do during playback. Each edit copies the
+// parameter snapshot, the chunks of the map are shared instead of copied, and the
+// replaced snapshots have to be freed while readers are registered all the time.
+void bench_snapshot_edits()
+{
+	static const unsigned rate_out = 48000;
+	static const int num_points = 100000;
+	static const int num_edits = 100000;
+	static const int num_copies = 1000;
+
+	TrackBuffer* src = make_test_track(44100, 2, 60.0f);
+	SamplerScratch sampler(src);
+	std::vector<float> x(num_points), y(num_points), slope(num_points, 1.0f);
+	for (int j = 0; j < num_points; j++)
+	{
+		x[j] = 0.2f + 0.0005f * (float)j;
+		y[j] = x[j];
+	}
+	sampler.set_control_points(num_points, x.data(), y.data(), slope.data());
+	sampler.set_sample_rate(rate_out);
+
+	std::atomic<bool> quit(false);
+	std::atomic<uint64_t> num_blocks(0);
+	auto render = [&](int start)
+	{
+		std::vector<float> block(1024 * 2);
+		for (int i = start; !quit; i = (i + 1024) % (rate_out * 40))
+		{
+			sampler.get_samples(i, 1024, block.data());
+			num_blocks++;
+		}
+	};
+	std::thread t0(render, 0);
+	std::thread t1(render, rate_out * 20);
+
+	size_t max_retired = 0;
+	double start = time_sec();
+	for (int e = 0; e < num_edits; e++)
+	{
+		int j = (int)(((uint64_t)e * 7919) % num_points);
+		sampler.move_control_point(j, y[j] + 0.0001f * (float)(e & 7));
+		if ((e & 1023) == 0) max_retired = std::max(max_retired, sampler.num_retired());
+	}
+	double stop = time_sec();
+	quit = true;
+	t0.join();
+	t1.join();
+
+	// what each edit cost when the whole map was copied
+	std::vector<CHSpline::Sample> flat(num_points + 1);
+	double copy_start = time_sec();
+	for (int c = 0; c < num_copies; c++)
+	{
+		std::vector<CHSpline::Sample> copy(flat);
+		flat[c % flat.size()].y = copy[(c * 31) % copy.size()].y + 1.0f;
+	}
+	double copy_time = (time_sec() - copy_start) / (double)num_copies * (double)num_edits;
+
+	printf("\n%d edits of a %d point map during rendering (%llu blocks): %.2f s, copying the map each time: %.1f s\n",
+		num_edits, num_points, (unsigned long long)num_blocks.load(), stop - start, copy_time);
+	printf("replaced snapshots waiting to be freed: at most %zu, %zu at the end%s\n",
+		max_retired, sampler.num_retired(), max_retired > (size_t)num_edits / 10 ? "  NOT RECLAIMED" : "");
+
+	delete src;
+}
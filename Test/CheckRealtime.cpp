@@ -0,0 +1,70 @@
+#include "TrackBuffer.h"
+#include "SamplerScratch.h"
+#include "SamplerCached.h"
+#include "SourcePrefetcher.h"
+#include "PlaybackStream.h"
+#include "RTCheck.h"
+
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+TrackBuffer* make_test_track(unsigned rate, unsigned chn, float duration);
+
+// Plays the same chain as the UI - SamplerScratch, SourcePrefetcher, SamplerCached
+// and a PlaybackStream - into a simulated device, while the time map is being
+// edited, and reports what the real-time sections did that they should not.
+void check_realtime()
+{
+	static const unsigned rate_out = 48000;
+	static const int callback_frames = 480;
+	static const int num_callbacks = 400;
+
+	printf("\nreal-time safety (%d callbacks of %d frames, edits running)\n", num_callbacks, callback_frames);
+	if (!RTCheck::enabled())
+	{
+		RTCheck::report(stdout);
+		return;
+	}
+
+	TrackBuffer* src = make_test_track(44100, 2, 30.0f);
+	SamplerScratch* sampler = new SamplerScratch(src);
+	sampler->set_control_rate_baking(0.05f);
+	for (int j = 1; j <= 20; j++)
+		sampler->add_control_point((float)j * 0.5f, (float)((j % 4) + 1) * 2.0f);
+	sampler->set_sample_rate(rate_out);
+
+	SourcePrefetcher* prefetcher = new SourcePrefetcher(sampler);
+	SamplerCached* cached = new SamplerCached(sampler);
+	cached->set_prefetcher(prefetcher);
+
+	RTCheck::reset();
+	NullAudioSink sink(rate_out, callback_frames);
+	PlaybackStream* stream = new PlaybackStream(cached, &sink, 0, callback_frames * 2, 4096, RenderAhead::Priority_Normal, true);
+	sink.start(stream);
+
+	// scrubbing the control points under the playback, at about the rate of mouse moves
+	int edit = 0;
+	while (sink.stats().callbacks < (uint64_t)num_callbacks)
+	{
+		int j = edit % 20;
+		sampler->move_control_point(j, (float)((edit % 7) + 1) * 2.0f);
+		edit++;
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	sink.stop();
+	unsigned underruns = stream->num_underruns();
+	delete stream;
+
+	RTCheck::report(stdout);
+	RTCheck::Stats stats = RTCheck::stats();
+	printf("%s, %d edits, %u underruns\n", stats.allocations + stats.frees + stats.locks + stats.io == 0 ? "real-time safe" : "NOT real-time safe",
+		edit, underruns);
+
+	delete cached;
+	delete prefetcher;
+	delete sampler;
+	delete src;
+}
@@ -6,11 +6,57 @@
 
 
 #include <cmath>
+#include <cstring>
 #define PI 3.141592653589792
 
-int main()
+void bench_render_kernels();
+void bench_bake_edits();
+void bench_snapshot_edits();
+void bench_gesture();
+void check_realtime();
+void bench_playback();
+void bench_live_jog();
+void bench_decode_append();
+void bench_parallel_decode(const char* fileName);
+void bench_lazy_decode(const char* fileName);
+void bench_async_decode(const char* fileName);
+void bench_audio_cache(const char* fileName);
+void bench_export();
+void bench_export_formats();
+void bench_export_fanout();
+void bench_parallel_mp3();
+
+static bool s_selected(int argc, char* argv[], const char* name)
 {
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], name) == 0 || strcmp(argv[i], "all") == 0) return true;
+	}
+	return false;
+}
+
+// Benchmarks run only when named on the command line, "all" runs every one of them.
+int main(int argc, char* argv[])
+{
+	if (s_selected(argc, argv, "render")) bench_render_kernels();
+	if (s_selected(argc, argv, "bake")) bench_bake_edits();
+	if (s_selected(argc, argv, "snapshot")) bench_snapshot_edits();
+	if (s_selected(argc, argv, "gesture")) bench_gesture();
+	if (s_selected(argc, argv, "realtime")) check_realtime();
+	if (s_selected(argc, argv, "playback")) bench_playback();
+	if (s_selected(argc, argv, "jog")) bench_live_jog();
+	if (s_selected(argc, argv, "append")) bench_decode_append();
+	if (s_selected(argc, argv, "parallel_decode")) bench_parallel_decode("scratch10.mp3");
+	if (s_selected(argc, argv, "lazy_decode")) bench_lazy_decode("scratch10.mp3");
+	if (s_selected(argc, argv, "async_decode")) bench_async_decode("scratch10.mp3");
+	if (s_selected(argc, argv, "cache")) bench_audio_cache("scratch10.mp3");
+	if (s_selected(argc, argv, "export")) bench_export();
+	if (s_selected(argc, argv, "formats")) bench_export_formats();
+	if (s_selected(argc, argv, "fanout")) bench_export_fanout();
+	if (s_selected(argc, argv, "parallel_mp3")) bench_parallel_mp3();
+
 	TrackBuffer* buf_in = ReadAudioFromFile("scratch10.mp3");
+	if (buf_in == nullptr) return 0;
 
 	SamplerScratch* sampler = new SamplerScratch(buf_in);
 	sampler->set_start_pos(0.1f);